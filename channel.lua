@@ -1,126 +1,31 @@
 -- SPDX-License-Identifier: MIT
 -- Author: Jianhui Zhao <zhaojh329@gmail.com>
 
-local sync = require 'eco.sync'
+local eco = require 'eco'
 
 --- Coroutine channel.
 --
 -- A channel provides a mechanism for communication between coroutines by
 -- sending and receiving values.
 --
--- - If the channel buffer is full, @{channel:send} blocks until a receiver
+-- - If the channel buffer is full, `channel:send` blocks until a receiver
 --   consumes an item (or `timeout` expires).
--- - If the channel buffer is empty, @{channel:recv} blocks until a sender
+-- - If the channel buffer is empty, `channel:recv` blocks until a sender
 --   provides an item (or `timeout` expires).
--- - After @{channel:close}, receivers can still drain buffered items, but
+-- - After `channel:close`, receivers can still drain buffered items, but
 --   sending will raise an error.
 --
+-- Channels are implemented natively (see `eco.channel` in the @{eco} module
+-- for the methods): values are kept in a fixed size ring buffer and
+-- handed directly to a parked peer, with no allocation per message.
+-- `channel:send_many` and `channel:recv_many` move batches in a single call.
+--
 -- All timeouts are expressed in seconds.
 --
 -- @module eco.channel
 
 local M = {}
 
---- Channel object returned by @{channel.new}.
--- @type channel
-local methods = {}
-
---- Get the number of buffered items.
--- @function channel:length
--- @treturn integer Number of buffered values.
-function methods:length()
-    return #self.buf
-end
-
---- Close the channel.
---
--- This is idempotent.
---
--- After closing, @{channel:recv} returns `nil` once the buffer is drained.
--- @{channel:send} will raise an error.
--- Any coroutine blocked in @{channel:recv} or @{channel:send} is awakened.
---
--- @function channel:close
-function methods:close()
-    if self.closed then
-        return
-    end
-
-    self.closed = true
-    self.cond_recv:broadcast()
-    self.cond_send:broadcast()
-end
-
---- Send a value to the channel.
---
--- @function channel:send
--- @tparam any v Value to send.
--- @tparam[opt] number timeout Timeout in seconds.
--- @treturn boolean true On success.
--- @treturn[2] nil On timeout.
--- @treturn[2] string Error message (`'timeout'`).
---- @raise If the channel is closed.
-function methods:send(v, timeout)
-    assert(not self.closed, 'sending on closed channel')
-
-    local buf = self.buf
-
-    while #buf >= self.capacity do
-        local ok, err = self.cond_send:wait(timeout)
-        if not ok then
-            return nil, err
-        end
-
-        assert(not self.closed, 'sending on closed channel')
-    end
-
-    buf[#buf + 1] = v
-
-    self.cond_recv:signal()
-
-    return true
-end
-
---- Receive a value from the channel.
---
--- If the channel is closed and the buffer is empty, returns `nil`.
--- On timeout, returns `nil, 'timeout'`.
---
--- @function channel:recv
--- @tparam[opt] number timeout Timeout in seconds.
--- @treturn any v Received value.
--- @treturn[2] nil On closed (and buffer drained) or timeout.
--- @treturn[2] string Error message (`'timeout'`) on timeout.
-function methods:recv(timeout)
-    local buf = self.buf
-
-    while #buf < 1 do
-        if self.closed then
-            return nil
-        end
-
-        local ok, err = self.cond_recv:wait(timeout)
-        if not ok then
-            return nil, err
-        end
-    end
-
-    local v = buf[1]
-
-    table.remove(buf,  1)
-
-    self.cond_send:signal()
-
-    return v
-end
-
---- End of `channel` class section.
--- @section end
-
-local metatable = {
-    __index = methods
-}
-
 --- Create a channel.
 --
 -- If `capacity` is not provided or is less than 1, it defaults to 1.
@@ -140,15 +45,25 @@ function M.new(capacity)
         capacity = 1
     end
 
-    local ch = {
-        cond_send = sync.cond(),
-        cond_recv = sync.cond(),
-        capacity = capacity,
-        closed = false,
-        buf = {}
-    }
+    return eco.channel(capacity)
+end
 
-    return setmetatable(ch, metatable)
+--- Receive from the first ready channel of a list.
+--
+-- Channels are checked in list order. A closed and drained channel is
+-- ready and yields `nil`.
+--
+-- @function select
+-- @tparam {channel,...} channels Channels to receive from.
+-- @tparam[opt] number timeout Timeout in seconds.
+-- @treturn integer Index of the channel in the list.
+-- @treturn any The value received.
+-- @treturn[2] nil On timeout.
+-- @treturn[2] string Error message (`'timeout'`).
+-- @usage
+-- local i, v = channel.select({ ch1, ch2 }, 1.0)
+function M.select(channels, timeout)
+    return eco.select(channels, timeout)
 end
 
 return M
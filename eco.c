@@ -51,7 +51,11 @@
 #define _GNU_SOURCE
 
 #include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/epoll.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -59,6 +63,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -66,60 +71,138 @@
 #include <signal.h>
 
 #include "config.h"
+#include "uring.h"
 #include "eco.h"
 #include "list.h"
 
-static char eco_scheduler_key;
+static char eco_sched_key;
 static char eco_co_key;
-static char eco_ready_key;
+static char eco_co_pool_key;
+#ifdef ECO_IO_URING
+static char eco_uring_op_key;
+#endif
 
 static volatile sig_atomic_t got_sigint;
 static volatile sig_atomic_t got_sigchld;
 
-#define MAX_EVENTS 128
+#define EVENTS_INIT_SIZE 128
+#define EVENTS_MAX_SIZE 1024
+#define EVENTS_MAX_LIMIT 65536
+#define BUSY_POLL_MAX 1000000
 #define MAX_TIMER_CACHE 32
+#define TIMER_HEAP_INIT_SIZE 64
+#define READY_QUEUE_INIT_SIZE 64
 #define RD_BUFSIZE 4096
-#define FD_HASH_BUCKETS 256
-#define IO_FAIRNESS_DURATION 300
+#define RD_BUFSIZE_MIN 512
+#define RD_BUFSIZE_MAX (64 * 1024)
+#define WRITEV_MAX_IOV 1024
+#define FD_TABLE_INIT_SIZE 256
+#define FD_SLAB_SIZE 64
+#define IO_FAIRNESS_OPS 1024
 #define CO_RUN_TIMEOUT 5000
+#define URING_ENTRIES 256
+#define SPLICE_CHUNK_SIZE (64 * 1024)
 
 #define ECO_IO_MT "struct eco_io *"
 #define ECO_READER_MT "struct eco_reader *"
 #define ECO_WRITER_MT "struct eco_writer *"
+#define ECO_SPLICE_MT "struct eco_splice *"
+#define ECO_BUFFER_MT "struct eco_buffer *"
+#define ECO_WAITQ_MT "struct eco_waitq *"
+#define ECO_CHANNEL_MT "struct eco_channel *"
 
 struct eco_scheduler {
     struct list_head timer_cache;
-    struct list_head timers;
-    struct list_head fds[FD_HASH_BUCKETS];
+    struct eco_fd **fds;        /* indexed by fd */
+    size_t fds_cap;
+    struct list_head fd_free;   /* unused eco_fd objects carved from slabs */
+    struct list_head fd_slabs;
+    struct eco_timer **timers; /* binary min-heap ordered by (at, seq) */
+    size_t timer_count;
+    size_t timer_cap;
+    uint64_t timer_seq;
     size_t timer_cache_size;
     int panic_hook;
     int sigchld_hook;
     int epoll_fd;
+    struct epoll_event *events; /* event batch, doubles when it fills up */
+    int nevents;
+    int max_events;
+    uint32_t busy_poll;         /* spin window in us before blocking, 0 = disabled */
+    uint32_t epoll_gen;         /* bumped whenever epoll_fd is recreated */
+#ifdef ECO_IO_URING
+    struct eco_uring *uring;    /* NULL when running on epoll */
+    struct eco_uring_poll **uring_done; /* sized like events */
+    int uring_ndone;
+    struct list_head uring_polls;   /* requests in flight, freed with the scheduler */
+#endif
     pid_t pid;
-    uint32_t nfd;
+    uint32_t nfd;               /* fds waited on, io_uring requests in flight included */
     uint16_t co_run_timeout;
+    uint32_t co_pool_size;
+    uint32_t co_pool_count;
+    uint64_t co_pool_hits;
+    uint64_t co_pool_misses;
     uint64_t resumed_at;
-    int64_t ready_head;
-    int64_t ready_tail;
+    uint32_t io_budget;         /* I/O ops left before a fairness yield, see eco_io_fairness() */
+    uint64_t loop_time; /* cached monotonic time in ms, see eco_update_time() */
+    lua_State **ready;  /* ring buffer of runnable coroutines, capacity is a power of 2 */
+    size_t ready_cap;
+    size_t ready_head;
+    size_t ready_count;
+    struct list_head flush_list;    /* buffered writers to flush before the next wait */
+    unsigned edge_triggered:1;
+    unsigned worker:1;          /* runs in an eco.threads thread, see threads.c */
     unsigned quit:1;
 };
 
 struct eco_timer {
-    struct list_head list;
+    struct list_head list;  /* link in timer_cache while unused */
     uint64_t at;
+    uint64_t seq;           /* keeps FIFO order for timers with the same deadline */
+    size_t idx;             /* position in the scheduler's timer heap */
     lua_State *co;
+    bool allocated;         /* from eco_timer_alloc, not embedded in an object */
 };
 
 struct eco_fd {
-    struct list_head list;
+    struct list_head list;  /* link in fd_free while unused */
     struct eco_io *read_io;
     struct eco_io *write_io;
+#ifdef ECO_IO_URING
+    struct eco_uring_poll *poll;    /* armed one-shot poll request */
+#endif
     int refcount;
     unsigned events:3;
+    unsigned readable:1;    /* edge-triggered: an edge was seen since the last EAGAIN */
+    unsigned writable:1;
+#ifdef ECO_IO_URING
+    unsigned no_uring_op:1; /* not a socket: wait for readiness instead */
+#endif
+    uint32_t et_gen;        /* epoll generation of the EPOLLET registration, 0 = none */
     int fd;
 };
 
+#ifdef ECO_IO_URING
+/* A pending poll request holds a reference to its eco_fd until it completes. */
+struct eco_uring_poll {
+    struct list_head list;
+    struct eco_fd *efd;
+};
+
+/*
+ * A socket recv, send or accept submitted instead of waiting for
+ * readiness. Its user_data is tagged with ECO_URING_OP_TAG.
+ */
+struct eco_uring_op {
+    int res;
+    unsigned pending:1;     /* submitted, the kernel may still use the buffer */
+    unsigned done:1;        /* completed, res not consumed yet */
+};
+#endif
+
 struct eco_io {
+    struct eco_scheduler *sched;
     struct eco_fd *efd;
     struct eco_timer timer;
     unsigned is_timeout:1;
@@ -127,19 +210,21 @@ struct eco_io {
     unsigned is_ready:1;
     unsigned fairness_yield:1;
     unsigned eof:1;
+    unsigned flush_armed:1;     /* writer waiting for EPOLLOUT to flush its buffer, no coroutine */
+    unsigned unpolled:1;        /* never polled, waits for reader:notify */
     double timeout;
     lua_State *co;
+    struct eco_waiter *waiter;  /* parked in eco.select */
+#ifdef ECO_IO_URING
+    struct eco_uring_op op;
+#endif
 };
 
-static inline struct list_head *eco_fd_bucket(struct eco_scheduler *sched, int fd)
-{
-    return &sched->fds[(uint32_t)fd & (FD_HASH_BUCKETS - 1)];
-}
-
 struct eco_reader {
     struct eco_io io;
     luaL_Buffer b;
     char mode;
+    struct eco_buffer *into;    /* read_into target, anchored on the caller's stack */
     union {
         size_t expected;
         struct {
@@ -151,7 +236,10 @@ struct eco_reader {
     int (*read)(void *buf, size_t len, void *ctx, char **err);
     void *ctx;
     size_t len;
-    char buf[RD_BUFSIZE];
+    char *buf;
+    size_t buf_size;
+    size_t buf_max;     /* buf doubles up to this while reads keep filling it */
+    bool filled;        /* the last read filled the whole buffer */
 };
 
 struct eco_writer {
@@ -160,6 +248,7 @@ struct eco_writer {
         struct {
             const char *data;
             int ref;
+            struct eco_buffer_store *store; /* data is in an eco.buffer */
         } data;
         struct {
             off_t offset;
@@ -168,8 +257,55 @@ struct eco_writer {
     };
     size_t total;
     size_t written;
+    struct iovec *iov;  /* writev: pending buffers, kept across calls */
+    int iov_idx;
+    int iovcnt;
+    int iov_cap;
+    int iov_first;      /* stack index of the first string or buffer */
+    char *buf;          /* userspace write buffer, see writer:setbuf */
+    size_t buf_len;
+    size_t buf_size;
+    struct list_head flush_node;
+    unsigned auto_flush:1;
+    unsigned flush_queued:1;
+    unsigned buf_iov:1; /* iov[0] of the pending writev is the write buffer */
     int (*write)(const void *buf, size_t len, void *ctx, char **err);
     void *ctx;
+#ifdef ECO_IO_URING
+    struct msghdr msg;  /* writev submitted as sendmsg */
+#endif
+};
+
+struct eco_park;
+
+/* One link of a parked coroutine: a wait queue entry or an I/O object */
+struct eco_waiter {
+    struct list_head node;
+    struct eco_park *park;
+    struct eco_io *io;  /* eco.select: waiting for the io to become readable */
+    int index;          /* position in the eco.select list, 1 otherwise */
+    int ref;            /* channel sender: the value to hand over */
+    bool queued;
+};
+
+/*
+ * A coroutine parked on one or more wait sources (waitq, channel, io),
+ * anchored on its own stack. The first source to complete the wait
+ * unlinks all the others.
+ */
+struct eco_park {
+    struct eco_timer timer;
+    lua_State *co;
+    int ref;            /* value handed over by the waker */
+    int index;          /* waiter that completed the wait, 0 = none yet */
+    int timer_index;    /* eco.select: list item fired by the timer */
+    lua_Integer pos;    /* channel:send_many progress */
+    lua_Integer count;
+    uint64_t deadline;
+    unsigned has_timeout:1;
+    unsigned closed:1;  /* completed by closing the source */
+    int nwaiters;
+    struct eco_waiter waiters[];
 };
 
 static inline void eco_fd_ref(struct eco_fd *efd)
@@ -177,13 +313,19 @@ static inline void eco_fd_ref(struct eco_fd *efd)
     efd->refcount++;
 }
 
-static void eco_fd_put(struct eco_fd *efd)
+static void eco_fd_put(struct eco_scheduler *sched, struct eco_fd *efd)
 {
     efd->refcount--;
 
     if (efd->refcount == 0) {
-        list_del(&efd->list);
-        free(efd);
+        if (efd->et_gen == sched->epoll_gen)
+            epoll_ctl(sched->epoll_fd, EPOLL_CTL_DEL, efd->fd, NULL);
+
+        /* The table may have been reset by eco._init() in the meantime */
+        if ((size_t)efd->fd < sched->fds_cap && sched->fds[efd->fd] == efd)
+            sched->fds[efd->fd] = NULL;
+
+        list_add(&efd->list, &sched->fd_free);
     }
 }
 
@@ -194,17 +336,31 @@ static uint64_t eco_time_now()
     return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static struct eco_scheduler *get_eco_scheduler(lua_State *L)
+static uint64_t eco_time_now_us()
 {
-    struct eco_scheduler *sched;
-
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_scheduler_key);
-
-    sched = (struct eco_scheduler *)lua_topointer(L, -1);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-    lua_pop(L, 1);
+/*
+ * Like libuv, timers are based on a cached loop time. It is refreshed after
+ * each epoll_wait and whenever the clock is sampled anyway (by the watchdog).
+ */
+static inline uint64_t eco_update_time(struct eco_scheduler *sched)
+{
+    sched->loop_time = eco_time_now();
+    return sched->loop_time;
+}
 
-    return sched;
+/*
+ * Every function registered by luaopen_eco carries the scheduler as its
+ * first upvalue. I/O objects cache it in struct eco_io, so hot paths never
+ * need a registry lookup.
+ */
+static inline struct eco_scheduler *get_eco_scheduler(lua_State *L)
+{
+    return lua_touserdata(L, lua_upvalueindex(1));
 }
 
 static void eco_log_traceback(struct eco_scheduler *sched, lua_State *L,
@@ -224,17 +380,81 @@ static void eco_log_traceback(struct eco_scheduler *sched, lua_State *L,
     }
 }
 
-static void eco_resume_direct(lua_State *L, lua_State *co, int narg)
+/* Reset a finished coroutine and keep it for reuse by eco.run. */
+static bool eco_co_pool_put(struct eco_scheduler *sched, lua_State *L, lua_State *co)
+{
+    bool ok = false;
+
+    if (sched->co_pool_count >= sched->co_pool_size)
+        return false;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_co_pool_key);
+
+    /* Only coroutines created by eco.run are anchored in eco_co_key */
+    get_obj(L, &eco_co_key, co);
+    if (lua_tothread(L, -1) != co)
+        goto done;
+
+#if LUA_VERSION_RELEASE_NUM >= 50406
+    if (lua_closethread(co, L) != LUA_OK)
+        goto done;
+#else
+    if (lua_resetthread(co) != LUA_OK)
+        goto done;
+#endif
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, ++sched->co_pool_count);
+    ok = true;
+
+done:
+    lua_pop(L, 2);
+    return ok;
+}
+
+/* Push a pooled coroutine, or a new one if the pool is empty. */
+static lua_State *eco_co_pool_get(struct eco_scheduler *sched, lua_State *L)
+{
+    lua_State *co;
+
+    if (sched->co_pool_count == 0) {
+        if (sched->co_pool_size > 0)
+            sched->co_pool_misses++;
+        return lua_newthread(L);
+    }
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_co_pool_key);
+    lua_rawgeti(L, -1, sched->co_pool_count);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, sched->co_pool_count--);
+    lua_remove(L, -2);
+
+    co = lua_tothread(L, -1);
+
+    sched->co_pool_hits++;
+
+    return co;
+}
+
+static void eco_resume_direct(struct eco_scheduler *sched, lua_State *L, lua_State *co, int narg)
 {
-    struct eco_scheduler *sched = get_eco_scheduler(L);
     uint64_t duration;
     int nres, status;
 
-    sched->resumed_at = eco_time_now();
+    /* Only the watchdog needs a precise time */
+    if (sched->co_run_timeout > 0)
+        sched->resumed_at = eco_update_time(sched);
+    else
+        sched->resumed_at = sched->loop_time;
+
+    sched->io_budget = IO_FAIRNESS_OPS;
 
     status = lua_resume(co, L, narg, &nres);
 
-    duration = eco_time_now() - sched->resumed_at;
+    if (sched->co_run_timeout > 0)
+        duration = eco_update_time(sched) - sched->resumed_at;
+    else
+        duration = 0;
 
     if (sched->co_run_timeout > 0 && duration > sched->co_run_timeout) {
         lua_pushfstring(co,
@@ -246,6 +466,7 @@ static void eco_resume_direct(lua_State *L, lua_State *co, int narg)
 
     switch (status) {
     case LUA_OK: /* dead */
+        eco_co_pool_put(sched, L, co);
         set_obj(L, &eco_co_key, 0, co);
         break;
 
@@ -258,56 +479,170 @@ static void eco_resume_direct(lua_State *L, lua_State *co, int narg)
     }
 }
 
+static int eco_ready_grow(struct eco_scheduler *sched)
+{
+    size_t cap = sched->ready_cap ? sched->ready_cap * 2 : READY_QUEUE_INIT_SIZE;
+    lua_State **ready;
+    size_t i;
+
+    ready = malloc(cap * sizeof(lua_State *));
+    if (!ready)
+        return -1;
+
+    for (i = 0; i < sched->ready_count; i++)
+        ready[i] = sched->ready[(sched->ready_head + i) & (sched->ready_cap - 1)];
+
+    free(sched->ready);
+
+    sched->ready = ready;
+    sched->ready_cap = cap;
+    sched->ready_head = 0;
+
+    return 0;
+}
+
+/*
+ * Queue a coroutine for resumption. The queue only holds raw pointers,
+ * the coroutine itself is kept alive by its anchor in eco_co_key.
+ */
 static void eco_ready(lua_State *L, lua_State *co, struct eco_scheduler *sched)
 {
-    if (!sched)
-        sched = get_eco_scheduler(L);
+    size_t tail;
 
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_ready_key);
-    lua_pushlightuserdata(L, co);
-    lua_rawseti(L, -2, ++sched->ready_tail);
+    if (sched->ready_count == sched->ready_cap && eco_ready_grow(sched) < 0)
+        luaL_error(L, "failed to grow ready queue");
 
-    lua_pop(L, 1);
+    tail = (sched->ready_head + sched->ready_count) & (sched->ready_cap - 1);
+
+    sched->ready[tail] = co;
+    sched->ready_count++;
+}
+
+static inline bool eco_timer_before(const struct eco_timer *a, const struct eco_timer *b)
+{
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void eco_timer_heap_set(struct eco_scheduler *sched, size_t idx, struct eco_timer *timer)
+{
+    sched->timers[idx] = timer;
+    timer->idx = idx;
+}
+
+static void eco_timer_heap_up(struct eco_scheduler *sched, size_t idx)
+{
+    struct eco_timer *timer = sched->timers[idx];
+
+    while (idx > 0) {
+        size_t parent = (idx - 1) / 2;
+
+        if (!eco_timer_before(timer, sched->timers[parent]))
+            break;
+
+        eco_timer_heap_set(sched, idx, sched->timers[parent]);
+        idx = parent;
+    }
+
+    eco_timer_heap_set(sched, idx, timer);
+}
 
-    if (sched->ready_head == 0)
-        sched->ready_head = sched->ready_tail;
+static void eco_timer_heap_down(struct eco_scheduler *sched, size_t idx)
+{
+    struct eco_timer *timer = sched->timers[idx];
+    size_t count = sched->timer_count;
+
+    while (1) {
+        size_t child = idx * 2 + 1;
+
+        if (child >= count)
+            break;
+
+        if (child + 1 < count && eco_timer_before(sched->timers[child + 1], sched->timers[child]))
+            child++;
+
+        if (!eco_timer_before(sched->timers[child], timer))
+            break;
+
+        eco_timer_heap_set(sched, idx, sched->timers[child]);
+        idx = child;
+    }
+
+    eco_timer_heap_set(sched, idx, timer);
+}
+
+static int eco_timer_heap_reserve(struct eco_scheduler *sched)
+{
+    struct eco_timer **timers;
+    size_t cap;
+
+    if (sched->timer_count < sched->timer_cap)
+        return 0;
+
+    cap = sched->timer_cap ? sched->timer_cap * 2 : TIMER_HEAP_INIT_SIZE;
+
+    timers = realloc(sched->timers, cap * sizeof(struct eco_timer *));
+    if (!timers)
+        return -1;
+
+    sched->timers = timers;
+    sched->timer_cap = cap;
+
+    return 0;
+}
+
+static inline struct eco_timer *eco_timer_first(struct eco_scheduler *sched)
+{
+    return sched->timer_count ? sched->timers[0] : NULL;
 }
 
-static void eco_timer_stop(struct eco_timer *timer)
+static void eco_timer_stop(struct eco_scheduler *sched, struct eco_timer *timer)
 {
+    size_t idx = timer->idx;
+    struct eco_timer *last;
+
     if (!timer->at)
         return;
 
     timer->at = 0;
     timer->co = NULL;
 
-    list_del(&timer->list);
+    /* Timers armed before eco._init() no longer belong to the heap. */
+    if (idx >= sched->timer_count || sched->timers[idx] != timer)
+        return;
+
+    last = sched->timers[--sched->timer_count];
+    if (last == timer)
+        return;
+
+    eco_timer_heap_set(sched, idx, last);
+
+    if (idx > 0 && eco_timer_before(last, sched->timers[(idx - 1) / 2]))
+        eco_timer_heap_up(sched, idx);
+    else
+        eco_timer_heap_down(sched, idx);
 }
 
-static void eco_timer_start(struct eco_scheduler *sched, lua_State *L,
+static int eco_timer_start(struct eco_scheduler *sched, lua_State *L,
             struct eco_timer *timer, double seconds)
 {
     const double max_seconds = UINT64_MAX / 1000.0;
-    struct list_head *h = &sched->timers;
-    struct eco_timer *pos;
 
-    eco_timer_stop(timer);
+    eco_timer_stop(sched, timer);
+
+    if (eco_timer_heap_reserve(sched) < 0)
+        return -1;
 
     if (seconds > max_seconds)
         seconds = max_seconds;
 
-    timer->at = eco_time_now() + (uint64_t)(seconds * 1000);
-
-    list_for_each_entry(pos, &sched->timers, list) {
-        if (pos->at > timer->at) {
-            h = &pos->list;
-            break;
-        }
-    }
+    timer->at = sched->loop_time + (uint64_t)(seconds * 1000);
+    timer->seq = sched->timer_seq++;
+    timer->co = L;
 
-    list_add_tail(&timer->list, h);
+    sched->timers[sched->timer_count] = timer;
+    eco_timer_heap_up(sched, sched->timer_count++);
 
-    timer->co = L;
+    return 0;
 }
 
 static struct eco_timer *eco_timer_alloc(struct eco_scheduler *sched)
@@ -326,13 +661,14 @@ static struct eco_timer *eco_timer_alloc(struct eco_scheduler *sched)
 
     timer->at = 0;
     timer->co = NULL;
+    timer->allocated = true;
 
     return timer;
 }
 
 static void eco_timer_free(struct eco_scheduler *sched, struct eco_timer *timer)
 {
-    eco_timer_stop(timer);
+    eco_timer_stop(sched, timer);
 
     if (sched->timer_cache_size < MAX_TIMER_CACHE) {
         list_add_tail(&timer->list, &sched->timer_cache);
@@ -420,13 +756,139 @@ static inline void eco_io_check_busy(lua_State *L, struct eco_io *io, int events
         luaL_error(L, "another coroutine is already waiting for write on this file descriptor");
 }
 
+#ifdef ECO_IO_URING
+#define ECO_URING_OP_TAG 1
+
+static inline void *eco_io_op_data(struct eco_io *io)
+{
+    return (void *)((uintptr_t)&io->op | ECO_URING_OP_TAG);
+}
+
+/*
+ * Submitted right away: a request parked on a socket is canceled inline,
+ * so nothing that happens to the socket afterwards can complete it.
+ */
+static void eco_io_op_cancel(struct eco_io *io)
+{
+    struct eco_uring *r = io->sched->uring;
+
+    if (eco_uring_cancel(r, eco_io_op_data(io)) == 0)
+        eco_uring_wait(r, 0);
+}
+
+static int eco_uring_arm(struct eco_scheduler *sched, struct eco_fd *efd)
+{
+    struct eco_uring_poll *req = malloc(sizeof(struct eco_uring_poll));
+
+    if (!req)
+        return -1;
+
+    if (eco_uring_poll_add(sched->uring, efd->fd, efd->events | EPOLLERR | EPOLLHUP, req) < 0) {
+        free(req);
+        return -1;
+    }
+
+    list_add_tail(&req->list, &sched->uring_polls);
+    req->efd = efd;
+    efd->poll = req;
+    eco_fd_ref(efd);
+
+    return 0;
+}
+
+/*
+ * io_uring polls are one-shot: the request is replaced when the interest
+ * changes and re-armed after it fired while waiters remain.
+ */
+static int eco_fd_update_events_uring(struct eco_scheduler *sched, struct eco_fd *efd, int events)
+{
+    int old = efd->events;
+    int ret = 0;
+
+    if (events == old && (events == 0 || efd->poll))
+        return 0;
+
+    if (efd->poll) {
+        if (eco_uring_poll_remove(sched->uring, efd->poll) < 0)
+            return -1;
+        efd->poll = NULL;
+    }
+
+    efd->events = events;
+
+    if (events && eco_uring_arm(sched, efd) < 0) {
+        efd->events = 0;
+        events = 0;
+        ret = -1;
+    }
+
+    if (old == 0 && events)
+        sched->nfd++;
+    else if (old && events == 0)
+        sched->nfd--;
+
+    return ret;
+}
+#endif
+
+/*
+ * Edge-triggered registrations are made once, for both directions, and
+ * kept while the eco_fd lives, so waiters coming and going cost no
+ * epoll_ctl. They carry the fd rather than the eco_fd pointer: the
+ * registration may outlive the eco_fd if the fd was closed while another
+ * process still holds it open, and a stale event must not dereference freed
+ * memory.
+ *
+ * Level-triggered registrations carry the eco_fd pointer, which is at least
+ * 2-byte aligned and so never has the tag bit set. Every registration is
+ * written and read through data.u64: on 32-bit big-endian targets data.ptr
+ * overlays the upper half and would leave the tag bit undefined.
+ */
+#define ECO_EV_ET_TAG 1
+
+#define eco_ev_set_efd(ev, efd) ((ev)->data.u64 = (uintptr_t)(efd))
+#define eco_ev_efd(ev) ((struct eco_fd *)(uintptr_t)(ev)->data.u64)
+
+static int eco_fd_update_events_et(struct eco_scheduler *sched, struct eco_fd *efd, int events)
+{
+    if (events && efd->et_gen != sched->epoll_gen) {
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.u64 = ((uint64_t)efd->fd << 1) | ECO_EV_ET_TAG
+        };
+
+        if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_ADD, efd->fd, &ev) < 0)
+            return -1;
+
+        efd->et_gen = sched->epoll_gen;
+    }
+
+    if (efd->events == 0 && events)
+        sched->nfd++;
+    else if (efd->events && events == 0)
+        sched->nfd--;
+
+    efd->events = events;
+
+    return 0;
+}
+
 static int eco_fd_update_events(struct eco_scheduler *sched, struct eco_fd *efd)
 {
     int events = (efd->read_io ? EPOLLIN : 0) | (efd->write_io ? EPOLLOUT : 0);
-    struct epoll_event ev;
+    struct epoll_event ev = {};
     int nfd = sched->nfd;
     int op, ret;
 
+#ifdef ECO_IO_URING
+    if (sched->uring)
+        return eco_fd_update_events_uring(sched, efd, events);
+#endif
+
+    /* An fd switches mode only while nobody waits on it */
+    if (efd->et_gen == sched->epoll_gen || (sched->edge_triggered && efd->events == 0))
+        return eco_fd_update_events_et(sched, efd, events);
+
     if (events == efd->events)
         return 0;
 
@@ -441,7 +903,7 @@ static int eco_fd_update_events(struct eco_scheduler *sched, struct eco_fd *efd)
     }
 
     ev.events = events | EPOLLERR | EPOLLHUP;
-    ev.data.ptr = efd;
+    eco_ev_set_efd(&ev, efd);
 
     ret = epoll_ctl(sched->epoll_fd, op, efd->fd, &ev);
     if (ret < 0) {
@@ -460,14 +922,15 @@ static int eco_fd_update_events(struct eco_scheduler *sched, struct eco_fd *efd)
     return 0;
 }
 
-static void eco_io_detach(lua_State *L, struct eco_scheduler *sched, struct eco_io *io)
+static void eco_io_detach(struct eco_io *io)
 {
+    struct eco_scheduler *sched = io->sched;
     struct eco_fd *efd = io->efd;
 
-    if (!sched)
-        sched = get_eco_scheduler(L);
+    eco_timer_stop(sched, &io->timer);
 
-    eco_timer_stop(&io->timer);
+    if (io->unpolled)
+        return;
 
     if (efd->read_io == io)
         efd->read_io = NULL;
@@ -478,100 +941,480 @@ static void eco_io_detach(lua_State *L, struct eco_scheduler *sched, struct eco_
     eco_fd_update_events(sched, efd);
 }
 
-static void eco_io_ready(lua_State *L, struct eco_scheduler *sched, struct eco_io *io)
+static struct eco_park *eco_park_new(lua_State *L, struct eco_scheduler *sched,
+            int n, double timeout)
 {
-    if (!io->co || io->is_ready)
-        return;
+    size_t size = sizeof(struct eco_park) + n * sizeof(struct eco_waiter);
+    struct eco_park *p = lua_newuserdatauv(L, size, 0);
 
-    if (!sched)
-        sched = get_eco_scheduler(L);
+    memset(p, 0, size);
 
-    io->is_ready = true;
+    p->co = L;
+    p->ref = LUA_NOREF;
+    p->nwaiters = n;
 
-    eco_io_detach(L, sched, io);
-    eco_ready(L, io->co, sched);
+    for (int i = 0; i < n; i++) {
+        p->waiters[i].park = p;
+        p->waiters[i].index = i + 1;
+        p->waiters[i].ref = LUA_NOREF;
+    }
+
+    if (timeout > 0) {
+        if (eco_timer_start(sched, L, &p->timer, timeout) < 0)
+            luaL_error(L, "failed to start timer");
+        p->has_timeout = true;
+    }
+
+    return p;
 }
 
-static int eco_io_yieldk(lua_State *L, struct eco_io *io, int events, lua_KFunction k)
+static inline void eco_park_on(struct eco_waiter *w, struct list_head *q)
 {
-    struct eco_scheduler *sched = get_eco_scheduler(L);
-    struct eco_fd *efd = io->efd;
-
-    if (events & EPOLLIN)
-        efd->read_io = io;
+    list_add_tail(&w->node, q);
+    w->queued = true;
+}
 
-    if (events & EPOLLOUT)
-        efd->write_io = io;
+/* The timer fired, so the parked coroutine already sits in the ready queue */
+static inline bool eco_park_timed_out(struct eco_park *p)
+{
+    return p->has_timeout && !p->timer.at;
+}
 
-    if (eco_fd_update_events(sched, efd) < 0)
-        return -1;
+static void eco_park_dequeue(struct eco_park *p)
+{
+    for (int i = 0; i < p->nwaiters; i++) {
+        struct eco_waiter *w = &p->waiters[i];
+        struct eco_io *io = w->io;
 
-    io->co = L;
+        if (!w->queued)
+            continue;
 
-    if (io->timeout > 0)
-        eco_timer_start(sched, NULL, &io->timer, io->timeout);
+        w->queued = false;
 
-    return lua_yieldk(L, 0, (lua_KContext)io, k);
+        if (io) {
+            io->waiter = NULL;
+            eco_io_detach(io);
+            io->is_ready = false;
+            io->co = NULL;
+        } else {
+            list_del(&w->node);
+        }
+    }
 }
 
-static void eco_io_fairness(lua_State *L, struct eco_io *io, lua_KFunction k)
+/*
+ * Complete a parked wait through one of its waiters. A wake up of a
+ * coroutine whose timer already fired but which hasn't run yet still
+ * wins the race.
+ */
+static void eco_park_wake(lua_State *L, struct eco_scheduler *sched,
+            struct eco_waiter *w, bool closed)
 {
-    struct eco_scheduler *sched = get_eco_scheduler(L);
-
-    if (eco_time_now() - sched->resumed_at < IO_FAIRNESS_DURATION)
-        return;
+    struct eco_park *p = w->park;
 
-    io->co = L;
-    io->fairness_yield = true;
+    eco_park_dequeue(p);
 
-    eco_timer_start(sched, NULL, &io->timer, 0);
+    p->index = w->index;
+    p->closed = closed;
 
-    lua_yieldk(L, 0, (lua_KContext)io, k);
+    if (!eco_park_timed_out(p)) {
+        eco_timer_stop(sched, &p->timer);
+        eco_ready(L, p->co, sched);
+    }
 }
 
-static void eco_io_stop(lua_State *L, struct eco_io *io)
+/* Returns false if the coroutine was resumed by someone else and must keep waiting */
+static bool eco_park_finish(struct eco_scheduler *sched, struct eco_park *p)
 {
-    struct eco_scheduler *sched = get_eco_scheduler(L);
+    if (!p->index && !eco_park_timed_out(p))
+        return false;
 
-    eco_io_detach(L, sched, io);
+    eco_timer_stop(sched, &p->timer);
+    eco_park_dequeue(p);
 
-    io->is_ready = false;
-    io->co = NULL;
+    return true;
 }
 
-static struct eco_fd *eco_fd_get(lua_State *L, int fd)
+static void eco_io_ready(lua_State *L, struct eco_io *io)
 {
-    struct eco_scheduler *sched = get_eco_scheduler(L);
-    struct list_head *bucket = eco_fd_bucket(sched, fd);
-    struct eco_fd *efd;
+    if (!io->co || io->is_ready)
+        return;
 
-    list_for_each_entry(efd, bucket, list) {
-        if (efd->fd == fd) {
-            efd->refcount++;
-            return efd;
-        }
+#ifdef ECO_IO_URING
+    /* Timed out or canceled: the completion of the request resumes it */
+    if (io->op.pending) {
+        eco_timer_stop(io->sched, &io->timer);
+        eco_io_op_cancel(io);
+        return;
     }
+#endif
 
-    efd = calloc(1, sizeof(struct eco_fd));
-    if (!efd)
-        return NULL;
+    io->is_ready = true;
 
-    efd->fd = fd;
-    efd->refcount++;
+    if (io->waiter) {
+        bool canceled = io->is_canceled;
 
-    list_add_tail(&efd->list, bucket);
+        io->is_canceled = false;
+        eco_park_wake(L, io->sched, io->waiter, canceled);
+        return;
+    }
 
-    return efd;
+    eco_io_detach(io);
+    eco_ready(L, io->co, io->sched);
 }
 
-static int eco_io_init(lua_State *L, struct eco_io *io, int fd)
+static int eco_io_arm(lua_State *L, struct eco_io *io, int events)
 {
-    io->efd = eco_fd_get(L, fd);
-    if (!io->efd)
-        return luaL_error(L, "failed to allocate fd context");
+    struct eco_fd *efd = io->efd;
 
-    return 0;
-}
+    if (io->unpolled) {
+        io->co = L;
+        return 0;
+    }
+
+    if (events & EPOLLIN) {
+        efd->read_io = io;
+        efd->readable = false;
+    }
+
+    if (events & EPOLLOUT) {
+        efd->write_io = io;
+        efd->writable = false;
+    }
+
+    if (eco_fd_update_events(io->sched, efd) < 0)
+        return -1;
+
+    io->co = L;
+
+    return 0;
+}
+
+static int eco_io_yieldk(lua_State *L, struct eco_io *io, int events, lua_KFunction k)
+{
+    struct eco_scheduler *sched = io->sched;
+
+    if (eco_io_arm(L, io, events) < 0)
+        return -1;
+
+    if (io->timeout > 0 && eco_timer_start(sched, NULL, &io->timer, io->timeout) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return lua_yieldk(L, 0, (lua_KContext)io, k);
+}
+
+#ifdef ECO_IO_URING
+/*
+ * Whether a request can be submitted for io instead of waiting for
+ * readiness. The timeout is armed first, so it's never left without one.
+ */
+static bool eco_io_op_arm(struct eco_io *io)
+{
+    struct eco_scheduler *sched = io->sched;
+
+    if (!sched->uring || io->efd->no_uring_op)
+        return false;
+
+    if (io->timeout > 0 && eco_timer_start(sched, NULL, &io->timer, io->timeout) < 0)
+        return false;
+
+    return true;
+}
+
+/* The request of io was queued, wait for its completion */
+static int eco_io_op_yieldk(lua_State *L, struct eco_io *io, lua_KFunction k)
+{
+    io->op.pending = true;
+    io->co = L;
+    io->sched->nfd++;
+
+    /* The kernel uses buffers anchored on the coroutine's stack */
+    lua_pushthread(L);
+    set_obj(L, &eco_uring_op_key, -1, &io->op);
+    lua_pop(L, 1);
+
+    return lua_yieldk(L, 0, (lua_KContext)io, k);
+}
+
+static void eco_io_op_complete(lua_State *L, struct eco_io *io, int res)
+{
+    struct eco_scheduler *sched = io->sched;
+
+    io->op.pending = false;
+    sched->nfd--;
+
+    /* Nobody waits for it anymore */
+    if (!io->co) {
+        set_obj(L, &eco_uring_op_key, 0, &io->op);
+        return;
+    }
+
+    io->op.done = true;
+    io->op.res = res;
+
+    eco_timer_stop(sched, &io->timer);
+
+    io->is_ready = true;
+    eco_ready(L, io->co, sched);
+}
+
+/*
+ * Called first when resumed. A request that completed wins over a timeout
+ * or a cancel which came too late to stop it.
+ */
+static void eco_io_op_settle(lua_State *L, struct eco_io *io)
+{
+    if (!io->op.done)
+        return;
+
+    set_obj(L, &eco_uring_op_key, 0, &io->op);
+
+    if (io->op.res == -ECANCELED) {
+        io->op.done = false;
+        return;
+    }
+
+    io->is_timeout = false;
+    io->is_canceled = false;
+}
+
+static inline bool eco_io_op_done(struct eco_io *io)
+{
+    return io->op.done;
+}
+
+/* Take the result of the completed request as a syscall would return it */
+static bool eco_io_op_take(struct eco_io *io, ssize_t *res)
+{
+    if (!io->op.done)
+        return false;
+
+    io->op.done = false;
+
+    /* Not a socket, or the kernel wants us to poll: don't submit again */
+    if (io->op.res == -ENOTSOCK || io->op.res == -EAGAIN) {
+        io->efd->no_uring_op = true;
+        *res = -1;
+        errno = EAGAIN;
+        return true;
+    }
+
+    *res = io->op.res < 0 ? -1 : io->op.res;
+    if (io->op.res < 0)
+        errno = -io->op.res;
+
+    return true;
+}
+#else
+static inline void eco_io_op_settle(lua_State *L, struct eco_io *io)
+{
+}
+
+static inline bool eco_io_op_done(struct eco_io *io)
+{
+    return false;
+}
+
+static inline bool eco_io_op_take(struct eco_io *io, ssize_t *res)
+{
+    return false;
+}
+#endif
+
+/* Wait until io can be read from, or for the completion of a recv into buf */
+static int eco_io_wait_recv(lua_State *L, struct eco_io *io, void *buf, size_t len,
+            lua_KFunction k)
+{
+#ifdef ECO_IO_URING
+    if (eco_io_op_arm(io)) {
+        if (eco_uring_recv(io->sched->uring, io->efd->fd, buf, len, eco_io_op_data(io)) == 0)
+            return eco_io_op_yieldk(L, io, k);
+
+        eco_timer_stop(io->sched, &io->timer);
+    }
+#endif
+
+    return eco_io_yieldk(L, io, EPOLLIN, k);
+}
+
+/* Wait until io can be written to, or for the completion of a send of buf */
+static int eco_io_wait_send(lua_State *L, struct eco_io *io, const void *buf, size_t len,
+            lua_KFunction k)
+{
+#ifdef ECO_IO_URING
+    if (eco_io_op_arm(io)) {
+        if (eco_uring_send(io->sched->uring, io->efd->fd, buf, len, eco_io_op_data(io)) == 0)
+            return eco_io_op_yieldk(L, io, k);
+
+        eco_timer_stop(io->sched, &io->timer);
+    }
+#endif
+
+    return eco_io_yieldk(L, io, EPOLLOUT, k);
+}
+
+/*
+ * I/O that completes right away never yields. After IO_FAIRNESS_OPS such
+ * operations in one resume, let the other coroutines run.
+ */
+static void eco_io_fairness(lua_State *L, struct eco_io *io, lua_KFunction k)
+{
+    struct eco_scheduler *sched = io->sched;
+
+    if (sched->io_budget > 0) {
+        sched->io_budget--;
+        return;
+    }
+
+    if (eco_timer_start(sched, NULL, &io->timer, 0) < 0)
+        return;
+
+    io->co = L;
+    io->fairness_yield = true;
+
+    lua_yieldk(L, 0, (lua_KContext)io, k);
+}
+
+static void eco_io_stop(lua_State *L, struct eco_io *io)
+{
+#ifdef ECO_IO_URING
+    /* Unbound under a request: its buffers are about to go away */
+    if (io->op.pending)
+        eco_io_op_cancel(io);
+#endif
+
+    if (io->waiter) {
+        io->waiter->queued = false;
+        io->waiter = NULL;
+    }
+
+    eco_io_detach(io);
+
+    io->is_ready = false;
+    io->co = NULL;
+}
+
+static inline struct eco_fd *eco_fd_find(struct eco_scheduler *sched, int fd)
+{
+    return (size_t)fd < sched->fds_cap ? sched->fds[fd] : NULL;
+}
+
+/* Fds are small dense integers, so the table simply doubles to cover them. */
+static int eco_fd_table_reserve(struct eco_scheduler *sched, int fd)
+{
+    size_t cap = sched->fds_cap ? sched->fds_cap : FD_TABLE_INIT_SIZE;
+    struct eco_fd **fds;
+
+    if ((size_t)fd < sched->fds_cap)
+        return 0;
+
+    while (cap <= (size_t)fd)
+        cap *= 2;
+
+    fds = realloc(sched->fds, cap * sizeof(struct eco_fd *));
+    if (!fds)
+        return -1;
+
+    memset(fds + sched->fds_cap, 0, (cap - sched->fds_cap) * sizeof(struct eco_fd *));
+
+    sched->fds = fds;
+    sched->fds_cap = cap;
+
+    return 0;
+}
+
+struct eco_fd_slab {
+    struct list_head list;
+    struct eco_fd fds[FD_SLAB_SIZE];
+};
+
+/*
+ * eco_fd objects are carved from slabs of FD_SLAB_SIZE and recycled through
+ * fd_free. Slabs are only returned to the system with the scheduler, the
+ * number of live objects is bounded by the number of open fds.
+ */
+static struct eco_fd *eco_fd_alloc(struct eco_scheduler *sched)
+{
+    struct eco_fd *efd;
+
+    if (list_empty(&sched->fd_free)) {
+        struct eco_fd_slab *slab = malloc(sizeof(struct eco_fd_slab));
+        int i;
+
+        if (!slab)
+            return NULL;
+
+        list_add_tail(&slab->list, &sched->fd_slabs);
+
+        for (i = 0; i < FD_SLAB_SIZE; i++)
+            list_add_tail(&slab->fds[i].list, &sched->fd_free);
+    }
+
+    efd = list_first_entry(&sched->fd_free, struct eco_fd, list);
+    list_del(&efd->list);
+
+    memset(efd, 0, sizeof(struct eco_fd));
+
+    return efd;
+}
+
+/*
+ * The fd may have been closed and its number reused since it was
+ * registered, in which case the kernel dropped the registration.
+ */
+static void eco_fd_et_revalidate(struct eco_scheduler *sched, struct eco_fd *efd)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        .data.u64 = ((uint64_t)efd->fd << 1) | ECO_EV_ET_TAG
+    };
+
+    if (epoll_ctl(sched->epoll_fd, EPOLL_CTL_MOD, efd->fd, &ev) == 0)
+        return;
+
+    efd->et_gen = 0;
+    efd->readable = false;
+    efd->writable = false;
+}
+
+static struct eco_fd *eco_fd_get(struct eco_scheduler *sched, int fd)
+{
+    struct eco_fd *efd = eco_fd_find(sched, fd);
+
+    if (efd) {
+        if (efd->et_gen == sched->epoll_gen)
+            eco_fd_et_revalidate(sched, efd);
+
+        efd->refcount++;
+        return efd;
+    }
+
+    if (eco_fd_table_reserve(sched, fd) < 0)
+        return NULL;
+
+    efd = eco_fd_alloc(sched);
+    if (!efd)
+        return NULL;
+
+    efd->fd = fd;
+    efd->refcount++;
+
+    sched->fds[fd] = efd;
+
+    return efd;
+}
+
+static int eco_io_init(lua_State *L, struct eco_io *io, int fd)
+{
+    io->sched = get_eco_scheduler(L);
+    io->efd = eco_fd_get(io->sched, fd);
+    if (!io->efd)
+        return luaL_error(L, "failed to allocate fd context");
+
+    return 0;
+}
 
 static void eco_io_unbind_fd(lua_State *L, struct eco_io *io)
 {
@@ -584,7 +1427,7 @@ static void eco_io_unbind_fd(lua_State *L, struct eco_io *io)
         eco_io_stop(L, io);
 
     io->efd = NULL;
-    eco_fd_put(efd);
+    eco_fd_put(io->sched, efd);
 }
 
 static int lua_io_gc(lua_State *L)
@@ -641,7 +1484,7 @@ static void eco_process_sigchld(lua_State *L, struct eco_scheduler *sched)
     int status;
     pid_t pid;
 
-    if (!got_sigchld)
+    if (!got_sigchld || sched->worker)
         return;
 
     got_sigchld = 0;
@@ -682,83 +1525,282 @@ static int eco_set_callback_ref(lua_State *L, int idx, int *ref)
     return 0;
 }
 
-static int eco_scheduler_init(lua_State *L)
+static int eco_backend_init(struct eco_scheduler *sched)
 {
-    struct eco_scheduler *sched = calloc(1, sizeof(struct eco_scheduler));
-    int i;
+#ifdef ECO_IO_URING
+    struct eco_uring *uring = malloc(sizeof(struct eco_uring));
 
-    if (!sched)
-        return luaL_error(L, "failed to allocate scheduler");
+    sched->uring_ndone = 0;
 
-    sched->epoll_fd = epoll_create1(0);
-    if (sched->epoll_fd < 0)
-        return luaL_error(L, "failed to create epoll: %s", strerror(errno));
+    if (uring && eco_uring_init(uring, URING_ENTRIES) == 0) {
+        sched->uring = uring;
+        sched->epoll_fd = -1;
+        return 0;
+    }
 
-    sched->panic_hook = LUA_NOREF;
-    sched->sigchld_hook = LUA_NOREF;
-    sched->pid = getpid();
-    sched->quit = false;
-    sched->resumed_at = 0;
-    sched->co_run_timeout = CO_RUN_TIMEOUT;
+    /* Fall back to epoll if the kernel lacks io_uring */
+    free(uring);
+    sched->uring = NULL;
+#endif
 
-    INIT_LIST_HEAD(&sched->timer_cache);
-    INIT_LIST_HEAD(&sched->timers);
-    for (i = 0; i < FD_HASH_BUCKETS; i++)
-        INIT_LIST_HEAD(&sched->fds[i]);
+    sched->epoll_fd = epoll_create1(0);
 
-    lua_pushlightuserdata(L, sched);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_scheduler_key);
+    return sched->epoll_fd < 0 ? -1 : 0;
+}
 
-    lua_newtable(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_co_key);
+static void eco_backend_exit(struct eco_scheduler *sched)
+{
+#ifdef ECO_IO_URING
+    if (sched->uring) {
+        eco_uring_exit(sched->uring);
+        free(sched->uring);
+        sched->uring = NULL;
+    }
+#endif
 
-    lua_newtable(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_ready_key);
+    if (sched->epoll_fd >= 0)
+        close(sched->epoll_fd);
 
-    return 0;
+    sched->epoll_fd = -1;
 }
 
-static int eco_io_push_wait_error(lua_State *L, struct eco_io *io)
+static int eco_events_resize(struct eco_scheduler *sched, int n)
 {
-    const char *err = NULL;
+    struct epoll_event *events;
 
-    io->is_ready = false;
+    events = realloc(sched->events, n * sizeof(struct epoll_event));
+    if (!events)
+        return -1;
 
-    if (io->is_timeout) {
-        io->is_timeout = false;
-        err = "timeout";
-    } else if (io->is_canceled) {
-        io->is_canceled = false;
-        err = "canceled";
+    sched->events = events;
+
+#ifdef ECO_IO_URING
+    {
+        struct eco_uring_poll **done = realloc(sched->uring_done, n * sizeof(struct eco_uring_poll *));
+
+        if (!done)
+            return -1;
+
+        sched->uring_done = done;
     }
+#endif
 
-    if (!err)
-        return 0;
+    sched->nevents = n;
 
-    return push_nil_string(L, err);
+    return 0;
 }
 
-static int eco_io_waitk(lua_State *L, int status, lua_KContext ctx)
+/*
+ * A full batch means more events are probably pending, so double it for
+ * the next epoll_wait, up to max_events. On allocation failure the loop
+ * just keeps going with the current batch size.
+ */
+static void eco_events_grow(struct eco_scheduler *sched)
 {
-    struct eco_io *io = (struct eco_io *)ctx;
-    int ret;
+    int n = sched->nevents * 2;
 
-    ret = eco_io_push_wait_error(L, io);
-    if (ret) {
-        eco_io_stop(L, io);
-        return ret;
-    }
+    if (sched->nevents >= sched->max_events)
+        return;
 
-    eco_io_stop(L, io);
-    lua_pushboolean(L, true);
-    return 1;
+    if (n > sched->max_events)
+        n = sched->max_events;
+
+    eco_events_resize(sched, n);
 }
 
-static int eco_io_wait(lua_State *L, struct eco_io *io, int ev, double timeout)
+/*
+ * Runs when the state is closed. The sentinel is created before any other
+ * eco object, so it's finalized after all of them.
+ */
+static int eco_scheduler_gc(lua_State *L)
 {
-    int ret;
-
-    eco_io_check_busy(L, io, ev);
+    struct eco_scheduler **p = lua_touserdata(L, 1);
+    struct eco_scheduler *sched = *p;
+    struct eco_timer *timer, *tmp;
+    size_t i;
+
+    if (!sched)
+        return 0;
+
+    *p = NULL;
+
+    eco_backend_exit(sched);
+
+#ifdef ECO_IO_URING
+    {
+        struct eco_uring_poll *req, *ntmp;
+
+        list_for_each_entry_safe(req, ntmp, &sched->uring_polls, list)
+            free(req);
+    }
+
+    free(sched->uring_done);
+#endif
+
+    /* Sleeping coroutines never came back for their timers */
+    for (i = 0; i < sched->timer_count; i++) {
+        if (sched->timers[i]->allocated)
+            free(sched->timers[i]);
+    }
+
+    list_for_each_entry_safe(timer, tmp, &sched->timer_cache, list)
+        free(timer);
+
+    {
+        struct eco_fd_slab *slab, *stmp;
+
+        list_for_each_entry_safe(slab, stmp, &sched->fd_slabs, list)
+            free(slab);
+    }
+
+    free(sched->timers);
+    free(sched->fds);
+    free(sched->events);
+    free(sched->ready);
+    free(sched);
+
+    return 0;
+}
+
+static int eco_scheduler_init(lua_State *L)
+{
+    struct eco_scheduler *sched = calloc(1, sizeof(struct eco_scheduler));
+    struct eco_scheduler **p;
+
+    if (!sched)
+        return luaL_error(L, "failed to allocate scheduler");
+
+    sched->epoll_fd = -1;
+
+    INIT_LIST_HEAD(&sched->timer_cache);
+    INIT_LIST_HEAD(&sched->fd_free);
+    INIT_LIST_HEAD(&sched->fd_slabs);
+    INIT_LIST_HEAD(&sched->flush_list);
+#ifdef ECO_IO_URING
+    INIT_LIST_HEAD(&sched->uring_polls);
+#endif
+
+    /* Owns the scheduler from now on, errors below don't leak it */
+    p = lua_newuserdatauv(L, sizeof(struct eco_scheduler *), 0);
+    *p = sched;
+
+    lua_newtable(L);
+    lua_pushcfunction(L, eco_scheduler_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_sched_key);
+
+    if (eco_backend_init(sched) < 0)
+        return luaL_error(L, "failed to create epoll: %s", strerror(errno));
+
+    sched->max_events = EVENTS_MAX_SIZE;
+    sched->epoll_gen = 1;
+
+    if (eco_events_resize(sched, EVENTS_INIT_SIZE) < 0)
+        return luaL_error(L, "failed to allocate event batch");
+
+    sched->panic_hook = LUA_NOREF;
+    sched->sigchld_hook = LUA_NOREF;
+    sched->pid = getpid();
+    sched->worker = syscall(SYS_gettid) != sched->pid;
+    sched->quit = false;
+    sched->resumed_at = 0;
+    sched->io_budget = IO_FAIRNESS_OPS;
+    sched->co_run_timeout = CO_RUN_TIMEOUT;
+
+    eco_update_time(sched);
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_co_key);
+
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_co_pool_key);
+
+#ifdef ECO_IO_URING
+    lua_newtable(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_uring_op_key);
+#endif
+
+    /* Left on the stack to become the upvalue of the module functions */
+    lua_pushlightuserdata(L, sched);
+
+    return 0;
+}
+
+static int eco_io_push_wait_error(lua_State *L, struct eco_io *io)
+{
+    const char *err = NULL;
+
+    io->is_ready = false;
+
+    if (io->is_timeout) {
+        io->is_timeout = false;
+        err = "timeout";
+    } else if (io->is_canceled) {
+        io->is_canceled = false;
+        err = "canceled";
+    }
+
+    if (!err)
+        return 0;
+
+    return push_nil_string(L, err);
+}
+
+static int eco_io_waitk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_io *io = (struct eco_io *)ctx;
+    int ret;
+
+    ret = eco_io_push_wait_error(L, io);
+    if (ret) {
+        eco_io_stop(L, io);
+        return ret;
+    }
+
+    eco_io_stop(L, io);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+/*
+ * With an edge-triggered fd, a pending edge may already have been consumed
+ * by a caller which didn't drain the fd, so confirm readiness with poll
+ * before waiting for the next edge.
+ */
+static bool eco_io_poll_ready(struct eco_io *io, int ev)
+{
+    struct eco_fd *efd = io->efd;
+    struct pollfd pfd = {
+        .fd = efd->fd
+    };
+
+    if (efd->et_gen != io->sched->epoll_gen)
+        return false;
+
+    if ((ev & EPOLLIN) && efd->readable)
+        pfd.events |= POLLIN;
+
+    if ((ev & EPOLLOUT) && efd->writable)
+        pfd.events |= POLLOUT;
+
+    if (!pfd.events)
+        return false;
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+static int eco_io_wait(lua_State *L, struct eco_io *io, int ev, double timeout)
+{
+    int ret;
+
+    eco_io_check_busy(L, io, ev);
+
+    if (eco_io_poll_ready(io, ev)) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
 
     io->timeout = timeout;
 
@@ -810,7 +1852,7 @@ static int eco_io_cancel(lua_State *L, struct eco_io *io)
     io->fairness_yield = false;
     io->is_canceled = true;
 
-    eco_io_ready(L, NULL, io);
+    eco_io_ready(L, io);
 
     return 0;
 }
@@ -841,10 +1883,100 @@ static int lua_io_cancel(lua_State *L)
     return eco_io_cancel(L, io);
 }
 
+/* Wait until a connection can be accepted, or for the completion of an accept */
+static int eco_io_wait_accept(lua_State *L, struct eco_io *io, lua_KFunction k)
+{
+#ifdef ECO_IO_URING
+    if (eco_io_op_arm(io)) {
+        if (eco_uring_accept(io->sched->uring, io->efd->fd, NULL, NULL,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC, eco_io_op_data(io)) == 0)
+            return eco_io_op_yieldk(L, io, k);
+
+        eco_timer_stop(io->sched, &io->timer);
+    }
+#endif
+
+    return eco_io_yieldk(L, io, EPOLLIN, k);
+}
+
+static int eco_io_accept_once(lua_State *L, struct eco_io *io, lua_KFunction k,
+            bool continuation)
+{
+    ssize_t fd;
+    int ret;
+
+    if (continuation) {
+        eco_io_op_settle(L, io);
+
+        ret = eco_io_push_wait_error(L, io);
+        if (ret) {
+            eco_io_stop(L, io);
+            return ret;
+        }
+    }
+
+    while (1) {
+        if (!eco_io_op_take(io, &fd))
+            fd = accept4(io->efd->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0)
+            break;
+
+        /* The peer gave up before it was accepted, take the next one */
+        if (errno == ECONNABORTED || errno == EINTR)
+            continue;
+
+        if (errno_wouldblock()) {
+            ret = eco_io_wait_accept(L, io, k);
+            if (ret >= 0)
+                return ret;
+        }
+
+        push_errno(L, errno);
+        eco_io_stop(L, io);
+        return 2;
+    }
+
+    eco_io_stop(L, io);
+    lua_pushinteger(L, fd);
+    return 1;
+}
+
+static int lua_io_acceptk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_io *io = (struct eco_io *)ctx;
+    return eco_io_accept_once(L, io, lua_io_acceptk, true);
+}
+
+/**
+ * Accept a connection on a listening socket.
+ *
+ * Suspends the current coroutine until a connection is pending. With the
+ * io_uring backend the accept itself is submitted to the kernel. The new
+ * file descriptor is non-blocking and close-on-exec.
+ *
+ * @function io:accept
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn integer The file descriptor of the accepted connection.
+ * @treturn[2] nil On error.
+ * @treturn[2] string Error message.
+ */
+static int lua_io_accept(lua_State *L)
+{
+    struct eco_io *io = luaL_checkudata(L, 1, ECO_IO_MT);
+    double timeout = lua_tonumber(L, 2);
+
+    eco_io_check_busy(L, io, EPOLLIN);
+
+    io->timeout = timeout;
+
+    return eco_io_accept_once(L, io, lua_io_acceptk, false);
+}
+
 /// @section end
 
 static const struct luaL_Reg io_methods[] = {
     {"wait", lua_io_wait},
+    {"accept", lua_io_accept},
     {"cancel", lua_io_cancel},
     {NULL, NULL}
 };
@@ -887,91 +2019,445 @@ static int lua_eco_io(lua_State *L)
     return 1;
 }
 
-/**
- * reader object created by @{eco.reader}.
- * @type reader
- */
+/* Storage shared by a buffer and its slices */
+struct eco_buffer_store {
+    int refcount;
+    int writing;    /* pending writes of any view, see eco_buffer_pin() */
+    char data[];
+};
 
-/**
- * Wait for the underlying file descriptor to become readable.
- *
- * @function reader:wait
- * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
- * @treturn boolean true If the underlying file descriptor to become readable.
- * @treturn[2] nil On error.
- * @treturn[2] string Error message.
- */
-static int lua_reader_wait(lua_State *L)
+struct eco_buffer {
+    struct eco_buffer_store *store;
+    char *data;     /* start of this view inside store->data */
+    size_t len;
+    size_t cap;
+    bool reading;   /* a reader:read_into is filling it */
+};
+
+/* Bytes of a string or an eco.buffer argument, NULL for anything else */
+static const char *eco_tobytes(lua_State *L, int idx, size_t *len)
 {
-    struct eco_reader *rd = luaL_checkudata(L, 1, ECO_READER_MT);
-    double timeout = lua_tonumber(L, 2);
-    return eco_io_wait(L, &rd->io, EPOLLIN, timeout);
+    struct eco_buffer *b;
+
+    if (lua_type(L, idx) != LUA_TUSERDATA)
+        return lua_tolstring(L, idx, len);
+
+    b = luaL_testudata(L, idx, ECO_BUFFER_MT);
+    if (!b)
+        return NULL;
+
+    *len = b->len;
+    return b->data;
 }
 
-static bool eco_reader_find_line(const char *buf, size_t len, char mode,
-                size_t *line_len, size_t *consumed, bool *strip_prev_tail_cr)
+static struct eco_buffer *eco_buffer_new(lua_State *L, struct eco_buffer_store *store,
+            char *data, size_t len, size_t cap)
 {
-    size_t i;
+    struct eco_buffer *b = lua_newuserdatauv(L, sizeof(struct eco_buffer), 0);
 
-    for (i = 0; i < len; i++) {
-        if (buf[i] != '\n')
-            continue;
+    b->store = store;
+    b->data = data;
+    b->len = len;
+    b->cap = cap;
+    b->reading = false;
 
-        *line_len = (mode == 'l') ? i : (i + 1);
-        *consumed = i + 1;
-        if (strip_prev_tail_cr)
-            *strip_prev_tail_cr = false;
+    store->refcount++;
 
-        if (mode == 'l') {
-            if (i > 0 && buf[i - 1] == '\r')
-                (*line_len)--;
-            else if (i == 0 && strip_prev_tail_cr)
-                *strip_prev_tail_cr = true;
-        }
+    luaL_setmetatable(L, ECO_BUFFER_MT);
 
-        return true;
-    }
+    return b;
+}
 
-    return false;
+/*
+ * The space after the data belongs to a pending read_into, and a pending
+ * write points into the data. Slices share the memory, so the writes are
+ * counted on the store.
+ */
+static inline void eco_buffer_check_busy(lua_State *L, struct eco_buffer *b)
+{
+    if (b->reading)
+        luaL_error(L, "a reader is reading into this buffer");
+
+    if (b->store && b->store->writing)
+        luaL_error(L, "a writer is writing this buffer");
 }
 
-static void eco_reader_consume_buf(struct eco_reader *rd, size_t consumed, size_t total)
+/* Count a write of the buffer at idx in or out, if it's one */
+static struct eco_buffer_store *eco_buffer_pin(lua_State *L, int idx, int delta)
 {
-    if (consumed < total) {
-        memmove(rd->buf, rd->buf + consumed, total - consumed);
-        rd->len = total - consumed;
-    } else {
-        rd->len = 0;
-    }
+    struct eco_buffer *b;
+
+    if (lua_type(L, idx) != LUA_TUSERDATA)
+        return NULL;
+
+    b = luaL_testudata(L, idx, ECO_BUFFER_MT);
+    if (!b || !b->store)
+        return NULL;
+
+    b->store->writing += delta;
+
+    return b->store;
 }
 
-static void eco_reader_cleanup(lua_State *L, struct eco_reader *rd)
+/* Translate string.sub style indexes into [*start, *end) */
+static void eco_buffer_range(lua_State *L, struct eco_buffer *b, int idx,
+            size_t *start, size_t *end)
 {
-    if (rd->mode != 'u' || rd->needle_ref == LUA_NOREF)
+    lua_Integer i = luaL_optinteger(L, idx, 1);
+    lua_Integer j = luaL_optinteger(L, idx + 1, -1);
+    lua_Integer len = b->len;
+
+    if (i < 0)
+        i = i < -len ? 1 : len + i + 1;
+    else if (i == 0)
+        i = 1;
+
+    if (j < 0)
+        j = len + j + 1;
+    else if (j > len)
+        j = len;
+
+    if (i > j) {
+        *start = *end = 0;
         return;
-    luaL_unref(L, LUA_REGISTRYINDEX, rd->needle_ref);
-    rd->needle_ref = LUA_NOREF;
+    }
+
+    *start = i - 1;
+    *end = j;
 }
 
-static inline int eco_reader_stop(lua_State *L, struct eco_reader *rd, int nret)
+/**
+ * buffer object created by @{eco.buffer}.
+ *
+ * A fixed capacity byte buffer living outside the Lua heap. Readers fill
+ * it with @{reader:read_into} and writers send it as is, so large payloads
+ * don't have to become Lua strings. Slices share the memory of the buffer
+ * they come from.
+ *
+ * `#buf` is the length of the data.
+ *
+ * @type buffer
+ */
+
+/**
+ * Get the length of the data.
+ *
+ * @function buffer:len
+ * @treturn integer
+ */
+static int lua_buffer_len(lua_State *L)
 {
-    eco_reader_cleanup(L, rd);
-    eco_io_stop(L, &rd->io);
-    return nret;
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+    lua_pushinteger(L, b->len);
+    return 1;
 }
 
-static int eco_reader_readuntil_consume(lua_State *L, struct eco_reader *rd)
+/**
+ * Get the capacity.
+ *
+ * @function buffer:cap
+ * @treturn integer
+ */
+static int lua_buffer_cap(lua_State *L)
 {
-    char *p;
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+    lua_pushinteger(L, b->cap);
+    return 1;
+}
 
-    if (rd->len < rd->needle_len)
-        return 0;
+/**
+ * Copy (part of) the data into a Lua string.
+ *
+ * Indexes work like in `string.sub`.
+ *
+ * @function buffer:tostring
+ * @tparam[opt=1] integer i Start index.
+ * @tparam[opt=-1] integer j End index.
+ * @treturn string
+ */
+static int lua_buffer_tostring(lua_State *L)
+{
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+    size_t start, end;
 
-    p = memmem(rd->buf, rd->len, rd->needle, rd->needle_len);
-    if (p) {
-        size_t matched = p - rd->buf;
+    eco_buffer_range(L, b, 2, &start, &end);
 
-        lua_pushlstring(L, rd->buf, matched);
+    lua_pushlstring(L, b->data + start, end - start);
+    return 1;
+}
+
+/**
+ * Get a view of part of the data, without copying.
+ *
+ * Indexes work like in `string.sub`. The slice shares the memory of the
+ * buffer: changes through one are visible through the other. A slice is
+ * full, its capacity is its length.
+ *
+ * @function buffer:slice
+ * @tparam[opt=1] integer i Start index.
+ * @tparam[opt=-1] integer j End index.
+ * @treturn buffer
+ */
+static int lua_buffer_slice(lua_State *L)
+{
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+    size_t start, end;
+
+    eco_buffer_range(L, b, 2, &start, &end);
+
+    eco_buffer_new(L, b->store, b->data + start, end - start, end - start);
+    return 1;
+}
+
+/**
+ * Append data at the end.
+ *
+ * @function buffer:append
+ * @tparam string|buffer data
+ * @treturn buffer The buffer itself.
+ * @raise If a @{reader:read_into} on this buffer, or a write of it or of
+ * a slice sharing its memory, is pending.
+ */
+static int lua_buffer_append(lua_State *L)
+{
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+    size_t len;
+    const char *data = eco_tobytes(L, 2, &len);
+
+    luaL_argexpected(L, data, 2, "string or buffer");
+    eco_buffer_check_busy(L, b);
+    luaL_argcheck(L, len <= b->cap - b->len, 2, "not enough space");
+
+    memmove(b->data + b->len, data, len);
+    b->len += len;
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+/**
+ * Drop data from the front, or all of it.
+ *
+ * Remaining data is moved to the front, so the space at the end can be
+ * filled again.
+ *
+ * @function buffer:consume
+ * @tparam[opt] integer n Number of bytes, default is all.
+ * @treturn buffer The buffer itself.
+ * @raise If a @{reader:read_into} on this buffer, or a write of it or of
+ * a slice sharing its memory, is pending.
+ */
+static int lua_buffer_consume(lua_State *L)
+{
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+    lua_Integer n = luaL_optinteger(L, 2, b->len);
+
+    luaL_argcheck(L, n >= 0, 2, "n must be greater than or equal to 0");
+    eco_buffer_check_busy(L, b);
+
+    if ((size_t)n >= b->len) {
+        b->len = 0;
+    } else {
+        memmove(b->data, b->data + n, b->len - n);
+        b->len -= n;
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+/// @section end
+
+static int lua_buffer_gc(lua_State *L)
+{
+    struct eco_buffer *b = luaL_checkudata(L, 1, ECO_BUFFER_MT);
+
+    if (b->store && --b->store->refcount == 0)
+        free(b->store);
+
+    b->store = NULL;
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+
+    return 0;
+}
+
+static const struct luaL_Reg buffer_methods[] = {
+    {"len", lua_buffer_len},
+    {"cap", lua_buffer_cap},
+    {"tostring", lua_buffer_tostring},
+    {"slice", lua_buffer_slice},
+    {"append", lua_buffer_append},
+    {"consume", lua_buffer_consume},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg buffer_metatable[] = {
+    {"__len", lua_buffer_len},
+    {"__gc", lua_buffer_gc},
+    {NULL, NULL}
+};
+
+/**
+ * Create a byte buffer.
+ *
+ * @function buffer
+ * @tparam integer size Capacity in bytes.
+ * @tparam[opt] string data Initial content.
+ * @treturn buffer
+ *
+ * @usage
+ * local buf = eco.buffer(1024 * 1024)
+ * while buf:len() < buf:cap() do
+ *     local n, err = rd:read_into(buf)
+ *     if not n then break end
+ * end
+ * wr:write(buf)
+ */
+static int lua_eco_buffer(lua_State *L)
+{
+    lua_Integer size = luaL_checkinteger(L, 1);
+    struct eco_buffer_store *store;
+    struct eco_buffer *b;
+    const char *data;
+    size_t len = 0;
+
+    luaL_argcheck(L, size >= 0, 1, "size must be greater than or equal to 0");
+
+    /* Checked before the userdata is pushed, it would be taken for argument 2 */
+    data = luaL_optlstring(L, 2, NULL, &len);
+    luaL_argcheck(L, len <= (size_t)size, 2, "data is larger than size");
+
+    b = lua_newuserdatauv(L, sizeof(struct eco_buffer), 0);
+    memset(b, 0, sizeof(struct eco_buffer));
+    luaL_setmetatable(L, ECO_BUFFER_MT);
+
+    store = malloc(sizeof(struct eco_buffer_store) + size);
+    if (!store)
+        return luaL_error(L, "failed to allocate buffer");
+
+    store->refcount = 1;
+    store->writing = 0;
+
+    b->store = store;
+    b->data = store->data;
+    b->cap = size;
+
+    if (data) {
+        memcpy(b->data, data, len);
+        b->len = len;
+    }
+
+    return 1;
+}
+
+/**
+ * reader object created by @{eco.reader}.
+ * @type reader
+ */
+
+/**
+ * Wait for the underlying file descriptor to become readable.
+ *
+ * @function reader:wait
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn boolean true If the underlying file descriptor to become readable.
+ * @treturn[2] nil On error.
+ * @treturn[2] string Error message.
+ */
+static int lua_reader_wait(lua_State *L)
+{
+    struct eco_reader *rd = luaL_checkudata(L, 1, ECO_READER_MT);
+    double timeout = lua_tonumber(L, 2);
+    return eco_io_wait(L, &rd->io, EPOLLIN, timeout);
+}
+
+static bool eco_reader_find_line(const char *buf, size_t len, char mode,
+                size_t *line_len, size_t *consumed, bool *strip_prev_tail_cr)
+{
+    const char *p = memchr(buf, '\n', len);
+    size_t i;
+
+    if (!p)
+        return false;
+
+    i = p - buf;
+
+    *line_len = (mode == 'l') ? i : (i + 1);
+    *consumed = i + 1;
+    if (strip_prev_tail_cr)
+        *strip_prev_tail_cr = false;
+
+    if (mode == 'l') {
+        if (i > 0 && buf[i - 1] == '\r')
+            (*line_len)--;
+        else if (i == 0 && strip_prev_tail_cr)
+            *strip_prev_tail_cr = true;
+    }
+
+    return true;
+}
+
+static void eco_reader_grow(struct eco_reader *rd)
+{
+    size_t size = rd->buf_size * 2;
+    char *buf;
+
+    if (size > rd->buf_max)
+        size = rd->buf_max;
+
+    buf = realloc(rd->buf, size);
+    if (!buf)
+        return;
+
+    rd->buf = buf;
+    rd->buf_size = size;
+}
+
+static void eco_reader_consume_buf(struct eco_reader *rd, size_t consumed, size_t total)
+{
+    if (consumed < total) {
+        memmove(rd->buf, rd->buf + consumed, total - consumed);
+        rd->len = total - consumed;
+    } else {
+        rd->len = 0;
+    }
+}
+
+static void eco_reader_cleanup(lua_State *L, struct eco_reader *rd)
+{
+    if (rd->mode != 'u' || rd->needle_ref == LUA_NOREF)
+        return;
+    luaL_unref(L, LUA_REGISTRYINDEX, rd->needle_ref);
+    rd->needle_ref = LUA_NOREF;
+}
+
+static inline int eco_reader_stop(lua_State *L, struct eco_reader *rd, int nret)
+{
+    /* Only reached with the caller, which anchors the buffer, still running */
+    if (rd->mode == 'b' && rd->into) {
+        rd->into->reading = false;
+        rd->into = NULL;
+    }
+
+    eco_reader_cleanup(L, rd);
+    eco_io_stop(L, &rd->io);
+    return nret;
+}
+
+static int eco_reader_readuntil_consume(lua_State *L, struct eco_reader *rd)
+{
+    const char *p;
+
+    if (rd->len < rd->needle_len)
+        return 0;
+
+    p = memmem(rd->buf, rd->len, rd->needle, rd->needle_len);
+    if (p) {
+        size_t matched = p - rd->buf;
+
+        lua_pushlstring(L, rd->buf, matched);
         eco_reader_consume_buf(rd, matched + rd->needle_len, rd->len);
         lua_pushboolean(L, true);
         eco_reader_cleanup(L, rd);
@@ -998,6 +2484,8 @@ static int eco_reader_read_once(lua_State *L, struct eco_reader *rd,
     int ret;
 
     if (continuation) {
+        eco_io_op_settle(L, io);
+
         ret = eco_io_push_wait_error(L, io);
         if (ret)
             goto unref;
@@ -1007,19 +2495,28 @@ static int eco_reader_read_once(lua_State *L, struct eco_reader *rd,
         size_t size;
         char *buf;
 
-        eco_io_fairness(L, io, k);
+        /* A completed recv already filled the buffer, it must stay put */
+        if (!eco_io_op_done(io)) {
+            eco_io_fairness(L, io, k);
+
+            /* Bulk transfer, read bigger chunks */
+            if (rd->filled && rd->buf_size < rd->buf_max)
+                eco_reader_grow(rd);
+        }
 
         if (mode == 'a')
-            size = LUAL_BUFFERSIZE;
+            size = rd->buf_size;
         else if (mode == 'u')
-            size = RD_BUFSIZE - rd->len;
+            size = rd->buf_size - rd->len;
         else if (mode == 'l' || mode == 'L')
-            size = RD_BUFSIZE;
-        else /* any or full */
+            size = rd->buf_size;
+        else /* any, full or into */
             size = rd->expected;
 
         if (mode == 'f' || mode == 'a' || mode == 0)
             buf = luaL_prepbuffsize(&rd->b, size);
+        else if (mode == 'b')
+            buf = rd->into->data + rd->into->len;
         else if (mode == 'u')
             buf = rd->buf + rd->len;
         else
@@ -1041,10 +2538,15 @@ static int eco_reader_read_once(lua_State *L, struct eco_reader *rd,
                 goto unref;
             }
         } else {
-            ret = read(io->efd->fd, buf, size);
+            ssize_t n;
+
+            if (!eco_io_op_take(io, &n))
+                n = read(io->efd->fd, buf, size);
+
+            ret = n;
             if (ret < 0) {
                 if (errno_wouldblock()) {
-                    ret = eco_io_yieldk(L, io, EPOLLIN, k);
+                    ret = eco_io_wait_recv(L, io, buf, size, k);
                     if (ret < 0)
                         goto err;
                     return ret;
@@ -1083,6 +2585,15 @@ static int eco_reader_read_once(lua_State *L, struct eco_reader *rd,
 
         io->eof = false;
 
+        if (mode == 'a' || mode == 'u' || mode == 'l' || mode == 'L')
+            rd->filled = (size_t)ret == size;
+
+        if (mode == 'b') {
+            rd->into->len += ret;
+            lua_pushinteger(L, ret);
+            return eco_reader_stop(L, rd, 1);
+        }
+
         if (mode == 'f' || mode == 0) {
             luaL_addsize(&rd->b, ret);
 
@@ -1323,6 +2834,61 @@ static int lua_reader_readuntil(lua_State *L)
     return eco_reader_read_once(L, rd, lua_reader_readuntilk, false);
 }
 
+/**
+ * Read into an @{eco.buffer}, appending after its data.
+ *
+ * Like `read(n)`, it returns as soon as some data is available, without
+ * creating a Lua string. Until it returns, `buf:append` and `buf:consume`
+ * raise an error.
+ *
+ * @function reader:read_into
+ * @tparam buffer buf Target buffer.
+ * @tparam[opt] integer n Maximum number of bytes, default is the free space of `buf`.
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout)
+ * @treturn integer Number of bytes read
+ * @treturn[2] nil On error or EOF
+ * @treturn[2] string Error message, "eof" or "closed"
+ */
+static int lua_reader_read_into(lua_State *L)
+{
+    struct eco_reader *rd = luaL_checkudata(L, 1, ECO_READER_MT);
+    struct eco_buffer *b = luaL_checkudata(L, 2, ECO_BUFFER_MT);
+    size_t space = b->cap - b->len;
+    lua_Integer n = luaL_optinteger(L, 3, space);
+    double timeout = lua_tonumber(L, 4);
+
+    luaL_argcheck(L, n > 0, 3, "n must be greater than 0");
+    eco_buffer_check_busy(L, b);
+    luaL_argcheck(L, space > 0, 2, "buffer is full");
+
+    eco_io_check_busy(L, &rd->io, EPOLLIN);
+
+    if ((size_t)n > space)
+        n = space;
+
+    if (rd->len > 0) {
+        if ((size_t)n > rd->len)
+            n = rd->len;
+
+        memcpy(b->data + b->len, rd->buf, n);
+        b->len += n;
+        eco_reader_consume_buf(rd, n, rd->len);
+
+        lua_pushinteger(L, n);
+        return 1;
+    }
+
+    rd->io.timeout = timeout;
+    rd->expected = n;
+    rd->into = b;
+    rd->mode = 'b';
+
+    /* append/consume would move the space the read goes to */
+    b->reading = true;
+
+    return eco_reader_read_once(L, rd, lua_reader_readk, false);
+}
+
 /**
  * Cancel a pending read operation.
  *
@@ -1340,6 +2906,26 @@ static int lua_reader_cancel(lua_State *L)
     return eco_io_cancel(L, &rd->io);
 }
 
+/**
+ * Wake a read waiting on a reader created with `polled = false`.
+ *
+ * The waiting coroutine calls the custom read function again, so a
+ * notification that comes too early is harmless.
+ *
+ * @function reader:notify
+ * @treturn nil
+ */
+static int lua_reader_notify(lua_State *L)
+{
+    struct eco_reader *rd = luaL_checkudata(L, 1, ECO_READER_MT);
+    struct eco_io *io = &rd->io;
+
+    if (io->unpolled && io->co && !io->fairness_yield)
+        eco_io_ready(L, io);
+
+    return 0;
+}
+
 /// @section end
 
 static const struct luaL_Reg reader_methods[] = {
@@ -1347,15 +2933,24 @@ static const struct luaL_Reg reader_methods[] = {
     {"read", lua_reader_read},
     {"readfull", lua_reader_readfull},
     {"readuntil", lua_reader_readuntil},
+    {"read_into", lua_reader_read_into},
     {"cancel", lua_reader_cancel},
+    {"notify", lua_reader_notify},
     {NULL, NULL}
 };
 
 static int lua_reader_gc(lua_State *L)
 {
     struct eco_reader *rd = luaL_checkudata(L, 1, ECO_READER_MT);
+
     eco_reader_cleanup(L, rd);
     eco_io_unbind_fd(L, &rd->io);
+
+    free(rd->buf);
+    rd->buf = NULL;
+    rd->buf_size = 0;
+    rd->len = 0;
+
     return 0;
 }
 
@@ -1371,10 +2966,21 @@ static const struct luaL_Reg reader_metatable[] = {
  * Wraps a file descriptor in an `eco.reader` object for async I/O.
  * Optionally, a custom read function and context pointer can be provided.
  *
+ * Line and delimiter reads go through an internal buffer. It starts with
+ * `bufsize` bytes and doubles, up to `maxbufsize`, while reads keep
+ * filling it up.
+ *
  * @function reader
  * @tparam integer fd File descriptor to wrap
  * @tparam[opt] lightuserdata read Custom read function
  * @tparam[opt] lightuserdata ctx Context pointer for the read function
+ * @tparam[opt] table opts Buffer options, always the last argument.
+ * @tparam[opt=4096] integer opts.bufsize Initial buffer size in bytes, at least 512.
+ * @tparam[opt=65536] integer opts.maxbufsize Buffer size cap (raised to
+ * `bufsize` if smaller).
+ * @tparam[opt=true] boolean opts.polled With `false`, `fd` is never polled:
+ * when the custom read function returns `-EAGAIN`, the reader waits for
+ * @{reader:notify} instead. For data produced by another thread.
  * @treturn reader The reader object
  * @treturn[2] nil On failure
  * @treturn[2] string Error message
@@ -1387,13 +2993,38 @@ static const struct luaL_Reg reader_metatable[] = {
  *     return
  * end
  * print(line)
+ *
+ * local bulk = eco.reader(fd, { bufsize = 16384, maxbufsize = 1024 * 1024 })
  */
 static int lua_eco_reader(lua_State *L)
 {
     int fd = luaL_checkinteger(L, 1);
     int narg = lua_gettop(L);
+    lua_Integer bufsize = RD_BUFSIZE;
+    lua_Integer maxbufsize = RD_BUFSIZE_MAX;
+    bool polled = true;
     struct eco_reader *rd;
 
+    if (narg > 1 && lua_istable(L, narg)) {
+        int opts = narg--;
+
+        lua_getfield(L, opts, "bufsize");
+        bufsize = luaL_optinteger(L, -1, bufsize);
+        luaL_argcheck(L, bufsize >= RD_BUFSIZE_MIN, opts, "bufsize must be at least 512");
+        lua_pop(L, 1);
+
+        lua_getfield(L, opts, "maxbufsize");
+        maxbufsize = luaL_optinteger(L, -1, maxbufsize);
+        lua_pop(L, 1);
+
+        if (maxbufsize < bufsize)
+            maxbufsize = bufsize;
+
+        if (lua_getfield(L, opts, "polled") != LUA_TNIL)
+            polled = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
     eco_check_custom_rw_callback_args(L, narg);
 
     rd = eco_new_fd_userdata(L, fd, sizeof(struct eco_reader), ECO_READER_MT);
@@ -1402,8 +3033,17 @@ static int lua_eco_reader(lua_State *L)
 
     rd->needle_ref = LUA_NOREF;
 
+    rd->buf = malloc(bufsize);
+    if (!rd->buf)
+        return push_errno(L, ENOMEM);
+
+    rd->buf_size = bufsize;
+    rd->buf_max = maxbufsize;
+
     eco_io_init(L, &rd->io, fd);
 
+    rd->io.unpolled = !polled;
+
     if (narg > 1) {
         rd->read = lua_topointer(L, 2);
 
@@ -1415,45 +3055,204 @@ static int lua_eco_reader(lua_State *L)
 }
 
 
-/**
- * writer object created by @{eco.writer}.
- * @type writer
- */
-
-/**
- * Wait for the underlying file descriptor to become writable.
- *
- * @function writer:wait
- * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
- * @treturn boolean true If the underlying file descriptor to become writable.
- * @treturn[2] nil On error.
- * @treturn[2] string Error message.
- */
-static int lua_writer_wait(lua_State *L)
+static void eco_writer_queue_flush(struct eco_writer *wr)
 {
-    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
-    double timeout = lua_tonumber(L, 2);
-    return eco_io_wait(L, &wr->io, EPOLLOUT, timeout);
+    if (wr->flush_queued)
+        return;
+
+    list_add_tail(&wr->flush_node, &wr->io.sched->flush_list);
+    wr->flush_queued = true;
 }
 
-static int eco_write_once(lua_State *L, struct eco_writer *wr,
-            lua_KFunction k, bool continuation)
+/* Give the fd back to coroutines, the pending data goes out with their write */
+static void eco_writer_disarm(struct eco_writer *wr)
 {
     struct eco_io *io = &wr->io;
-    int ret;
 
-    if (continuation) {
-        ret = eco_io_push_wait_error(L, io);
-        if (ret)
-            goto unref;
+    if (!io->flush_armed)
+        return;
+
+    io->flush_armed = false;
+    eco_io_detach(io);
+
+    if (wr->auto_flush)
+        eco_writer_queue_flush(wr);
+}
+
+/* Forget about a background flush, queued or waiting for EPOLLOUT */
+static void eco_writer_drop_flush(struct eco_writer *wr)
+{
+    if (wr->io.flush_armed) {
+        wr->io.flush_armed = false;
+        eco_io_detach(&wr->io);
     }
 
-    if (!continuation)
-        eco_io_fairness(L, io, k);
+    if (wr->flush_queued) {
+        list_del(&wr->flush_node);
+        wr->flush_queued = false;
+    }
+}
 
-    if (wr->write) {
-        char *err = "";
-        ret = wr->write(wr->data.data + wr->written, wr->total - wr->written, wr->ctx, &err);
+static void eco_writer_flush_ready(struct eco_io *io)
+{
+    struct eco_writer *wr = container_of(io, struct eco_writer, io);
+
+    io->flush_armed = false;
+    eco_io_detach(io);
+
+    eco_writer_queue_flush(wr);
+}
+
+/*
+ * Hand the write buffer to the fd without blocking, what it doesn't take
+ * stays buffered. On error, the buffer is dropped and -1 is returned.
+ */
+static ssize_t eco_writer_write_buf(struct eco_writer *wr)
+{
+    ssize_t ret;
+
+    if (wr->write) {
+        char *err = "";
+
+        ret = wr->write(wr->buf, wr->buf_len, wr->ctx, &err);
+        if (ret == -EAGAIN)
+            ret = 0;
+    } else {
+        ret = write(wr->io.efd->fd, wr->buf, wr->buf_len);
+        if (ret < 0 && errno_wouldblock())
+            ret = 0;
+    }
+
+    if (ret < 0) {
+        wr->buf_len = 0;
+        return -1;
+    }
+
+    wr->buf_len -= ret;
+
+    if (wr->buf_len)
+        memmove(wr->buf, wr->buf + ret, wr->buf_len);
+
+    return ret;
+}
+
+/*
+ * Background flush of an auto-flush writer, it never blocks. What doesn't
+ * fit into the kernel buffer waits for EPOLLOUT without a coroutine.
+ */
+static void eco_writer_flush_nowait(struct eco_writer *wr)
+{
+    struct eco_io *io = &wr->io;
+    struct eco_fd *efd = io->efd;
+
+    /* A coroutine is writing, the buffer goes out with its data */
+    if (!efd || io->co || io->flush_armed || !wr->buf_len)
+        return;
+
+    /* On error the stream is broken, the next write reports it */
+    if (eco_writer_write_buf(wr) < 0 || !wr->buf_len)
+        return;
+
+    if (efd->write_io)
+        return;
+
+    efd->write_io = io;
+    efd->writable = false;
+
+    if (eco_fd_update_events(io->sched, efd) < 0) {
+        efd->write_io = NULL;
+        return;
+    }
+
+    io->flush_armed = true;
+}
+
+static void eco_process_flush(struct eco_scheduler *sched)
+{
+    while (!list_empty(&sched->flush_list)) {
+        struct eco_writer *wr = list_first_entry(&sched->flush_list, struct eco_writer, flush_node);
+
+        list_del(&wr->flush_node);
+        wr->flush_queued = false;
+
+        eco_writer_flush_nowait(wr);
+    }
+}
+
+/* Keep what the last writev didn't send from the write buffer */
+static void eco_writer_buf_sent(struct eco_writer *wr)
+{
+    if (!wr->buf_iov)
+        return;
+
+    wr->buf_iov = false;
+
+    if (wr->iov_idx > 0) {
+        wr->buf_len = 0;
+        return;
+    }
+
+    memmove(wr->buf, wr->iov[0].iov_base, wr->iov[0].iov_len);
+    wr->buf_len = wr->iov[0].iov_len;
+}
+
+static int eco_writer_start_writev(lua_State *L, struct eco_writer *wr,
+            int first, int n, double timeout, bool count_buf);
+
+/**
+ * writer object created by @{eco.writer}.
+ * @type writer
+ */
+
+/**
+ * Wait for the underlying file descriptor to become writable.
+ *
+ * @function writer:wait
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn boolean true If the underlying file descriptor to become writable.
+ * @treturn[2] nil On error.
+ * @treturn[2] string Error message.
+ */
+static int lua_writer_wait(lua_State *L)
+{
+    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
+    double timeout = lua_tonumber(L, 2);
+
+    eco_writer_disarm(wr);
+
+    return eco_io_wait(L, &wr->io, EPOLLOUT, timeout);
+}
+
+static void eco_writer_unref(lua_State *L, struct eco_writer *wr)
+{
+    if (wr->data.store) {
+        wr->data.store->writing--;
+        wr->data.store = NULL;
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, wr->data.ref);
+}
+
+static int eco_write_once(lua_State *L, struct eco_writer *wr,
+            lua_KFunction k, bool continuation)
+{
+    struct eco_io *io = &wr->io;
+    int ret;
+
+    if (continuation) {
+        eco_io_op_settle(L, io);
+
+        ret = eco_io_push_wait_error(L, io);
+        if (ret)
+            goto unref;
+    }
+
+    if (!continuation)
+        eco_io_fairness(L, io, k);
+
+    if (wr->write) {
+        char *err = "";
+        ret = wr->write(wr->data.data + wr->written, wr->total - wr->written, wr->ctx, &err);
         if (ret < 0) {
             if (ret == -EAGAIN) {
                 ret = 0;
@@ -1463,7 +3262,12 @@ static int eco_write_once(lua_State *L, struct eco_writer *wr,
             }
         }
     } else {
-        ret = write(io->efd->fd, wr->data.data + wr->written, wr->total - wr->written);
+        ssize_t n;
+
+        if (!eco_io_op_take(io, &n))
+            n = write(io->efd->fd, wr->data.data + wr->written, wr->total - wr->written);
+
+        ret = n;
         if (ret < 0) {
             if (errno_wouldblock())
                 ret = 0;
@@ -1475,13 +3279,17 @@ static int eco_write_once(lua_State *L, struct eco_writer *wr,
     wr->written += ret;
 
     if (wr->written < wr->total) {
-        ret = eco_io_yieldk(L, io, EPOLLOUT, k);
+        if (wr->write)
+            ret = eco_io_yieldk(L, io, EPOLLOUT, k);
+        else
+            ret = eco_io_wait_send(L, io, wr->data.data + wr->written,
+                        wr->total - wr->written, k);
         if (ret < 0)
             goto err;
         return ret;
     }
 
-    luaL_unref(L, LUA_REGISTRYINDEX, wr->data.ref);
+    eco_writer_unref(L, wr);
     lua_pushinteger(L, wr->total);
     eco_io_stop(L, io);
     return 1;
@@ -1489,7 +3297,7 @@ static int eco_write_once(lua_State *L, struct eco_writer *wr,
 err:
     push_errno(L, errno);
 unref:
-    luaL_unref(L, LUA_REGISTRYINDEX, wr->data.ref);
+    eco_writer_unref(L, wr);
     eco_io_stop(L, io);
     return 2;
 }
@@ -1507,8 +3315,12 @@ static int lua_writer_writek(lua_State *L, int status, lua_KContext ctx)
  * this `eco.writer`. If the write would block, the coroutine is
  * suspended and resumed automatically when the descriptor is writable.
  *
+ * With a write buffer (see @{writer:setbuf}), `data` is copied to the
+ * buffer as long as it fits, and the call returns without a system call.
+ * Otherwise the buffer and `data` are written together.
+ *
  * @function writer:write
- * @tparam string data Data to write
+ * @tparam string|buffer data Data to write
  * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout)
  * @treturn integer Number of bytes written
  * @treturn[2] nil On error
@@ -1518,11 +3330,30 @@ static int lua_writer_write(lua_State *L)
 {
     struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
     size_t size;
-    const char *data = luaL_checklstring(L, 2, &size);
+    const char *data = eco_tobytes(L, 2, &size);
     double timeout = lua_tonumber(L, 3);
 
+    luaL_argexpected(L, data, 2, "string or buffer");
+
+    eco_writer_disarm(wr);
     eco_io_check_busy(L, &wr->io, EPOLLOUT);
 
+    if (wr->buf_size) {
+        if (wr->buf_len + size <= wr->buf_size) {
+            memcpy(wr->buf + wr->buf_len, data, size);
+            wr->buf_len += size;
+
+            if (wr->auto_flush)
+                eco_writer_queue_flush(wr);
+
+            lua_pushinteger(L, size);
+            return 1;
+        }
+
+        if (wr->buf_len)
+            return eco_writer_start_writev(L, wr, 2, 1, timeout, false);
+    }
+
     wr->io.timeout = timeout;
     wr->total = size;
     wr->written = 0;
@@ -1531,268 +3362,1886 @@ static int lua_writer_write(lua_State *L)
     wr->data.ref = luaL_ref(L, LUA_REGISTRYINDEX);
     wr->data.data = data;
 
+    /* Until it's written, the buffer's data must stay where it is */
+    wr->data.store = eco_buffer_pin(L, 2, 1);
+
     return eco_write_once(L, wr, lua_writer_writek, false);
 }
 
-static int lua_writer_sendfilek(lua_State *L, int status, lua_KContext ctx)
+/* Skip the buffers fully written and trim the first partially written one */
+static void eco_writev_advance(struct eco_writer *wr, size_t n)
 {
-    struct eco_writer *wr = (struct eco_writer *)ctx;
-    struct eco_io *io = &wr->io;
-    int ret;
+    wr->written += n;
 
-    ret = eco_io_push_wait_error(L, io);
-    if (ret)
-        goto out_close;
+    while (n > 0) {
+        struct iovec *iov = &wr->iov[wr->iov_idx];
 
-    ret = sendfile(io->efd->fd, wr->file.fd, &wr->file.offset, wr->total - wr->written);
-    if (ret < 0) {
-        if (errno_wouldblock())
-            goto wait_writable;
-        goto err;
-    }
+        if (n < iov->iov_len) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+            break;
+        }
 
-    if (ret == 0) {
-        push_nil_eof_or_closed(L, io->efd->fd);
-        ret = 2;
-        goto out_close;
+        n -= iov->iov_len;
+        wr->iov_idx++;
     }
 
-    wr->written += ret;
-
-    if (wr->written < wr->total) {
-wait_writable:
-        ret = eco_io_yieldk(L, io, EPOLLOUT, lua_writer_sendfilek);
-        if (ret < 0)
-            goto err;
-        return ret;
-    }
+    while (wr->iov_idx < wr->iovcnt && wr->iov[wr->iov_idx].iov_len == 0)
+        wr->iov_idx++;
+}
 
-    lua_pushinteger(L, wr->total);
-    ret = 1;
-    goto out_close;
+/* The eco.buffers among the arguments of a writev, see eco_writer_start_writev */
+static void eco_writev_pin(lua_State *L, struct eco_writer *wr, int delta)
+{
+    int i, n = wr->iovcnt - wr->buf_iov;
 
-err:
-    push_errno(L, errno);
-    ret = 2;
+    for (i = 0; i < n; i++)
+        eco_buffer_pin(L, wr->iov_first + i, delta);
+}
 
-out_close:
-    close(wr->file.fd);
-    eco_io_stop(L, io);
-    return ret;
+static void eco_writev_unpin(lua_State *L, struct eco_writer *wr)
+{
+    eco_writev_pin(L, wr, -1);
 }
 
-/**
- * Send a file's content to the writer's file descriptor.
- *
- * Uses the `sendfile` system call to send `len` bytes starting from
- * `offset` of the file at `path` to the writer's file descriptor.
- * If the operation would block, the coroutine is suspended and resumed
- * automatically when the descriptor is writable.
- *
- * @function writer:sendfile
- * @tparam string path Path to the file
- * @tparam integer offset Offset in the file to start sending
- * @tparam integer len Number of bytes to send
- * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout)
- * @treturn integer Number of bytes sent
- * @treturn[2] nil On error
- * @treturn[2] string Error message, "eof" or "closed"
- *
- * @usage
- * local wr = eco.writer(fd)
- * local n, err = wr:sendfile('/tmp/file.txt', 0, 1024)
- * if not n then print('Sendfile failed:', err) end
- */
-static int lua_writer_sendfile(lua_State *L)
+/* Wait until wr can be written to, or for the completion of a sendmsg */
+static int eco_writer_wait_sendmsg(lua_State *L, struct eco_writer *wr, lua_KFunction k)
 {
-    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
-    const char *path = luaL_checkstring(L, 2);
-    off_t offset = luaL_checkinteger(L, 3);
-    int len = luaL_checkinteger(L, 4);
-    double timeout = lua_tonumber(L, 5);
     struct eco_io *io = &wr->io;
-    int ret = 0, fd;
 
-    luaL_argcheck(L, offset >= 0, 3, "offset must be greater than or equal to 0");
-    luaL_argcheck(L, len > 0, 4, "len must be great than 0");
+#ifdef ECO_IO_URING
+    if (eco_io_op_arm(io)) {
+        int cnt = wr->iovcnt - wr->iov_idx;
 
-    eco_io_check_busy(L, &wr->io, EPOLLOUT);
+        memset(&wr->msg, 0, sizeof(wr->msg));
+        wr->msg.msg_iov = &wr->iov[wr->iov_idx];
+        wr->msg.msg_iovlen = cnt > WRITEV_MAX_IOV ? WRITEV_MAX_IOV : cnt;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0)
-        return push_errno(L, errno);
+        if (eco_uring_sendmsg(io->sched->uring, io->efd->fd, &wr->msg, eco_io_op_data(io)) == 0)
+            return eco_io_op_yieldk(L, io, k);
 
-    wr->io.timeout = timeout;
-    wr->file.fd = fd;
-    wr->file.offset = offset;
-    wr->total = len;
-    wr->written = 0;
+        eco_timer_stop(io->sched, &io->timer);
+    }
+#endif
 
-    eco_io_fairness(L, io, lua_writer_sendfilek);
+    return eco_io_yieldk(L, io, EPOLLOUT, k);
+}
 
-    ret = sendfile(wr->io.efd->fd, fd, &offset, len);
-    if (ret < 0) {
-        if (errno_wouldblock())
-            goto again;
-        goto err;
-    }
+/*
+ * The buffers point into strings and eco.buffers left on the coroutine's
+ * stack by lua_writer_writev, which keeps them alive across yields.
+ */
+static int eco_writev_once(lua_State *L, struct eco_writer *wr,
+            lua_KFunction k, bool continuation)
+{
+    struct eco_io *io = &wr->io;
+    ssize_t ret;
 
-    if (ret == 0) {
-        push_nil_eof_or_closed(L, wr->io.efd->fd);
-        ret = 2;
-        goto out_close;
+    if (continuation) {
+        eco_io_op_settle(L, io);
+
+        ret = eco_io_push_wait_error(L, io);
+        if (ret)
+            goto out;
     }
 
-    if (ret < len)
-        goto again;
+    if (!continuation)
+        eco_io_fairness(L, io, k);
 
-    lua_pushinteger(L, len);
-    ret = 1;
-    goto out_close;
+    while (wr->iov_idx < wr->iovcnt) {
+        struct iovec *iov = &wr->iov[wr->iov_idx];
 
-again:
-    wr->file.offset = offset;
-    wr->written = (ret > 0) ? ret : 0;
+        if (wr->write) {
+            /* Custom writers (TLS...) take one buffer at a time */
+            char *err = "";
 
-    ret = eco_io_yieldk(L, &wr->io, EPOLLOUT, lua_writer_sendfilek);
-    if (ret < 0)
-        goto err;
-    return ret;
+            ret = wr->write(iov->iov_base, iov->iov_len, wr->ctx, &err);
+            if (ret < 0) {
+                if (ret == -EAGAIN)
+                    goto wait;
 
-err:
-    push_errno(L, errno);
-    ret = 2;
-    eco_io_stop(L, &wr->io);
+                ret = push_nil_string(L, err);
+                goto out;
+            }
+        } else {
+            int cnt = wr->iovcnt - wr->iov_idx;
 
-out_close:
-    close(fd);
-    return ret;
-}
+            if (!eco_io_op_take(io, &ret))
+                ret = writev(io->efd->fd, iov, cnt > WRITEV_MAX_IOV ? WRITEV_MAX_IOV : cnt);
+            if (ret < 0) {
+                if (errno_wouldblock())
+                    goto wait;
 
-/**
- * Cancel a pending write operation.
+                push_errno(L, errno);
+                ret = 2;
+                goto out;
+            }
+        }
+
+        if (ret == 0)
+            goto wait;
+
+        eco_writev_advance(wr, ret);
+    }
+
+    lua_pushinteger(L, wr->total);
+    ret = 1;
+    goto out;
+
+wait:
+    if (wr->write)
+        ret = eco_io_yieldk(L, io, EPOLLOUT, k);
+    else
+        ret = eco_writer_wait_sendmsg(L, wr, k);
+    if (ret >= 0)
+        return ret;
+
+    push_errno(L, errno);
+    ret = 2;
+
+out:
+    eco_writev_unpin(L, wr);
+    eco_writer_buf_sent(wr);
+    eco_io_stop(L, io);
+    return ret;
+}
+
+static int lua_writer_writevk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_writer *wr = (struct eco_writer *)ctx;
+    return eco_writev_once(L, wr, lua_writer_writevk, true);
+}
+
+static int eco_writer_reserve_iov(struct eco_writer *wr, int n)
+{
+    struct iovec *iov;
+    int cap = wr->iov_cap ? wr->iov_cap : 8;
+
+    if (n <= wr->iov_cap)
+        return 0;
+
+    while (cap < n)
+        cap *= 2;
+
+    iov = realloc(wr->iov, cap * sizeof(struct iovec));
+    if (!iov)
+        return -1;
+
+    wr->iov = iov;
+    wr->iov_cap = cap;
+
+    return 0;
+}
+
+/*
+ * Submit the strings at stack indexes first..first+n-1, preceded by the
+ * content of the write buffer. The total returned to Lua counts the buffer
+ * only when count_buf is set.
+ */
+static int eco_writer_start_writev(lua_State *L, struct eco_writer *wr,
+            int first, int n, double timeout, bool count_buf)
+{
+    int off = wr->buf_len > 0;
+    int i;
+
+    if (eco_writer_reserve_iov(wr, n + off) < 0)
+        return push_errno(L, ENOMEM);
+
+    wr->total = 0;
+
+    if (off) {
+        wr->iov[0].iov_base = wr->buf;
+        wr->iov[0].iov_len = wr->buf_len;
+        wr->buf_iov = true;
+
+        if (count_buf)
+            wr->total = wr->buf_len;
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t len;
+        const char *data = eco_tobytes(L, first + i, &len);
+
+        if (!data) {
+            wr->buf_iov = false;
+            return luaL_error(L, "bad buffer #%d (string or buffer expected, got %s)",
+                        i + 1, luaL_typename(L, first + i));
+        }
+
+        wr->iov[off + i].iov_base = (void *)data;
+        wr->iov[off + i].iov_len = len;
+        wr->total += len;
+    }
+
+    wr->io.timeout = timeout;
+    wr->written = 0;
+    wr->iov_idx = 0;
+    wr->iovcnt = n + off;
+    wr->iov_first = first;
+
+    /* Until they are written, the buffers' data must stay where it is */
+    eco_writev_pin(L, wr, 1);
+
+    /* skip leading empty buffers */
+    eco_writev_advance(wr, 0);
+
+    return eco_writev_once(L, wr, lua_writer_writevk, false);
+}
+
+/**
+ * Write several strings with a single vectored write.
  *
- * If a coroutine is currently suspended in `write`, `sendfile` or `wait`, it is
- * queued on the scheduler ready queue and will later return nil with error
- * "canceled". This method does not resume the waiting coroutine synchronously
- * before returning.
+ * Accepts either an array of strings followed by an optional timeout, or
+ * the strings as varargs (no timeout then). The strings are submitted with
+ * `writev`, so they don't need to be concatenated first. Partial writes are
+ * resumed across buffer boundaries when the descriptor becomes writable.
  *
- * @function writer:cancel
- * @treturn nil
+ * With a custom write function (e.g. TLS), the buffers are written one
+ * after another.
+ *
+ * @function writer:writev
+ * @tparam table|string|buffer data Array of strings or buffers, or the first one.
+ * @tparam[opt] number timeout Timeout in seconds when `data` is a table.
+ * @treturn integer Total number of bytes written
+ * @treturn[2] nil On error
+ * @treturn[2] string Error message
+ *
+ * @usage
+ * wr:writev({ 'HTTP/1.1 200 OK\r\n', headers, '\r\n', body })
+ * wr:writev('a', 'b', 'c')
  */
-static int lua_writer_cancel(lua_State *L)
+static int lua_writer_writev(lua_State *L)
 {
     struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
-    return eco_io_cancel(L, &wr->io);
+    double timeout = 0;
+    int first, n, i;
+
+    eco_writer_disarm(wr);
+    eco_io_check_busy(L, &wr->io, EPOLLOUT);
+
+    if (lua_istable(L, 2)) {
+        timeout = lua_tonumber(L, 3);
+        n = lua_rawlen(L, 2);
+
+        /* Copy the strings to the stack, which anchors them across yields */
+        lua_settop(L, 2);
+        luaL_checkstack(L, n, "too many buffers");
+
+        for (i = 1; i <= n; i++)
+            lua_rawgeti(L, 2, i);
+
+        first = 3;
+    } else {
+        first = 2;
+        n = lua_gettop(L) - 1;
+    }
+
+    return eco_writer_start_writev(L, wr, first, n, timeout, false);
 }
 
-/// @section end
+/**
+ * Write out the content of the write buffer.
+ *
+ * @function writer:flush
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout)
+ * @treturn integer Number of bytes flushed
+ * @treturn[2] nil On error
+ * @treturn[2] string Error message. On timeout, the unsent part is kept
+ * in the buffer.
+ */
+static int lua_writer_flush(lua_State *L)
+{
+    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
+    double timeout = lua_tonumber(L, 2);
 
-static const struct luaL_Reg writer_methods[] = {
-    {"wait", lua_writer_wait},
-    {"write", lua_writer_write},
-    {"sendfile", lua_writer_sendfile},
-    {"cancel", lua_writer_cancel},
-    {NULL, NULL}
-};
+    eco_writer_disarm(wr);
+    eco_io_check_busy(L, &wr->io, EPOLLOUT);
 
-static int lua_writer_gc(lua_State *L)
+    return eco_writer_start_writev(L, wr, 2, 0, timeout, true);
+}
+
+/**
+ * Set up a userspace write buffer.
+ *
+ * Small writes are then collected in the buffer and go out with a single
+ * system call once `size` bytes would be exceeded, or on @{writer:flush}.
+ *
+ * With `auto_flush`, the scheduler also flushes the buffer at the end of
+ * the current loop iteration, before it waits for events. This coalesces
+ * the writes done by the coroutines run in one iteration. An auto flush
+ * never blocks; what the kernel doesn't take is sent when the descriptor
+ * becomes writable. Errors of an auto flush are not reported, the next
+ * write or flush fails instead.
+ *
+ * Data left in the buffer is discarded when the writer is garbage
+ * collected. @{writer:cancel} can write it out without blocking first.
+ *
+ * @function writer:setbuf
+ * @tparam integer size High-water mark in bytes, 0 disables buffering.
+ * @tparam[opt=false] boolean auto_flush Flush at the end of each loop iteration.
+ *
+ * @usage
+ * wr:setbuf(16384, true)
+ * for _, msg in ipairs(msgs) do
+ *     wr:write(msg) -- one write(2) for all of them
+ * end
+ */
+static int lua_writer_setbuf(lua_State *L)
 {
     struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
-    eco_io_unbind_fd(L, &wr->io);
+    lua_Integer size = luaL_checkinteger(L, 2);
+    char *buf = NULL;
+
+    luaL_argcheck(L, size >= 0, 2, "size must be greater than or equal to 0");
+    luaL_argcheck(L, (size_t)size >= wr->buf_len, 2, "size is smaller than the pending data");
+
+    eco_writer_disarm(wr);
+    eco_io_check_busy(L, &wr->io, 0);
+
+    if (size > 0) {
+        buf = realloc(wr->buf, size);
+        if (!buf)
+            return luaL_error(L, "failed to allocate write buffer");
+    } else {
+        free(wr->buf);
+    }
+
+    wr->buf = buf;
+    wr->buf_size = size;
+    wr->auto_flush = lua_toboolean(L, 3);
+
+    if (wr->flush_queued && !wr->auto_flush) {
+        list_del(&wr->flush_node);
+        wr->flush_queued = false;
+    }
+
     return 0;
 }
 
-static const struct luaL_Reg writer_metatable[] = {
-    {"__gc", lua_writer_gc},
-    {"__close", lua_writer_gc},
-    {NULL, NULL}
-};
+static int lua_writer_sendfilek(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_writer *wr = (struct eco_writer *)ctx;
+    struct eco_io *io = &wr->io;
+    int ret;
+
+    ret = eco_io_push_wait_error(L, io);
+    if (ret)
+        goto out_close;
+
+    ret = sendfile(io->efd->fd, wr->file.fd, &wr->file.offset, wr->total - wr->written);
+    if (ret < 0) {
+        if (errno_wouldblock())
+            goto wait_writable;
+        goto err;
+    }
+
+    if (ret == 0) {
+        push_nil_eof_or_closed(L, io->efd->fd);
+        ret = 2;
+        goto out_close;
+    }
+
+    wr->written += ret;
+
+    if (wr->written < wr->total) {
+wait_writable:
+        ret = eco_io_yieldk(L, io, EPOLLOUT, lua_writer_sendfilek);
+        if (ret < 0)
+            goto err;
+        return ret;
+    }
+
+    lua_pushinteger(L, wr->total);
+    ret = 1;
+    goto out_close;
+
+err:
+    push_errno(L, errno);
+    ret = 2;
+
+out_close:
+    close(wr->file.fd);
+    eco_io_stop(L, io);
+    return ret;
+}
 
 /**
- * Create a new writer object.
+ * Send a file's content to the writer's file descriptor.
  *
- * Wraps a file descriptor in an `eco.writer` object for asynchronous
- * write operations. Optionally, a custom write function and context
- * pointer can be provided.
+ * Uses the `sendfile` system call to send `len` bytes starting from
+ * `offset` of the file at `path` to the writer's file descriptor.
+ * If the operation would block, the coroutine is suspended and resumed
+ * automatically when the descriptor is writable.
  *
- * @function eco.writer
- * @tparam integer fd File descriptor to wrap
- * @tparam[opt] lightuserdata write Custom write function
- * @tparam[opt] lightuserdata ctx Context pointer for the write function
- * @treturn writer The writer object
- * @treturn[2] nil On failure
- * @treturn[2] string Error message
+ * @function writer:sendfile
+ * @tparam string path Path to the file
+ * @tparam integer offset Offset in the file to start sending
+ * @tparam integer len Number of bytes to send
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout)
+ * @treturn integer Number of bytes sent
+ * @treturn[2] nil On error
+ * @treturn[2] string Error message, "eof" or "closed"
  *
  * @usage
  * local wr = eco.writer(fd)
- * wr:write('hello world')
+ * local n, err = wr:sendfile('/tmp/file.txt', 0, 1024)
+ * if not n then print('Sendfile failed:', err) end
  */
-static int lua_eco_writer(lua_State *L)
+static int lua_writer_sendfile(lua_State *L)
 {
-    int fd = luaL_checkinteger(L, 1);
-    int narg = lua_gettop(L);
-    struct eco_writer *wr;
+    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
+    const char *path = luaL_checkstring(L, 2);
+    off_t offset = luaL_checkinteger(L, 3);
+    int len = luaL_checkinteger(L, 4);
+    double timeout = lua_tonumber(L, 5);
+    struct eco_io *io = &wr->io;
+    int ret = 0, fd;
+
+    luaL_argcheck(L, offset >= 0, 3, "offset must be greater than or equal to 0");
+    luaL_argcheck(L, len > 0, 4, "len must be great than 0");
+
+    eco_writer_disarm(wr);
+    eco_io_check_busy(L, &wr->io, EPOLLOUT);
+
+    if (wr->buf_len)
+        return push_nil_string(L, "write buffer not flushed");
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return push_errno(L, errno);
+
+    wr->io.timeout = timeout;
+    wr->file.fd = fd;
+    wr->file.offset = offset;
+    wr->total = len;
+    wr->written = 0;
+
+    eco_io_fairness(L, io, lua_writer_sendfilek);
+
+    ret = sendfile(wr->io.efd->fd, fd, &offset, len);
+    if (ret < 0) {
+        if (errno_wouldblock())
+            goto again;
+        goto err;
+    }
+
+    if (ret == 0) {
+        push_nil_eof_or_closed(L, wr->io.efd->fd);
+        ret = 2;
+        goto out_close;
+    }
+
+    if (ret < len)
+        goto again;
+
+    lua_pushinteger(L, len);
+    ret = 1;
+    goto out_close;
+
+again:
+    wr->file.offset = offset;
+    wr->written = (ret > 0) ? ret : 0;
+
+    ret = eco_io_yieldk(L, &wr->io, EPOLLOUT, lua_writer_sendfilek);
+    if (ret < 0)
+        goto err;
+    return ret;
+
+err:
+    push_errno(L, errno);
+    ret = 2;
+    eco_io_stop(L, &wr->io);
+
+out_close:
+    close(fd);
+    return ret;
+}
+
+/**
+ * Cancel a pending write operation.
+ *
+ * If a coroutine is currently suspended in `write`, `writev`, `sendfile` or `wait`, it is
+ * queued on the scheduler ready queue and will later return nil with error
+ * "canceled". This method does not resume the waiting coroutine synchronously
+ * before returning.
+ *
+ * Data left in the write buffer is discarded and no background flush runs
+ * afterwards, so the fd can be closed right after. With `flush`, the buffer
+ * is first handed to the fd as far as it takes it without blocking, unless
+ * a coroutine is writing.
+ *
+ * @function writer:cancel
+ * @tparam[opt=false] boolean flush Write out the buffer before dropping it.
+ * @treturn nil
+ */
+static int lua_writer_cancel(lua_State *L)
+{
+    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
+    bool flush = lua_toboolean(L, 2);
+
+    eco_writer_drop_flush(wr);
+
+    if (flush && wr->buf_len && wr->io.efd && !wr->io.co)
+        eco_writer_write_buf(wr);
+
+    wr->buf_len = 0;
+
+    return eco_io_cancel(L, &wr->io);
+}
+
+/// @section end
+
+static const struct luaL_Reg writer_methods[] = {
+    {"wait", lua_writer_wait},
+    {"write", lua_writer_write},
+    {"writev", lua_writer_writev},
+    {"flush", lua_writer_flush},
+    {"setbuf", lua_writer_setbuf},
+    {"sendfile", lua_writer_sendfile},
+    {"cancel", lua_writer_cancel},
+    {NULL, NULL}
+};
+
+static int lua_writer_gc(lua_State *L)
+{
+    struct eco_writer *wr = luaL_checkudata(L, 1, ECO_WRITER_MT);
+
+    eco_writer_drop_flush(wr);
+    eco_io_unbind_fd(L, &wr->io);
+
+    free(wr->buf);
+    wr->buf = NULL;
+    wr->buf_len = 0;
+    wr->buf_size = 0;
+
+    free(wr->iov);
+    wr->iov = NULL;
+    wr->iov_cap = 0;
+
+    return 0;
+}
+
+static const struct luaL_Reg writer_metatable[] = {
+    {"__gc", lua_writer_gc},
+    {"__close", lua_writer_gc},
+    {NULL, NULL}
+};
+
+/**
+ * Create a new writer object.
+ *
+ * Wraps a file descriptor in an `eco.writer` object for asynchronous
+ * write operations. Optionally, a custom write function and context
+ * pointer can be provided.
+ *
+ * @function eco.writer
+ * @tparam integer fd File descriptor to wrap
+ * @tparam[opt] lightuserdata write Custom write function
+ * @tparam[opt] lightuserdata ctx Context pointer for the write function
+ * @treturn writer The writer object
+ * @treturn[2] nil On failure
+ * @treturn[2] string Error message
+ *
+ * @usage
+ * local wr = eco.writer(fd)
+ * wr:write('hello world')
+ */
+static int lua_eco_writer(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    int narg = lua_gettop(L);
+    struct eco_writer *wr;
+
+    eco_check_custom_rw_callback_args(L, narg);
+
+    wr = eco_new_fd_userdata(L, fd, sizeof(struct eco_writer), ECO_WRITER_MT);
+    if (!wr)
+        return push_errno(L, errno);
+
+    eco_io_init(L, &wr->io, fd);
+
+    if (narg > 1) {
+        wr->write = lua_topointer(L, 2);
+
+        if (narg > 2)
+            wr->ctx = (void *)lua_topointer(L, 3);
+    }
+
+    return 1;
+}
+
+/* State of an eco.splice call, kept on the coroutine's stack */
+struct eco_splice {
+    struct eco_io in;
+    struct eco_io out;
+    int pipe[2];
+    size_t pending;     /* bytes sitting in the pipe */
+    size_t total;
+    size_t limit;       /* 0 = until EOF */
+    size_t chunk;
+};
+
+/* The eco_splice userdata sits right after the 3 arguments */
+#define SPLICE_STACK_IDX 4
+
+static int lua_eco_splicek(lua_State *L, int status, lua_KContext ctx);
+
+static void eco_splice_release(lua_State *L, struct eco_splice *s)
+{
+    eco_io_unbind_fd(L, &s->in);
+    eco_io_unbind_fd(L, &s->out);
+
+    if (s->pipe[0] > -1) {
+        close(s->pipe[0]);
+        close(s->pipe[1]);
+        s->pipe[0] = s->pipe[1] = -1;
+    }
+}
+
+/* Push the byte count, or the error already pushed plus the partial counts */
+static int eco_splice_finish(lua_State *L, struct eco_splice *s, bool failed)
+{
+    if (!failed) {
+        eco_splice_release(L, s);
+        lua_pushinteger(L, s->total);
+        return 1;
+    }
+
+    /* Best effort: hand what is left in the pipe to the destination */
+    while (s->pending) {
+        ssize_t ret = splice(s->pipe[0], NULL, s->out.efd->fd, NULL, s->pending,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret <= 0)
+            break;
+
+        s->pending -= ret;
+        s->total += ret;
+    }
+
+    eco_splice_release(L, s);
+
+    lua_pushinteger(L, s->total);
+    lua_pushinteger(L, s->pending);
+    return 4;
+}
+
+static int eco_splice_wait(lua_State *L, struct eco_splice *s, struct eco_io *io, int events)
+{
+    int ret = eco_io_yieldk(L, io, events, lua_eco_splicek);
+    if (ret < 0) {
+        push_errno(L, errno);
+        return eco_splice_finish(L, s, true);
+    }
+    return ret;
+}
+
+static int eco_splice_once(lua_State *L, struct eco_splice *s)
+{
+    ssize_t ret;
+
+    eco_io_fairness(L, &s->in, lua_eco_splicek);
+
+    while (1) {
+        if (!s->pending) {
+            size_t len = s->chunk;
+
+            if (s->limit) {
+                if (s->total >= s->limit)
+                    break;
+
+                if (len > s->limit - s->total)
+                    len = s->limit - s->total;
+            }
+
+            ret = splice(s->in.efd->fd, NULL, s->pipe[1], NULL, len,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret == 0)
+                break;
+
+            if (ret < 0) {
+                if (errno_wouldblock())
+                    return eco_splice_wait(L, s, &s->in, EPOLLIN);
+                push_errno(L, errno);
+                return eco_splice_finish(L, s, true);
+            }
+
+            s->pending = ret;
+        }
+
+        /* The pipe is never full here, EAGAIN comes from the destination */
+        ret = splice(s->pipe[0], NULL, s->out.efd->fd, NULL, s->pending,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret < 0) {
+            if (errno_wouldblock())
+                return eco_splice_wait(L, s, &s->out, EPOLLOUT);
+            push_errno(L, errno);
+            return eco_splice_finish(L, s, true);
+        }
+
+        s->pending -= ret;
+        s->total += ret;
+    }
+
+    return eco_splice_finish(L, s, false);
+}
+
+static int lua_eco_splicek(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_splice *s = lua_touserdata(L, SPLICE_STACK_IDX);
+    struct eco_io *io = (struct eco_io *)ctx;
+    int ret;
+
+    ret = eco_io_push_wait_error(L, io);
+    eco_io_stop(L, io);
+
+    if (ret)
+        return eco_splice_finish(L, s, true);
+
+    return eco_splice_once(L, s);
+}
+
+/* Only does anything when the call never finished, e.g. the coroutine died */
+static int lua_splice_gc(lua_State *L)
+{
+    struct eco_splice *s = luaL_checkudata(L, 1, ECO_SPLICE_MT);
+    eco_splice_release(L, s);
+    return 0;
+}
+
+static const struct luaL_Reg splice_metatable[] = {
+    {"__gc", lua_splice_gc},
+    {NULL, NULL}
+};
+
+/**
+ * Move data from one file descriptor to another without copying it
+ * into Lua.
+ *
+ * Data goes `src_fd` -> internal pipe -> `dst_fd` with `splice(2)`, so
+ * it stays in the kernel. The coroutine is suspended while `src_fd` has
+ * nothing to read or `dst_fd` can't take more. One of the two
+ * descriptors must be a socket, a pipe or another fd `splice(2)`
+ * supports as a pipe peer (e.g. a TUN device via its file).
+ *
+ * For a bidirectional relay, run one `eco.splice` per direction in
+ * separate coroutines.
+ *
+ * The internal pipe is closed as soon as the call returns. On error or
+ * timeout, data already in the pipe is still handed to `dst_fd` if it
+ * takes it without blocking. What it doesn't take is lost, and reported
+ * as the fourth return value.
+ *
+ * @function splice
+ * @tparam integer src_fd Source file descriptor.
+ * @tparam integer dst_fd Destination file descriptor.
+ * @tparam[opt] table opts Options.
+ * @tparam[opt] integer opts.len Number of bytes to move, default is until EOF.
+ * @tparam[opt] number opts.timeout Timeout in seconds for each wait.
+ * @tparam[opt=65536] integer opts.chunk Maximum bytes per `splice(2)` call.
+ * @treturn integer Number of bytes moved. Fewer than `opts.len` means EOF.
+ * @treturn[2] nil On error.
+ * @treturn[2] string Error message.
+ * @treturn[2] integer Number of bytes moved before the error.
+ * @treturn[2] integer Number of bytes read from `src_fd` but not delivered.
+ *
+ * @usage
+ * -- forward a TCP connection to a unix socket until it closes
+ * eco.run(function() eco.splice(tcp:getfd(), unix:getfd()) end)
+ * eco.run(function() eco.splice(unix:getfd(), tcp:getfd()) end)
+ */
+static int lua_eco_splice(lua_State *L)
+{
+    int src = luaL_checkinteger(L, 1);
+    int dst = luaL_checkinteger(L, 2);
+    lua_Integer len = 0, chunk = SPLICE_CHUNK_SIZE;
+    double timeout = 0;
+    struct eco_splice *s;
+
+    if (!lua_isnoneornil(L, 3)) {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_getfield(L, 3, "len");
+        len = luaL_optinteger(L, -1, 0);
+        luaL_argcheck(L, len >= 0, 3, "len must be greater than or equal to 0");
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "timeout");
+        timeout = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 3, "chunk");
+        chunk = luaL_optinteger(L, -1, chunk);
+        luaL_argcheck(L, chunk > 0, 3, "chunk must be greater than 0");
+        lua_pop(L, 1);
+    }
+
+    if (set_fd_nonblock(src) < 0 || set_fd_nonblock(dst) < 0)
+        return push_errno(L, errno);
+
+    lua_settop(L, SPLICE_STACK_IDX - 1);
+
+    s = lua_newuserdatauv(L, sizeof(struct eco_splice), 0);
+    memset(s, 0, sizeof(struct eco_splice));
+    s->pipe[0] = s->pipe[1] = -1;
+    luaL_setmetatable(L, ECO_SPLICE_MT);
+
+    eco_io_init(L, &s->in, src);
+    eco_io_init(L, &s->out, dst);
+
+    eco_io_check_busy(L, &s->in, EPOLLIN);
+    eco_io_check_busy(L, &s->out, EPOLLOUT);
+
+    if (pipe2(s->pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+        push_errno(L, errno);
+        eco_splice_release(L, s);
+        return 2;
+    }
+
+    /* Best effort, a bigger pipe means fewer round trips per chunk */
+    if (chunk > SPLICE_CHUNK_SIZE)
+        fcntl(s->pipe[1], F_SETPIPE_SZ, (int)chunk);
+
+    s->in.timeout = timeout;
+    s->out.timeout = timeout;
+    s->limit = len;
+    s->chunk = chunk;
+
+    return eco_splice_once(L, s);
+}
+
+static int lua_eco_sleepk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+    struct eco_timer *timer = (struct eco_timer *)ctx;
+
+    eco_timer_free(sched, timer);
+
+    return 0;
+}
+
+/**
+ * Suspend the current coroutine for a given delay.
+ *
+ * This function yields the current Lua coroutine and resumes it
+ * after `delay` seconds, counted from the cached loop time (see @{now}).
+ *
+ * @function sleep
+ * @tparam number delay Number of seconds to sleep.
+ *
+ * @usage
+ * print('Sleeping for 1 second...')
+ * eco.run(function()
+ *     eco.sleep(1)
+ *     print('Awake!')
+ * end)
+ */
+static int lua_eco_sleep(lua_State *L)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+    double delay = luaL_checknumber(L, 1);
+    struct eco_timer *timer;
+
+    luaL_argcheck(L, delay >= 0, 1, "delay must be greater than or equal to 0");
+
+    timer = eco_timer_alloc(sched);
+    if (!timer)
+        return luaL_error(L, "failed to allocate timer");
+
+    if (eco_timer_start(sched, L, timer, delay) < 0) {
+        eco_timer_free(sched, timer);
+        return luaL_error(L, "failed to start timer");
+    }
+
+    return lua_yieldk(L, 0, (lua_KContext)timer, lua_eco_sleepk);
+}
+
+struct eco_waitq {
+    struct eco_scheduler *sched;
+    struct list_head waiters;   /* FIFO */
+    bool closed;
+};
+
+/* Wake the first waiter */
+static bool eco_waitq_wake_one(lua_State *L, struct eco_waitq *q, int data)
+{
+    struct eco_waiter *w;
+
+    if (list_empty(&q->waiters))
+        return false;
+
+    w = list_first_entry(&q->waiters, struct eco_waiter, node);
+
+    if (data && lua_toboolean(L, data)) {
+        lua_pushvalue(L, data);
+        w->park->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    eco_park_wake(L, q->sched, w, false);
+
+    return true;
+}
+
+static int lua_waitq_waitk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_park *p = (struct eco_park *)ctx;
+    struct eco_waitq *q = lua_touserdata(L, 1);
+
+    if (!eco_park_finish(q->sched, p))
+        /* Resumed by someone else, keep waiting */
+        return lua_yieldk(L, 0, ctx, lua_waitq_waitk);
+
+    if (!p->index)
+        return push_nil_string(L, "timeout");
+
+    if (p->closed)
+        return push_nil_string(L, "closed");
+
+    if (p->ref == LUA_NOREF) {
+        lua_pushboolean(L, true);
+    } else {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, p->ref);
+        luaL_unref(L, LUA_REGISTRYINDEX, p->ref);
+        p->ref = LUA_NOREF;
+    }
+
+    return 1;
+}
+
+/**
+ * Wait queue object created by @{eco.waitq}.
+ * @type waitq
+ */
+
+/**
+ * Wait until signaled.
+ *
+ * Waiters are woken in FIFO order.
+ *
+ * @function waitq:wait
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn any Data passed to @{waitq:signal}, or `true`.
+ * @treturn[2] nil On timeout or close.
+ * @treturn[2] string `"timeout"` or `"closed"`.
+ */
+static int lua_waitq_wait(lua_State *L)
+{
+    struct eco_waitq *q = luaL_checkudata(L, 1, ECO_WAITQ_MT);
+    double timeout = lua_tonumber(L, 2);
+    struct eco_park *p;
+
+    if (q->closed) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    lua_settop(L, 1);
+
+    p = eco_park_new(L, q->sched, 1, timeout);
+    eco_park_on(&p->waiters[0], &q->waiters);
+
+    return lua_yieldk(L, 0, (lua_KContext)p, lua_waitq_waitk);
+}
+
+/**
+ * Wake the first waiting coroutine.
+ *
+ * @function waitq:signal
+ * @tparam[opt] any data Returned by @{waitq:wait} when truthy, otherwise it returns `true`.
+ * @treturn boolean `true` if a waiter was woken.
+ */
+static int lua_waitq_signal(lua_State *L)
+{
+    struct eco_waitq *q = luaL_checkudata(L, 1, ECO_WAITQ_MT);
+
+    lua_pushboolean(L, !q->closed && eco_waitq_wake_one(L, q, 2));
+    return 1;
+}
+
+/**
+ * Wake all waiting coroutines.
+ *
+ * @function waitq:broadcast
+ * @treturn integer Number of woken coroutines.
+ */
+static int lua_waitq_broadcast(lua_State *L)
+{
+    struct eco_waitq *q = luaL_checkudata(L, 1, ECO_WAITQ_MT);
+    int n = 0;
+
+    if (!q->closed) {
+        while (eco_waitq_wake_one(L, q, 0))
+            n++;
+    }
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/**
+ * Get the number of waiting coroutines.
+ *
+ * @function waitq:count
+ * @treturn integer
+ */
+static int lua_waitq_count(lua_State *L)
+{
+    struct eco_waitq *q = luaL_checkudata(L, 1, ECO_WAITQ_MT);
+    struct list_head *pos;
+    int n = 0;
+
+    list_for_each(pos, &q->waiters)
+        n++;
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
+/**
+ * Close the wait queue.
+ *
+ * This is idempotent. Waiting coroutines return `nil, "closed"`.
+ *
+ * @function waitq:close
+ */
+static int lua_waitq_close(lua_State *L)
+{
+    struct eco_waitq *q = luaL_checkudata(L, 1, ECO_WAITQ_MT);
+    struct eco_waiter *w;
+
+    if (q->closed)
+        return 0;
+
+    q->closed = true;
+
+    while (!list_empty(&q->waiters)) {
+        w = list_first_entry(&q->waiters, struct eco_waiter, node);
+        eco_park_wake(L, q->sched, w, true);
+    }
+
+    return 0;
+}
+
+/// @section end
+
+static const struct luaL_Reg waitq_methods[] = {
+    {"wait", lua_waitq_wait},
+    {"signal", lua_waitq_signal},
+    {"broadcast", lua_waitq_broadcast},
+    {"count", lua_waitq_count},
+    {"close", lua_waitq_close},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg waitq_metatable[] = {
+    {"__gc", lua_waitq_close},
+    {"__close", lua_waitq_close},
+    {NULL, NULL}
+};
+
+/**
+ * Create a wait queue.
+ *
+ * A FIFO queue of coroutines, woken directly by the scheduler without
+ * any file descriptor. It's the building block of @{eco.sync}.
+ *
+ * @function waitq
+ * @treturn waitq
+ *
+ * @usage
+ * local q = eco.waitq()
+ *
+ * eco.run(function()
+ *     print(q:wait(1.0))
+ * end)
+ *
+ * q:signal('hello')
+ */
+static int lua_eco_waitq(lua_State *L)
+{
+    struct eco_waitq *q = lua_newuserdatauv(L, sizeof(struct eco_waitq), 0);
+
+    luaL_setmetatable(L, ECO_WAITQ_MT);
+
+    memset(q, 0, sizeof(struct eco_waitq));
+
+    q->sched = get_eco_scheduler(L);
+    INIT_LIST_HEAD(&q->waiters);
+
+    return 1;
+}
+
+struct eco_channel {
+    struct eco_scheduler *sched;
+    struct list_head recvq;     /* parked receivers, only while the ring is empty */
+    struct list_head sendq;     /* parked senders, only while the ring is full */
+    int cap;
+    int head;
+    int len;
+    bool closed;
+};
+
+static void eco_chan_push_ref(lua_State *L, int ref)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
+/* Append the value on the top of the stack to the ring and pop it */
+static void eco_chan_put(lua_State *L, struct eco_channel *ch, int idx)
+{
+    lua_getiuservalue(L, idx, 1);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, (ch->head + ch->len) % ch->cap + 1);
+    lua_pop(L, 1);
+
+    ch->len++;
+}
+
+/* Push the first value of the ring and release its slot */
+static void eco_chan_take(lua_State *L, struct eco_channel *ch, int idx)
+{
+    lua_getiuservalue(L, idx, 1);
+    lua_rawgeti(L, -1, ch->head + 1);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, ch->head + 1);
+    lua_remove(L, -2);
+
+    ch->head = (ch->head + 1) % ch->cap;
+    ch->len--;
+}
+
+static bool eco_chan_try_send(lua_State *L, struct eco_channel *ch, int idx, int vidx)
+{
+    if (!list_empty(&ch->recvq)) {
+        struct eco_waiter *w = list_first_entry(&ch->recvq, struct eco_waiter, node);
+
+        lua_pushvalue(L, vidx);
+        w->park->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        eco_park_wake(L, ch->sched, w, false);
+        return true;
+    }
+
+    if (ch->len < ch->cap) {
+        lua_pushvalue(L, vidx);
+        eco_chan_put(L, ch, idx);
+        return true;
+    }
+
+    return false;
+}
+
+/* On success, the value received is pushed onto the stack */
+static bool eco_chan_try_recv(lua_State *L, struct eco_channel *ch, int idx)
+{
+    struct eco_waiter *w = NULL;
+
+    if (!list_empty(&ch->sendq))
+        w = list_first_entry(&ch->sendq, struct eco_waiter, node);
+
+    if (ch->len > 0) {
+        eco_chan_take(L, ch, idx);
+
+        /* Refill the slot just freed from the first parked sender */
+        if (w) {
+            eco_chan_push_ref(L, w->ref);
+            w->ref = LUA_NOREF;
+            eco_chan_put(L, ch, idx);
+            eco_park_wake(L, ch->sched, w, false);
+        }
+
+        return true;
+    }
+
+    if (w) {
+        eco_chan_push_ref(L, w->ref);
+        w->ref = LUA_NOREF;
+        eco_park_wake(L, ch->sched, w, false);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Channel object created by @{eco.channel}.
+ *
+ * Buffered values live in a fixed size ring. A value sent while a
+ * receiver is parked goes straight to that receiver, and a receiver
+ * which frees a slot moves the value of the first parked sender into it.
+ *
+ * @type channel
+ */
+
+/**
+ * Get the number of buffered values.
+ *
+ * @function channel:length
+ * @treturn integer
+ */
+static int lua_channel_length(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+
+    lua_pushinteger(L, ch->len);
+    return 1;
+}
+
+/**
+ * Get the capacity of the channel.
+ *
+ * @function channel:capacity
+ * @treturn integer
+ */
+static int lua_channel_capacity(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+
+    lua_pushinteger(L, ch->cap);
+    return 1;
+}
+
+/**
+ * Close the channel.
+ *
+ * This is idempotent. Receivers can still drain the buffered values, then
+ * @{channel:recv} returns `nil`. @{channel:send} raises an error. Any parked
+ * coroutine is woken.
+ *
+ * @function channel:close
+ */
+static int lua_channel_close(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+    struct eco_waiter *w;
+
+    if (ch->closed)
+        return 0;
+
+    ch->closed = true;
+
+    while (!list_empty(&ch->recvq)) {
+        w = list_first_entry(&ch->recvq, struct eco_waiter, node);
+        eco_park_wake(L, ch->sched, w, true);
+    }
+
+    while (!list_empty(&ch->sendq)) {
+        w = list_first_entry(&ch->sendq, struct eco_waiter, node);
+        eco_park_wake(L, ch->sched, w, true);
+    }
+
+    return 0;
+}
+
+static int lua_channel_sendk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_channel *ch = lua_touserdata(L, 1);
+    struct eco_park *p = (struct eco_park *)ctx;
+    struct eco_waiter *w = &p->waiters[0];
+
+    if (!eco_park_finish(ch->sched, p))
+        return lua_yieldk(L, 0, ctx, lua_channel_sendk);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, w->ref);
+    w->ref = LUA_NOREF;
+
+    if (p->closed)
+        return luaL_error(L, "sending on closed channel");
+
+    if (p->index) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    return push_nil_string(L, "timeout");
+}
+
+/**
+ * Send a value.
+ *
+ * Blocks while the buffer is full.
+ *
+ * @function channel:send
+ * @tparam any v Value to send. It can't be `nil`, which @{channel:recv}
+ * returns once the channel is closed.
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn boolean `true` on success.
+ * @treturn[2] nil On timeout.
+ * @treturn[2] string `"timeout"`.
+ * @raise If the channel is closed or `v` is `nil`.
+ */
+static int lua_channel_send(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+    double timeout = lua_tonumber(L, 3);
+    struct eco_park *p;
+
+    lua_settop(L, 2);
+    luaL_argcheck(L, !lua_isnil(L, 2), 2, "can't send nil");
+
+    if (ch->closed)
+        return luaL_error(L, "sending on closed channel");
+
+    if (eco_chan_try_send(L, ch, 1, 2)) {
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    p = eco_park_new(L, ch->sched, 1, timeout);
+
+    lua_pushvalue(L, 2);
+    p->waiters[0].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    eco_park_on(&p->waiters[0], &ch->sendq);
+
+    return lua_yieldk(L, 0, (lua_KContext)p, lua_channel_sendk);
+}
+
+static int lua_channel_recvk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_channel *ch = lua_touserdata(L, 1);
+    struct eco_park *p = (struct eco_park *)ctx;
+
+    if (!eco_park_finish(ch->sched, p))
+        return lua_yieldk(L, 0, ctx, lua_channel_recvk);
+
+    if (!p->index)
+        return push_nil_string(L, "timeout");
+
+    if (p->ref == LUA_NOREF) {
+        lua_pushnil(L);
+    } else {
+        eco_chan_push_ref(L, p->ref);
+        p->ref = LUA_NOREF;
+    }
+
+    return 1;
+}
+
+/**
+ * Receive a value.
+ *
+ * Blocks while the buffer is empty. Since `nil` can't be sent, a `nil`
+ * without an error message always means the channel is closed.
+ *
+ * @function channel:recv
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn any The value received, `nil` once the channel is closed and drained.
+ * @treturn[2] nil On timeout.
+ * @treturn[2] string `"timeout"`.
+ */
+static int lua_channel_recv(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+    double timeout = lua_tonumber(L, 2);
+    struct eco_park *p;
+
+    lua_settop(L, 1);
+
+    if (eco_chan_try_recv(L, ch, 1))
+        return 1;
+
+    if (ch->closed) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    p = eco_park_new(L, ch->sched, 1, timeout);
+    eco_park_on(&p->waiters[0], &ch->recvq);
+
+    return lua_yieldk(L, 0, (lua_KContext)p, lua_channel_recvk);
+}
+
+static int lua_channel_send_manyk(lua_State *L, int status, lua_KContext ctx);
+
+/* Send values[pos..count], parking with the value that doesn't fit */
+static int eco_channel_send_many(lua_State *L, struct eco_channel *ch, struct eco_park *p)
+{
+    struct eco_scheduler *sched = ch->sched;
+    struct eco_waiter *w = &p->waiters[0];
+
+    while (p->pos <= p->count) {
+        lua_rawgeti(L, 2, p->pos);
+
+        if (!eco_chan_try_send(L, ch, 1, -1))
+            break;
+
+        lua_pop(L, 1);
+        p->pos++;
+    }
+
+    if (p->pos > p->count) {
+        eco_timer_stop(sched, &p->timer);
+        lua_pushinteger(L, p->count);
+        return 1;
+    }
+
+    if (p->has_timeout) {
+        if (p->deadline <= sched->loop_time) {
+            lua_pushinteger(L, p->pos - 1);
+            lua_pushliteral(L, "timeout");
+            return 2;
+        }
+
+        if (eco_timer_start(sched, L, &p->timer, (p->deadline - sched->loop_time) / 1000.0) < 0)
+            return luaL_error(L, "failed to start timer");
+    }
+
+    p->index = 0;
+    w->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    eco_park_on(w, &ch->sendq);
+
+    return lua_yieldk(L, 0, (lua_KContext)p, lua_channel_send_manyk);
+}
+
+static int lua_channel_send_manyk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_channel *ch = lua_touserdata(L, 1);
+    struct eco_park *p = (struct eco_park *)ctx;
+    struct eco_waiter *w = &p->waiters[0];
+
+    if (!eco_park_finish(ch->sched, p))
+        return lua_yieldk(L, 0, ctx, lua_channel_send_manyk);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, w->ref);
+    w->ref = LUA_NOREF;
+
+    if (p->closed)
+        return luaL_error(L, "sending on closed channel");
+
+    if (!p->index) {
+        lua_pushinteger(L, p->pos - 1);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    p->pos++;
+
+    return eco_channel_send_many(L, ch, p);
+}
+
+/**
+ * Send several values.
+ *
+ * Sends `values[1]` to `values[#values]` in order, blocking whenever the
+ * buffer is full. It's the same as calling @{channel:send} in a loop, but
+ * values which fit are sent in a single call.
+ *
+ * @function channel:send_many
+ * @tparam table values Values to send, none of them `nil`.
+ * @tparam[opt] number timeout Timeout in seconds for the whole batch.
+ * @treturn integer Number of values sent.
+ * @treturn[2] integer Number of values sent before the timeout.
+ * @treturn[2] string `"timeout"`.
+ * @raise If the channel is closed or `values` has a hole.
+ */
+static int lua_channel_send_many(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+    double timeout = lua_tonumber(L, 3);
+    lua_Integer i, count;
+    struct eco_park *p;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+
+    if (ch->closed)
+        return luaL_error(L, "sending on closed channel");
+
+    /* Check the whole batch first, so a hole doesn't leave it half sent */
+    count = lua_rawlen(L, 2);
+
+    for (i = 1; i <= count; i++) {
+        bool isnil = lua_rawgeti(L, 2, i) == LUA_TNIL;
+
+        lua_pop(L, 1);
+
+        if (isnil)
+            return luaL_error(L, "bad item #%d in list (can't send nil)", (int)i);
+    }
+
+    p = eco_park_new(L, ch->sched, 1, 0);
+    p->pos = 1;
+    p->count = count;
+
+    if (timeout > 0) {
+        p->deadline = ch->sched->loop_time + (uint64_t)(timeout * 1000);
+        p->has_timeout = true;
+    }
+
+    return eco_channel_send_many(L, ch, p);
+}
+
+/* Collect buffered values into the table at the top of the stack */
+static int eco_channel_recv_many(lua_State *L, struct eco_channel *ch, lua_Integer n, lua_Integer max)
+{
+    while (n < max && eco_chan_try_recv(L, ch, 1))
+        lua_rawseti(L, -2, ++n);
+
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+static int lua_channel_recv_manyk(lua_State *L, int status, lua_KContext ctx)
+{
+    struct eco_channel *ch = lua_touserdata(L, 1);
+    struct eco_park *p = (struct eco_park *)ctx;
+
+    if (!eco_park_finish(ch->sched, p))
+        return lua_yieldk(L, 0, ctx, lua_channel_recv_manyk);
+
+    if (!p->index)
+        return push_nil_string(L, "timeout");
+
+    /* Woken by close */
+    if (p->ref == LUA_NOREF) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_createtable(L, p->count < 64 ? p->count : 64, 0);
+    eco_chan_push_ref(L, p->ref);
+    p->ref = LUA_NOREF;
+    lua_rawseti(L, -2, 1);
+
+    return eco_channel_recv_many(L, ch, 1, p->count);
+}
+
+/**
+ * Receive several values.
+ *
+ * Blocks until at least one value is available, then takes up to `max`
+ * values without blocking again.
+ *
+ * @function channel:recv_many
+ * @tparam[opt] integer max Maximum number of values (default: the capacity).
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn table The values received.
+ * @treturn integer Number of values received.
+ * @treturn[2] nil Once the channel is closed and drained, or on timeout.
+ * @treturn[2] string `"timeout"` on timeout.
+ * @usage
+ * local values, n = ch:recv_many(32)
+ */
+static int lua_channel_recv_many(lua_State *L)
+{
+    struct eco_channel *ch = luaL_checkudata(L, 1, ECO_CHANNEL_MT);
+    lua_Integer max = luaL_optinteger(L, 2, ch->cap);
+    double timeout = lua_tonumber(L, 3);
+    struct eco_park *p;
+
+    luaL_argcheck(L, max > 0, 2, "must be greater than 0");
+
+    lua_settop(L, 1);
+
+    if (ch->len > 0 || !list_empty(&ch->sendq)) {
+        lua_createtable(L, ch->len < max ? ch->len : max, 0);
+        return eco_channel_recv_many(L, ch, 0, max);
+    }
+
+    if (ch->closed) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    p = eco_park_new(L, ch->sched, 1, timeout);
+    p->count = max;
+    eco_park_on(&p->waiters[0], &ch->recvq);
+
+    return lua_yieldk(L, 0, (lua_KContext)p, lua_channel_recv_manyk);
+}
+
+/// @section end
+
+static const struct luaL_Reg channel_methods[] = {
+    {"length", lua_channel_length},
+    {"capacity", lua_channel_capacity},
+    {"close", lua_channel_close},
+    {"send", lua_channel_send},
+    {"recv", lua_channel_recv},
+    {"send_many", lua_channel_send_many},
+    {"recv_many", lua_channel_recv_many},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg channel_metatable[] = {
+    {"__close", lua_channel_close},
+    {NULL, NULL}
+};
+
+/**
+ * Create a channel.
+ *
+ * The `eco.channel` module is a thin wrapper around it.
+ *
+ * @function channel
+ * @tparam[opt=1] integer capacity Buffer capacity, at least 1.
+ * @treturn channel
+ */
+static int lua_eco_channel(lua_State *L)
+{
+    lua_Integer cap = luaL_optinteger(L, 1, 1);
+    struct eco_channel *ch;
+
+    luaL_argcheck(L, cap > 0 && cap <= INT_MAX, 1, "out of range");
+
+    ch = lua_newuserdatauv(L, sizeof(struct eco_channel), 1);
+    luaL_setmetatable(L, ECO_CHANNEL_MT);
+
+    memset(ch, 0, sizeof(struct eco_channel));
+
+    ch->sched = get_eco_scheduler(L);
+    ch->cap = cap;
+    INIT_LIST_HEAD(&ch->recvq);
+    INIT_LIST_HEAD(&ch->sendq);
+
+    lua_createtable(L, cap < 64 ? cap : 64, 0);
+    lua_setiuservalue(L, -2, 1);
+
+    return 1;
+}
+
+/* eco.io and eco.reader items of eco.select wait for their fd to become readable */
+static struct eco_io *eco_select_toio(lua_State *L, int idx)
+{
+    struct eco_reader *rd;
+    struct eco_io *io;
+
+    io = luaL_testudata(L, idx, ECO_IO_MT);
+    if (io)
+        return io;
+
+    rd = luaL_testudata(L, idx, ECO_READER_MT);
+    if (rd)
+        return &rd->io;
+
+    return NULL;
+}
+
+/* Check whether an item is ready without waiting, pushing its value if so */
+static bool eco_select_poll(lua_State *L, int idx, int i)
+{
+    struct eco_reader *rd;
+    struct eco_channel *ch;
+    struct eco_waitq *q;
+    struct eco_io *io;
+
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+        if (lua_tonumber(L, idx) > 0)
+            return false;
+
+        lua_pushboolean(L, true);
+        return true;
+    }
+
+    ch = luaL_testudata(L, idx, ECO_CHANNEL_MT);
+    if (ch) {
+        if (eco_chan_try_recv(L, ch, idx))
+            return true;
+
+        if (!ch->closed)
+            return false;
+
+        lua_pushnil(L);
+        return true;
+    }
+
+    q = luaL_testudata(L, idx, ECO_WAITQ_MT);
+    if (q) {
+        if (!q->closed)
+            return false;
+
+        lua_pushnil(L);
+        return true;
+    }
+
+    io = eco_select_toio(L, idx);
+    if (!io)
+        luaL_error(L, "bad item #%d in list (channel, waitq, io, reader or number expected)", i);
+
+    if (!io->efd)
+        luaL_error(L, "bad item #%d in list (closed)", i);
+
+    rd = luaL_testudata(L, idx, ECO_READER_MT);
+    if (rd && rd->len > 0) {
+        lua_pushboolean(L, true);
+        return true;
+    }
+
+    eco_io_check_busy(L, io, EPOLLIN);
+
+    if (eco_io_poll_ready(io, EPOLLIN)) {
+        lua_pushboolean(L, true);
+        return true;
+    }
+
+    return false;
+}
 
-    eco_check_custom_rw_callback_args(L, narg);
+/* Link waiter `w` to the item at `idx`, which is known not to be ready */
+static int eco_select_park_on(lua_State *L, struct eco_waiter *w, int idx)
+{
+    struct eco_channel *ch;
+    struct eco_waitq *q;
+    struct eco_io *io;
 
-    wr = eco_new_fd_userdata(L, fd, sizeof(struct eco_writer), ECO_WRITER_MT);
-    if (!wr)
-        return push_errno(L, errno);
+    if (lua_type(L, idx) == LUA_TNUMBER)
+        return 0;
 
-    eco_io_init(L, &wr->io, fd);
+    ch = luaL_testudata(L, idx, ECO_CHANNEL_MT);
+    if (ch) {
+        eco_park_on(w, &ch->recvq);
+        return 0;
+    }
 
-    if (narg > 1) {
-        wr->write = lua_topointer(L, 2);
+    q = luaL_testudata(L, idx, ECO_WAITQ_MT);
+    if (q) {
+        eco_park_on(w, &q->waiters);
+        return 0;
+    }
 
-        if (narg > 2)
-            wr->ctx = (void *)lua_topointer(L, 3);
+    io = eco_select_toio(L, idx);
+
+    /* Listed twice, possibly through another object on the same fd */
+    if (io->co || io->efd->read_io)
+        return 0;
+
+    if (eco_io_arm(L, io, EPOLLIN) < 0) {
+        eco_io_detach(io);
+        return -1;
     }
 
-    return 1;
+    io->waiter = w;
+    w->io = io;
+    w->queued = true;
+
+    return 0;
 }
 
-static int lua_eco_sleepk(lua_State *L, int status, lua_KContext ctx)
+static int lua_eco_selectk(lua_State *L, int status, lua_KContext ctx)
 {
     struct eco_scheduler *sched = get_eco_scheduler(L);
-    struct eco_timer *timer = (struct eco_timer *)ctx;
+    struct eco_park *p = (struct eco_park *)ctx;
+    struct eco_waiter *w;
 
-    eco_timer_free(sched, timer);
+    if (!eco_park_finish(sched, p))
+        return lua_yieldk(L, 0, ctx, lua_eco_selectk);
 
-    return 0;
+    if (!p->index) {
+        if (!p->timer_index)
+            return push_nil_string(L, "timeout");
+
+        lua_pushinteger(L, p->timer_index);
+        lua_pushboolean(L, true);
+        return 2;
+    }
+
+    w = &p->waiters[p->index - 1];
+
+    if (w->io && p->closed)
+        return push_nil_string(L, "canceled");
+
+    lua_pushinteger(L, p->index);
+
+    if (p->ref != LUA_NOREF) {
+        eco_chan_push_ref(L, p->ref);
+        p->ref = LUA_NOREF;
+    } else if (p->closed) {
+        lua_pushnil(L);
+    } else {
+        lua_pushboolean(L, true);
+    }
+
+    return 2;
 }
 
 /**
- * Suspend the current coroutine for a given delay.
+ * Wait on several sources at once and return the first one ready.
  *
- * This function yields the current Lua coroutine and resumes it
- * after `delay` seconds.
+ * The list may hold:
  *
- * @function sleep
- * @tparam number delay Number of seconds to sleep.
+ * - @{channel}: ready when a value can be received, which is returned.
+ *   A closed and drained channel is ready and yields `nil`.
+ * - @{waitq} (and so `eco.sync` conds): ready when signaled, yields the
+ *   data passed to @{waitq:signal} or `true`. A closed queue yields `nil`.
+ * - @{io} and @{reader}: ready when the descriptor is readable (or a
+ *   reader holds buffered data), yields `true`. Nothing is read.
+ * - a number: a timer firing after that many seconds, yields `true`.
+ *
+ * The coroutine is parked once on all of them: the first source to fire
+ * wakes it and unlinks the others. Items are checked in list order, so
+ * earlier items take priority when several are ready.
  *
+ * @function select
+ * @tparam table list Wait sources.
+ * @tparam[opt] number timeout Timeout in seconds (default nil = no timeout).
+ * @treturn integer Index of the ready item in the list.
+ * @return Value of the ready item.
+ * @treturn[2] nil On timeout or error.
+ * @treturn[2] string `"timeout"`, `"canceled"` or an error message.
  * @usage
- * print('Sleeping for 1 second...')
- * eco.run(function()
- *     eco.sleep(1)
- *     print('Awake!')
- * end)
+ * local i, v = eco.select({ ch1, ch2, rd, 5.0 })
+ * if i == 3 then
+ *     local data = rd:read(1024)
+ * end
  */
-static int lua_eco_sleep(lua_State *L)
+static int lua_eco_select(lua_State *L)
 {
     struct eco_scheduler *sched = get_eco_scheduler(L);
-    double delay = luaL_checknumber(L, 1);
-    struct eco_timer *timer;
+    double timeout = lua_tonumber(L, 2);
+    double delay = 0;
+    int timer_index = 0;
+    struct eco_park *p;
+    int n, base;
 
-    luaL_argcheck(L, delay >= 0, 1, "delay must be greater than or equal to 0");
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
 
-    timer = eco_timer_alloc(sched);
-    if (!timer)
-        return luaL_error(L, "failed to allocate timer");
+    n = lua_rawlen(L, 1);
+    luaL_argcheck(L, n > 0, 1, "empty list");
 
-    eco_timer_start(sched, L, timer, delay);
+    /* Anchor the items on the stack: they link to our waiters */
+    luaL_checkstack(L, n + 4, NULL);
 
-    return lua_yieldk(L, 0, (lua_KContext)timer, lua_eco_sleepk);
+    base = lua_gettop(L);
+
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+
+        if (eco_select_poll(L, base + i, i)) {
+            lua_pushinteger(L, i);
+            lua_insert(L, -2);
+            return 2;
+        }
+
+        if (lua_type(L, base + i) == LUA_TNUMBER) {
+            double d = lua_tonumber(L, base + i);
+
+            if (!timer_index || d < delay) {
+                timer_index = i;
+                delay = d;
+            }
+        }
+    }
+
+    if (timer_index && (timeout <= 0 || delay <= timeout))
+        timeout = delay;
+    else
+        timer_index = 0;
+
+    p = eco_park_new(L, sched, n, timeout);
+    p->timer_index = timer_index;
+
+    for (int i = 0; i < n; i++) {
+        if (eco_select_park_on(L, &p->waiters[i], base + i + 1) < 0) {
+            int err = errno;
+
+            eco_timer_stop(sched, &p->timer);
+            eco_park_dequeue(p);
+            return push_errno(L, err);
+        }
+    }
+
+    return lua_yieldk(L, 0, (lua_KContext)p, lua_eco_selectk);
 }
 
 /**
@@ -1802,6 +5251,9 @@ static int lua_eco_sleep(lua_State *L)
  * and its arguments into it, and resumes the coroutine immediately.
  * The coroutine is tracked internally by `eco`.
  *
+ * If the coroutine pool is enabled by @{set_co_pool_size}, a finished
+ * coroutine is taken from the pool instead of creating a new one.
+ *
  * @function run
  * @tparam function func Function to run in the new coroutine.
  * @param ... Arguments to pass to the function.
@@ -1816,19 +5268,20 @@ static int lua_eco_sleep(lua_State *L)
  */
 static int lua_eco_run(lua_State *L)
 {
+    struct eco_scheduler *sched = get_eco_scheduler(L);
     int top = lua_gettop(L);
     lua_State *co;
 
     luaL_checktype(L, 1, LUA_TFUNCTION); /* func, a1, a2,... */
 
-    co = lua_newthread(L);  /* func, a1, a2,..., co */
+    co = eco_co_pool_get(sched, L);  /* func, a1, a2,..., co */
 
     lua_rotate(L, 1, 1);    /* co, func, a1, a2,... */
     lua_xmove(L, co, top);  /* co */
 
     set_obj(L, &eco_co_key, -1, co);
 
-    eco_resume_direct(L, co, top - 1);
+    eco_resume_direct(sched, L, co, top - 1);
 
     return 1;
 }
@@ -1840,7 +5293,7 @@ static int lua_eco_resume(lua_State *L)
     luaL_checktype(L, 1, LUA_TTHREAD);
 
     co = lua_tothread(L, 1);
-    eco_ready(L, co, NULL);
+    eco_ready(L, co, get_eco_scheduler(L));
 
     return 0;
 }
@@ -1940,7 +5393,8 @@ static int lua_eco_set_panic_hook(lua_State *L)
  * If a single `resume` runs longer than this timeout, eco triggers panic
  * and prints traceback via the existing panic path.
  *
- * The default timeout is 5000 milliseconds.
+ * The default timeout is 5000 milliseconds. Pass `0` to opt out and
+ * save the two clock reads it takes on each resume.
  *
  * @function set_watchdog_timeout
  * @tparam integer ms Timeout in milliseconds, `0` means disabled.
@@ -1958,16 +5412,177 @@ static int lua_eco_set_watchdog_timeout(lua_State *L)
     return 0;
 }
 
+/**
+ * Tune the event loop.
+ *
+ * Fields not present in `opts` keep their current value.
+ *
+ * @function set_loop_options
+ * @tparam table opts
+ * @tparam[opt] integer opts.max_events Upper bound of the number of events
+ * fetched per wait, in range [1, 65536]. The batch starts at 128 and doubles
+ * whenever it comes back full. Default is 1024.
+ * @tparam[opt] integer opts.busy_poll Spin window in microseconds, in range
+ * [0, 1000000]. Before blocking, the loop keeps polling without sleeping for
+ * up to this long, which lowers wakeup latency at the cost of CPU time.
+ * Default is `0` (disabled).
+ * @tparam[opt] boolean opts.edge_triggered Register fds with `EPOLLET`.
+ * An fd is then added to epoll once, for both directions, the first time a
+ * coroutine waits on it, and waiters come and go without any `epoll_ctl`.
+ * Changing it only affects fds registered afterwards. Has no effect with
+ * the io_uring backend. Default is `false`.
+ * @usage
+ * eco.set_loop_options({ max_events = 4096, busy_poll = 50 })
+ */
+static int lua_eco_set_loop_options(lua_State *L)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+    lua_Integer max_events = sched->max_events;
+    lua_Integer busy_poll = sched->busy_poll;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    lua_getfield(L, 1, "max_events");
+    max_events = luaL_optinteger(L, -1, max_events);
+    luaL_argcheck(L, max_events > 0 && max_events <= EVENTS_MAX_LIMIT,
+              1, "max_events must be in range [1, 65536]");
+    lua_pop(L, 1);
+
+    lua_getfield(L, 1, "busy_poll");
+    busy_poll = luaL_optinteger(L, -1, busy_poll);
+    luaL_argcheck(L, busy_poll >= 0 && busy_poll <= BUSY_POLL_MAX,
+              1, "busy_poll must be in range [0, 1000000]");
+    lua_pop(L, 1);
+
+    if (lua_getfield(L, 1, "edge_triggered") != LUA_TNIL)
+        sched->edge_triggered = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    sched->max_events = max_events;
+    sched->busy_poll = busy_poll;
+
+    /*
+     * Don't shrink the array itself, this may be called while
+     * eco_process_io is walking it.
+     */
+    if (sched->nevents > max_events)
+        sched->nevents = max_events;
+
+    return 0;
+}
+
+/**
+ * Set the maximum number of finished coroutines kept for reuse by @{run}.
+ *
+ * Reusing coroutines saves a `lua_newthread` allocation and the related GC
+ * work per task, which matters for servers spawning one coroutine per
+ * connection. The pool is disabled by default (size `0`).
+ *
+ * When the pool is enabled, a coroutine object may be handed out again by
+ * @{run} after it finished. Code must not keep using a coroutine reference
+ * (for example with `eco._resume`) once that coroutine has returned.
+ *
+ * Shrinking the pool releases the surplus coroutines immediately.
+ *
+ * @function set_co_pool_size
+ * @tparam integer size Maximum number of pooled coroutines, `0` disables the pool.
+ */
+static int lua_eco_set_co_pool_size(lua_State *L)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+    lua_Integer size = luaL_checkinteger(L, 1);
+
+    luaL_argcheck(L, size >= 0 && size <= UINT32_MAX, 1, "size out of range");
+
+    sched->co_pool_size = size;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_co_pool_key);
+
+    while (sched->co_pool_count > size) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, sched->co_pool_count--);
+    }
+
+    lua_pop(L, 1);
+
+    return 0;
+}
+
+/**
+ * Get statistics of the coroutine pool.
+ *
+ * The returned table contains the following fields:
+ *
+ * - `size`: maximum number of pooled coroutines.
+ * - `count`: number of coroutines currently in the pool.
+ * - `hits`: number of @{run} calls served from the pool.
+ * - `misses`: number of @{run} calls that had to create a coroutine while
+ *   the pool was enabled.
+ *
+ * @function co_pool_stats
+ * @treturn table
+ *
+ * @usage
+ * local st = eco.co_pool_stats()
+ * print('hit rate:', st.hits / math.max(1, st.hits + st.misses))
+ */
+static int lua_eco_co_pool_stats(lua_State *L)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+
+    lua_createtable(L, 0, 4);
+
+    lua_add_constant(L, "size", sched->co_pool_size);
+    lua_add_constant(L, "count", sched->co_pool_count);
+    lua_add_constant(L, "hits", sched->co_pool_hits);
+    lua_add_constant(L, "misses", sched->co_pool_misses);
+
+    return 1;
+}
+
+/**
+ * Get the cached loop time.
+ *
+ * Returns the monotonic time, in seconds, that the scheduler uses as the
+ * base of all timers. It is refreshed once per loop iteration after waiting
+ * for events (and whenever the scheduler samples the clock anyway), so it
+ * is cheap to call but may lag behind the real time while a coroutine runs
+ * for a long time. Use @{update_time} to refresh it.
+ *
+ * @function now
+ * @treturn number Monotonic time in seconds, with millisecond resolution.
+ */
+static int lua_eco_now(lua_State *L)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+    lua_pushnumber(L, sched->loop_time / 1000.0);
+    return 1;
+}
+
+/**
+ * Refresh the cached loop time.
+ *
+ * Timers started after a long computation are relative to the cached loop
+ * time. Call this first if they must be relative to the real current time.
+ *
+ * @function update_time
+ * @treturn number Monotonic time in seconds, with millisecond resolution.
+ */
+static int lua_eco_update_time(lua_State *L)
+{
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+    lua_pushnumber(L, eco_update_time(sched) / 1000.0);
+    return 1;
+}
+
 static int get_next_timeout(struct eco_scheduler *sched, uint64_t now)
 {
-    struct eco_timer *timer;
+    struct eco_timer *timer = eco_timer_first(sched);
     int64_t diff;
 
-    if (list_empty(&sched->timers))
+    if (!timer)
         return -1;
 
-    timer = list_first_entry(&sched->timers, struct eco_timer, list);
-
     diff = timer->at - now;
 
     return diff > 0 ? diff : 0;
@@ -1976,22 +5591,21 @@ static int get_next_timeout(struct eco_scheduler *sched, uint64_t now)
 static void eco_resume_io(lua_State *L, struct eco_io *io)
 {
     io->fairness_yield = false;
-    eco_io_ready(L, NULL, io);
+    eco_io_ready(L, io);
 }
 
 static void eco_process_timeouts(struct eco_scheduler *sched, lua_State *L, uint64_t now)
 {
     struct eco_timer *timer;
 
-    while (!list_empty(&sched->timers)) {
-        timer = list_first_entry(&sched->timers, struct eco_timer, list);
+    while ((timer = eco_timer_first(sched))) {
         lua_State *co = timer->co;
 
         if (timer->at > now)
             break;
 
         if (co) {
-            eco_timer_stop(timer);
+            eco_timer_stop(sched, timer);
             eco_ready(L, co, sched);
         } else {
             struct eco_io *io = container_of(timer, struct eco_io, timer);
@@ -2000,29 +5614,175 @@ static void eco_process_timeouts(struct eco_scheduler *sched, lua_State *L, uint
                 io->is_timeout = true;
 
             io->fairness_yield = false;
-            eco_io_ready(L, sched, io);
+            eco_io_ready(L, io);
         }
     }
 }
 
 static void eco_process_ready(lua_State *L, struct eco_scheduler *sched);
 
-static void eco_process_io(lua_State *L, int nfds, struct epoll_event *events)
+#ifdef ECO_IO_URING
+/*
+ * Translate poll completions into epoll events for eco_process_io. The
+ * completions of socket requests make their coroutines ready.
+ */
+static int eco_uring_wait_events(struct eco_scheduler *sched, lua_State *L, int timeout)
 {
-    struct eco_scheduler *sched = get_eco_scheduler(L);
+    struct epoll_event *events = sched->events;
+    struct io_uring_cqe cqes[64];
+    int nfds = 0;
+
+    if (eco_uring_wait(sched->uring, timeout) < 0)
+        return -1;
+
+    /* Every reaped request lands in uring_done, which is sized like events */
+    while (sched->uring_ndone < sched->nevents) {
+        int max = sched->nevents - sched->uring_ndone;
+        int i, n;
+
+        n = eco_uring_reap(sched->uring, cqes, max < 64 ? max : 64);
+        if (n == 0)
+            break;
+
+        for (i = 0; i < n; i++) {
+            uintptr_t data = cqes[i].user_data;
+            struct eco_uring_poll *req;
+            struct eco_fd *efd;
+
+            /* completion of a poll removal or a cancel */
+            if (!data)
+                continue;
+
+            if (data & ECO_URING_OP_TAG) {
+                struct eco_uring_op *op = (struct eco_uring_op *)(data & ~ECO_URING_OP_TAG);
+
+                eco_io_op_complete(L, container_of(op, struct eco_io, op), cqes[i].res);
+                continue;
+            }
+
+            req = (struct eco_uring_poll *)data;
+            efd = req->efd;
+
+            sched->uring_done[sched->uring_ndone++] = req;
+
+            /* the request was removed or replaced in the meantime */
+            if (efd->poll != req)
+                continue;
+
+            efd->poll = NULL;
+
+            events[nfds].events = cqes[i].res < 0 ? EPOLLERR : cqes[i].res;
+            eco_ev_set_efd(&events[nfds], efd);
+            nfds++;
+        }
+    }
+
+    return nfds;
+}
+
+/* Free completed poll requests and re-arm fds that still have waiters. */
+static void eco_uring_release(struct eco_scheduler *sched, lua_State *L)
+{
+    int i;
+
+    for (i = 0; i < sched->uring_ndone; i++) {
+        struct eco_uring_poll *req = sched->uring_done[i];
+        struct eco_fd *efd = req->efd;
+
+        list_del(&req->list);
+        free(req);
+
+        if (efd->events && !efd->poll && eco_uring_arm(sched, efd) < 0) {
+            /* let the waiters retry and report the error */
+            if (efd->read_io)
+                eco_resume_io(L, efd->read_io);
+
+            if (efd->write_io)
+                eco_resume_io(L, efd->write_io);
+        }
+
+        eco_fd_put(sched, efd);
+    }
+
+    sched->uring_ndone = 0;
+}
+#endif
+
+static int eco_backend_wait(struct eco_scheduler *sched, lua_State *L, int timeout)
+{
+#ifdef ECO_IO_URING
+    if (sched->uring) {
+        int nfds = eco_uring_wait_events(sched, L, timeout);
+
+        /* Nothing refers to the reaped requests, don't let them pile up */
+        if (nfds == 0)
+            eco_uring_release(sched, L);
+
+        return nfds;
+    }
+#endif
+
+    return epoll_wait(sched->epoll_fd, sched->events, sched->nevents, timeout);
+}
+
+/*
+ * With busy polling enabled, poll without blocking for up to busy_poll us
+ * (never beyond the next timer) before falling back to a blocking wait.
+ * This trades CPU time for wakeup latency.
+ */
+static int eco_wait_events(struct eco_scheduler *sched, lua_State *L, int timeout)
+{
+    if (sched->busy_poll && timeout != 0) {
+        uint64_t now = eco_time_now_us();
+        uint64_t deadline = now + sched->busy_poll;
+        int nfds;
+
+        if (timeout > 0 && deadline > now + (uint64_t)timeout * 1000)
+            deadline = now + (uint64_t)timeout * 1000;
+
+        do {
+            nfds = eco_backend_wait(sched, L, 0);
+            if (nfds != 0 || sched->ready_count || got_sigint)
+                return nfds;
+        } while (eco_time_now_us() < deadline);
+
+        timeout = get_next_timeout(sched, eco_update_time(sched));
+    }
+
+    return eco_backend_wait(sched, L, timeout);
+}
 
+static void eco_process_io(struct eco_scheduler *sched, lua_State *L,
+            int nfds, struct epoll_event *events)
+{
     for (int i = 0; i < nfds; i++) {
-        struct eco_fd *efd = events[i].data.ptr;
-        eco_fd_ref(efd);
+        struct eco_fd *efd = eco_ev_efd(&events[i]);
+
+        if (events[i].data.u64 & ECO_EV_ET_TAG) {
+            efd = eco_fd_find(sched, events[i].data.u64 >> 1);
+            eco_ev_set_efd(&events[i], efd);
+        }
+
+        if (efd)
+            eco_fd_ref(efd);
     }
 
     for (int i = 0; i < nfds; i++) {
-        struct eco_fd *efd = events[i].data.ptr;
+        struct eco_fd *efd = eco_ev_efd(&events[i]);
         int ev = events[i].events;
         uintptr_t resumed_io = 0;
         struct eco_io *io;
 
-        if (ev & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        if (!efd)
+            continue;
+
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+            efd->readable = true;
+
+        if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            efd->writable = true;
+
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
             io = efd->read_io;
             if (io && io->co) {
                 resumed_io = (uintptr_t)io;
@@ -2040,42 +5800,29 @@ static void eco_process_io(lua_State *L, int nfds, struct epoll_event *events)
             io = efd->write_io;
             if (io && io->co && (uintptr_t)io != resumed_io)
                 eco_resume_io(L, io);
+            else if (io && io->flush_armed)
+                eco_writer_flush_ready(io);
         }
     }
 
     for (int i = 0; i < nfds; i++) {
-        struct eco_fd *efd = events[i].data.ptr;
-        eco_fd_put(efd);
+        struct eco_fd *efd = eco_ev_efd(&events[i]);
+
+        if (efd)
+            eco_fd_put(sched, efd);
     }
 }
 
 static void eco_process_ready(lua_State *L, struct eco_scheduler *sched)
 {
-    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_ready_key);
-
-    while (sched->ready_head) {
-        lua_State *co;
-
-        lua_rawgeti(L, -1, sched->ready_head);
-
-        co = (lua_State *)lua_topointer(L, -1);
-
-        lua_pop(L, 1);
-
-        lua_pushnil(L);
-        lua_rawseti(L, -2, sched->ready_head);
+    while (sched->ready_count) {
+        lua_State *co = sched->ready[sched->ready_head];
 
-        if (sched->ready_head == sched->ready_tail) {
-            sched->ready_head = 0;
-            sched->ready_tail = 0;
-        } else {
-            sched->ready_head++;
-        }
+        sched->ready_head = (sched->ready_head + 1) & (sched->ready_cap - 1);
+        sched->ready_count--;
 
-        eco_resume_direct(L, co, 0);
+        eco_resume_direct(sched, L, co, 0);
     }
-
-    lua_pop(L, 1);
 }
 
 /**
@@ -2093,7 +5840,6 @@ static void eco_process_ready(lua_State *L, struct eco_scheduler *sched)
 static int lua_eco_loop(lua_State *L)
 {
     struct eco_scheduler *sched = get_eco_scheduler(L);
-    struct epoll_event events[MAX_EVENTS];
     struct sigaction old_sigpipe;
     struct sigaction old_sigint;
     struct sigaction old_sigchld;
@@ -2104,6 +5850,14 @@ static int lua_eco_loop(lua_State *L)
 
     sched->quit = false;
 
+    /*
+     * Signal dispositions are per process: only the main loop installs the
+     * handlers and reaps children. Threads started by eco.threads block
+     * these signals and only watch got_sigint.
+     */
+    if (sched->worker)
+        goto loop;
+
     got_sigint = 0;
     got_sigchld = 0;
 
@@ -2125,26 +5879,33 @@ static int lua_eco_loop(lua_State *L)
     }
     sigchld_installed = true;
 
+loop:
+    eco_update_time(sched);
+
     while (!sched->quit) {
-        uint64_t now = eco_time_now();
         int next_time;
         int nfds;
 
-        eco_process_timeouts(sched, L, now);
+        eco_process_timeouts(sched, L, sched->loop_time);
 
         eco_process_sigchld(L, sched);
 
         eco_process_ready(L, sched);
 
+        eco_process_flush(sched);
+
         if (sched->quit)
             break;
 
-        next_time = get_next_timeout(sched, now);
+        next_time = get_next_timeout(sched, sched->loop_time);
 
         if (next_time < 0 && sched->nfd < 1)
             break;
 
-        nfds = epoll_wait(sched->epoll_fd, events, MAX_EVENTS, next_time);
+        nfds = eco_wait_events(sched, L, next_time);
+
+        eco_update_time(sched);
+
         if (nfds < 0) {
             if (errno == EINTR) {
                 if (got_sigint)
@@ -2157,7 +5918,14 @@ static int lua_eco_loop(lua_State *L)
             goto out;
         }
 
-        eco_process_io(L, nfds, events);
+        eco_process_io(sched, L, nfds, sched->events);
+
+#ifdef ECO_IO_URING
+        eco_uring_release(sched, L);
+#endif
+
+        if (nfds == sched->nevents)
+            eco_events_grow(sched);
 
         if (got_sigint)
             break;
@@ -2201,42 +5969,72 @@ static int lua_eco_init(lua_State *L)
 {
     struct eco_scheduler *sched = get_eco_scheduler(L);
     pid_t curpid = getpid();
-    int epoll_fd;
-    int i;
 
     if (curpid == sched->pid)
         return luaL_error(L, "eco._init() is only allowed in child process after fork()");
 
-    close(sched->epoll_fd);
+    /* The io_uring rings are shared with the parent, never reuse them */
+    eco_backend_exit(sched);
 
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0)
+    if (eco_backend_init(sched) < 0)
         return luaL_error(L, "failed to create epoll: %s", strerror(errno));
 
-    sched->epoll_fd = epoll_fd;
     sched->pid = curpid;
+    sched->worker = false;  /* the forking thread is the only one left */
+    sched->epoll_gen++;
 
     INIT_LIST_HEAD(&sched->timer_cache);
-    INIT_LIST_HEAD(&sched->timers);
-    for (i = 0; i < FD_HASH_BUCKETS; i++)
-        INIT_LIST_HEAD(&sched->fds[i]);
 
+    /* Objects still referenced by I/O handles go back to fd_free once released */
+    if (sched->fds_cap)
+        memset(sched->fds, 0, sched->fds_cap * sizeof(struct eco_fd *));
+
+    sched->timer_count = 0;
     sched->nfd = 0;
     sched->quit = false;
     sched->ready_head = 0;
-    sched->ready_tail = 0;
+    sched->ready_count = 0;
     sched->resumed_at = 0;
+    sched->io_budget = IO_FAIRNESS_OPS;
     sched->co_run_timeout = CO_RUN_TIMEOUT;
 
+    eco_update_time(sched);
+
     lua_newtable(L);
     lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_co_key);
 
+#ifdef ECO_IO_URING
     lua_newtable(L);
-    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_ready_key);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_uring_op_key);
+#endif
 
     return 0;
 }
 
+/**
+ * Get the name of the event notification backend in use.
+ *
+ * Returns `"io_uring"` when eco is built with `ECO_IO_URING` and the
+ * kernel supports it, otherwise `"epoll"`.
+ *
+ * @function backend
+ * @treturn string
+ */
+static int lua_eco_backend(lua_State *L)
+{
+#ifdef ECO_IO_URING
+    struct eco_scheduler *sched = get_eco_scheduler(L);
+
+    if (sched->uring) {
+        lua_pushliteral(L, "io_uring");
+        return 1;
+    }
+#endif
+
+    lua_pushliteral(L, "epoll");
+    return 1;
+}
+
 static int lua_eco_set_sigchld_hook(lua_State *L)
 {
     struct eco_scheduler *sched = get_eco_scheduler(L);
@@ -2247,12 +6045,23 @@ static const struct luaL_Reg funcs[] = {
     {"io", lua_eco_io},
     {"reader", lua_eco_reader},
     {"writer", lua_eco_writer},
+    {"splice", lua_eco_splice},
+    {"buffer", lua_eco_buffer},
     {"sleep", lua_eco_sleep},
+    {"waitq", lua_eco_waitq},
+    {"channel", lua_eco_channel},
+    {"select", lua_eco_select},
     {"run", lua_eco_run},
     {"count", lua_eco_count},
     {"all", lua_eco_all},
     {"set_panic_hook", lua_eco_set_panic_hook},
     {"set_watchdog_timeout", lua_eco_set_watchdog_timeout},
+    {"set_co_pool_size", lua_eco_set_co_pool_size},
+    {"set_loop_options", lua_eco_set_loop_options},
+    {"now", lua_eco_now},
+    {"update_time", lua_eco_update_time},
+    {"backend", lua_eco_backend},
+    {"co_pool_stats", lua_eco_co_pool_stats},
     {"loop", lua_eco_loop},
     {"unloop", lua_eco_unloop},
     {"_resume", lua_eco_resume},
@@ -2268,8 +6077,14 @@ int luaopen_eco(lua_State *L)
     creat_metatable(L, ECO_IO_MT, io_metatable, io_methods);
     creat_metatable(L, ECO_READER_MT, reader_metatable, reader_methods);
     creat_metatable(L, ECO_WRITER_MT, writer_metatable, writer_methods);
-
-    luaL_newlib(L, funcs);
+    creat_metatable(L, ECO_SPLICE_MT, splice_metatable, NULL);
+    creat_metatable(L, ECO_BUFFER_MT, buffer_metatable, buffer_methods);
+    creat_metatable(L, ECO_WAITQ_MT, waitq_metatable, waitq_methods);
+    creat_metatable(L, ECO_CHANNEL_MT, channel_metatable, channel_methods);
+
+    luaL_newlibtable(L, funcs);
+    lua_insert(L, -2);
+    luaL_setfuncs(L, funcs, 1);
 
     lua_add_constant(L, "VERSION_MAJOR", ECO_VERSION_MAJOR);
     lua_add_constant(L, "VERSION_MINOR", ECO_VERSION_MINOR);
@@ -38,6 +38,7 @@
 #endif
 
 int luaopen_eco(lua_State *L);
+int luaopen_eco_internal_threads(lua_State *L);
 
 static inline int push_errno(lua_State *L, int err)
 {
@@ -0,0 +1,87 @@
+#!/usr/bin/env eco
+
+-- Throughput of delimiter search in reader:read('l') and reader:readuntil
+-- over large buffers and short parts.
+--
+-- Usage: eco examples/benchmark/delimiter.lua [megabytes]
+
+local socket = require 'eco.socket'
+local time = require 'eco.time'
+local eco = require 'eco'
+
+local total = (tonumber(arg[1]) or 256) * 1024 * 1024
+local bufsize = 1024 * 1024
+
+local function report(name, bytes, elapsed)
+    print(string.format('%-28s %8.1f MB %8.3f s %10.1f MB/s', name, bytes / 1048576,
+        elapsed, bytes / 1048576 / elapsed))
+end
+
+local function make_pair()
+    local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    if not s1 then
+        error(s2)
+    end
+    return s1, s2
+end
+
+-- Sends `unit` until `total` bytes were sent, while `consume` reads them.
+local function run(name, unit, consume)
+    local s1, s2 = make_pair()
+    local rd = eco.reader(s1:getfd(), { bufsize = bufsize, maxbufsize = bufsize })
+    local n = total // #unit
+    local done = false
+
+    eco.run(function()
+        for _ = 1, n do
+            s2:send(unit)
+        end
+    end)
+
+    local start = time.now()
+
+    eco.run(function()
+        consume(rd, n)
+        report(name, n * #unit, time.now() - start)
+        done = true
+    end)
+
+    while not done do
+        time.sleep(0.01)
+    end
+
+    s1:close()
+    s2:close()
+end
+
+-- Text with frequent '-' and '\r', so the first needle byte matches often
+local filler = {}
+for i = 1, 256 * 1024 do
+    filler[i] = i % 37 == 0 and '-' or (i % 41 == 0 and '\r' or string.char(97 + i % 26))
+end
+filler = table.concat(filler)
+
+run('read(\'l\') 256 KiB lines', filler .. '\n', function(rd, n)
+    for _ = 1, n do
+        assert(rd:read('l'))
+    end
+end)
+
+run('readuntil 256 KiB parts', filler .. '\r\n--boundary1234567890', function(rd, n)
+    for _ = 1, n do
+        repeat
+            local data, found = rd:readuntil('\r\n--boundary1234567890')
+            assert(data, found)
+        until found
+    end
+end)
+
+-- Short parts: the cost of setting up each search dominates
+run('readuntil 1 KiB parts', filler:sub(1, 1024) .. '\r\n--boundary1234567890', function(rd, n)
+    for _ = 1, n do
+        repeat
+            local data, found = rd:readuntil('\r\n--boundary1234567890')
+            assert(data, found)
+        until found
+    end
+end)
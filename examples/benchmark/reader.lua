@@ -0,0 +1,105 @@
+#!/usr/bin/env eco
+
+-- Micro-benchmark of reader:read on a socketpair.
+--
+-- Usage: eco examples/benchmark/reader.lua [iterations]
+
+local socket = require 'eco.socket'
+local time = require 'eco.time'
+local eco = require 'eco'
+
+local iterations = tonumber(arg[1]) or 200000
+
+local function report(name, n, elapsed)
+    print(string.format('%-24s %10d ops %8.3f s %10.1f ns/op', name, n, elapsed, elapsed * 1e9 / n))
+end
+
+local function make_pair()
+    local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    if not s1 then
+        error(s2)
+    end
+    return s1, s2
+end
+
+-- Every read is served from data already queued in the kernel,
+-- so each call costs one read(2) plus the eco bookkeeping around it.
+local function bench_read_syscall()
+    local s1, s2 = make_pair()
+    local rd = eco.reader(s1:getfd())
+    local chunk = string.rep('x', 64)
+    local batch = 1024
+
+    local start = time.now()
+
+    for _ = 1, iterations // batch do
+        s2:send(chunk:rep(batch))
+
+        for _ = 1, batch do
+            rd:read(64)
+        end
+    end
+
+    report('read(64) syscall', iterations // batch * batch, time.now() - start)
+
+    s1:close()
+    s2:close()
+end
+
+-- Lines are served from the reader's internal buffer after the first fill.
+local function bench_read_line()
+    local s1, s2 = make_pair()
+    local rd = eco.reader(s1:getfd())
+    local line = string.rep('y', 15) .. '\n'
+    local batch = 256
+
+    local start = time.now()
+
+    for _ = 1, iterations // batch do
+        s2:send(line:rep(batch))
+
+        for _ = 1, batch do
+            rd:read('l')
+        end
+    end
+
+    report('read(\'l\') buffered', iterations // batch * batch, time.now() - start)
+
+    s1:close()
+    s2:close()
+end
+
+-- Each read has to park the coroutine and wait for the peer.
+local function bench_read_pingpong()
+    local s1, s2 = make_pair()
+    local rd1 = eco.reader(s1:getfd())
+    local rd2 = eco.reader(s2:getfd())
+    local wr1 = eco.writer(s1:getfd())
+    local wr2 = eco.writer(s2:getfd())
+    local n = iterations // 10
+
+    local start = time.now()
+
+    eco.run(function()
+        for _ = 1, n do
+            rd2:read(1)
+            wr2:write('b')
+        end
+    end)
+
+    eco.run(function()
+        for _ = 1, n do
+            wr1:write('a')
+            rd1:read(1)
+        end
+
+        report('read(1) ping-pong', n, time.now() - start)
+
+        s1:close()
+        s2:close()
+    end)
+end
+
+bench_read_syscall()
+bench_read_line()
+bench_read_pingpong()
@@ -30,6 +30,7 @@
 #endif
 
 #include <sys/statvfs.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/file.h>
 #include <sys/stat.h>
@@ -40,12 +41,17 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <libgen.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "eco.h"
+#include "list.h"
 
 #define ECO_FILE_DIR_MT "eco{file-dir}"
+#define ECO_FILE_AIO_MT "eco{file-aio}"
+#define ECO_FILE_AIO_LOOP_MT "eco{file-aio-loop}"
 
 /**
  * Commit filesystem caches to disk
@@ -570,6 +576,894 @@ static int lua_inotify_parse_event(lua_State *L)
     return 1;
 }
 
+/*
+ * Regular files are always "ready" for epoll, so reading or writing them
+ * from the loop blocks every coroutine on slow storage. These jobs run the
+ * syscalls on a small pool of worker threads instead. A finished job goes
+ * to the done list of its loop, whose eventfd wakes the loop up.
+ *
+ * A job runs one operation at a time, on the fd of the file it belongs to.
+ * Its buffers are owned by the job, so a job collected while its operation
+ * is still running is handed over to the worker, which frees it once done.
+ * For the same reason, the fd is closed by the last job using it, see
+ * aio_close.
+ */
+
+/* Worker threads shared by every loop in the process, started on demand */
+#define AIO_THREADS 4
+
+/* Reads smaller than this are rounded up, the rest serves the next ones */
+#define AIO_READ_AHEAD 16384
+
+/* Writes queued behind a running one, the worker goes on with them */
+#define AIO_WRITE_BEHIND 65536
+
+enum {
+    AIO_OPEN = 1,
+    AIO_READ,
+    AIO_WRITE,
+    AIO_FSYNC,
+    AIO_STAT,
+    AIO_FSTAT
+};
+
+enum {
+    AIO_IDLE,
+    AIO_RUNNING,
+    AIO_DONE
+};
+
+/* One per loop, the lists and counters are protected by aio_pool.lock */
+struct eco_file_aio_loop {
+    struct list_head done;  /* finished jobs the loop hasn't looked at yet */
+    int refs;               /* the Lua object and the jobs */
+    int efd;
+};
+
+/* The fd of a closed file, closed in turn by the last job using it */
+struct eco_file_aio_fd {
+    int fd;
+    int refs;
+};
+
+struct eco_file_aio {
+    struct list_head list;  /* in the pool's queue, or the loop's done list */
+    struct list_head node;  /* in the pool's list of every job */
+    struct eco_file_aio_loop *loop;
+    struct eco_file_aio_fd *closing;
+    int op;
+    int state;          /* protected by aio_pool.lock while running */
+    bool orphan;        /* the Lua object is gone, the worker frees the job */
+    int fd;             /* the file's fd, -1 for path operations */
+    char *path;
+    int flags;
+    int mode;
+    char *buf;
+    size_t buf_size;
+    char *next;         /* writes queued while running, protected by aio_pool.lock */
+    size_t next_len;
+    size_t next_size;
+    size_t len;         /* bytes to read or write */
+    size_t pos;         /* read data not handed out yet */
+    size_t avail;
+    ssize_t ret;
+    int err;
+    struct stat st;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct list_head queue;
+    struct list_head jobs;
+    int nthreads;
+    int idle;
+    int gen;    /* bumped in forked children */
+    bool atfork;
+} aio_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .queue = LIST_HEAD_INIT(aio_pool.queue),
+    .jobs = LIST_HEAD_INIT(aio_pool.jobs)
+};
+
+/* Called with aio_pool.lock held */
+static void eco_file_aio_loop_put(struct eco_file_aio_loop *loop)
+{
+    if (--loop->refs > 0)
+        return;
+
+    close(loop->efd);
+    free(loop);
+}
+
+/* Called with aio_pool.lock held: the queued writes become the next run */
+static void eco_file_aio_swap(struct eco_file_aio *job)
+{
+    char *buf = job->buf;
+    size_t size = job->buf_size;
+
+    job->buf = job->next;
+    job->buf_size = job->next_size;
+    job->len = job->next_len;
+
+    job->next = buf;
+    job->next_size = size;
+    job->next_len = 0;
+}
+
+static void eco_file_aio_free(struct eco_file_aio *job)
+{
+    struct eco_file_aio_fd *closing = job->closing;
+    bool last = false;
+
+    /* Nobody is left to take the fd an orphaned open returned */
+    if (job->orphan && job->op == AIO_OPEN && job->ret >= 0)
+        close(job->ret);
+
+    pthread_mutex_lock(&aio_pool.lock);
+
+    if (closing)
+        last = --closing->refs == 0;
+
+    list_del(&job->node);
+    eco_file_aio_loop_put(job->loop);
+
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    if (last) {
+        close(closing->fd);
+        free(closing);
+    }
+
+    free(job->path);
+    free(job->buf);
+    free(job->next);
+    free(job);
+}
+
+static void eco_file_aio_run(struct eco_file_aio *job)
+{
+    ssize_t ret = 0;
+    size_t written;
+
+    switch (job->op) {
+    case AIO_OPEN:
+        ret = open(job->path, job->flags, job->mode);
+        break;
+
+    case AIO_READ:
+        do {
+            ret = read(job->fd, job->buf, job->len);
+        } while (ret < 0 && errno == EINTR);
+        break;
+
+    case AIO_WRITE:
+        for (written = 0; written < job->len; written += ret) {
+            ret = write(job->fd, job->buf + written, job->len - written);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    ret = 0;
+                    continue;
+                }
+                break;
+            }
+        }
+
+        /* Written in full like eco.writer does, or failed */
+        if (ret >= 0)
+            ret = written;
+        break;
+
+    case AIO_FSYNC:
+        ret = fsync(job->fd);
+        break;
+
+    case AIO_STAT:
+        ret = stat(job->path, &job->st);
+        break;
+
+    case AIO_FSTAT:
+        ret = fstat(job->fd, &job->st);
+        break;
+    }
+
+    job->ret = ret;
+    job->err = ret < 0 ? errno : 0;
+}
+
+static void *eco_file_aio_worker(void *arg)
+{
+    struct eco_file_aio *job;
+
+    while (1) {
+        pthread_mutex_lock(&aio_pool.lock);
+
+        aio_pool.idle++;
+
+        while (list_empty(&aio_pool.queue))
+            pthread_cond_wait(&aio_pool.cond, &aio_pool.lock);
+
+        aio_pool.idle--;
+
+        job = list_first_entry(&aio_pool.queue, struct eco_file_aio, list);
+        list_del_init(&job->list);
+
+        pthread_mutex_unlock(&aio_pool.lock);
+
+        eco_file_aio_run(job);
+
+        pthread_mutex_lock(&aio_pool.lock);
+
+        /* Go on with the writes queued meanwhile, even for a closed file */
+        while (job->op == AIO_WRITE && job->ret >= 0 && job->next_len > 0) {
+            eco_file_aio_swap(job);
+
+            pthread_mutex_unlock(&aio_pool.lock);
+            eco_file_aio_run(job);
+            pthread_mutex_lock(&aio_pool.lock);
+        }
+
+        /* Dropped after a failure, which is reported instead */
+        job->next_len = 0;
+
+        if (job->orphan) {
+            pthread_mutex_unlock(&aio_pool.lock);
+            eco_file_aio_free(job);
+            continue;
+        }
+
+        job->state = AIO_DONE;
+
+        if (list_empty(&job->loop->done))
+            eventfd_write(job->loop->efd, 1);
+
+        list_add_tail(&job->list, &job->loop->done);
+
+        pthread_mutex_unlock(&aio_pool.lock);
+    }
+
+    return NULL;
+}
+
+/* Forked with the lock held, the lists are consistent in the child */
+static void eco_file_aio_atfork_prepare(void)
+{
+    pthread_mutex_lock(&aio_pool.lock);
+}
+
+static void eco_file_aio_atfork_parent(void)
+{
+    pthread_mutex_unlock(&aio_pool.lock);
+}
+
+/*
+ * The workers don't survive fork(), let the child start its own. The jobs
+ * they were running never complete in the child, they fail instead, and
+ * the orphaned ones are freed.
+ */
+static void eco_file_aio_atfork_child(void)
+{
+    struct eco_file_aio *job, *tmp;
+
+    pthread_mutex_init(&aio_pool.lock, NULL);
+    pthread_cond_init(&aio_pool.cond, NULL);
+    INIT_LIST_HEAD(&aio_pool.queue);
+    aio_pool.nthreads = 0;
+    aio_pool.idle = 0;
+    aio_pool.gen++;
+
+    list_for_each_entry_safe(job, tmp, &aio_pool.jobs, node) {
+        if (job->state != AIO_RUNNING)
+            continue;
+
+        /* Either in the queue just emptied, or in no list */
+        INIT_LIST_HEAD(&job->list);
+        job->next_len = 0;
+
+        if (job->orphan) {
+            job->ret = -1;
+            eco_file_aio_free(job);
+            continue;
+        }
+
+        job->state = AIO_DONE;
+        job->ret = -1;
+        job->err = ECANCELED;
+    }
+}
+
+/*
+ * Called with aio_pool.lock held.
+ *
+ * Workers are detached and may outlive the Lua state, e.g. finishing a
+ * write left behind by a timeout or by __gc. The module is linked with
+ * -z nodelete so that lua_close() doesn't unmap their code.
+ */
+static int eco_file_aio_spawn(void)
+{
+    sigset_t set, oldset;
+    pthread_t tid;
+    int err;
+
+    /* Signals are handled by the loops */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+    err = pthread_create(&tid, NULL, eco_file_aio_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (err)
+        return err;
+
+    pthread_detach(tid);
+    aio_pool.nthreads++;
+
+    return 0;
+}
+
+static int eco_file_aio_queue(struct eco_file_aio *job, int op)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&aio_pool.lock);
+
+    if (aio_pool.idle == 0 && aio_pool.nthreads < AIO_THREADS) {
+        err = eco_file_aio_spawn();
+
+        /* Fine as long as a busy worker will get to the job */
+        if (err && aio_pool.nthreads > 0)
+            err = 0;
+    }
+
+    if (!err) {
+        job->op = op;
+        job->state = AIO_RUNNING;
+        list_add_tail(&job->list, &aio_pool.queue);
+        pthread_cond_signal(&aio_pool.cond);
+    }
+
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    return err;
+}
+
+static int eco_file_aio_state(struct eco_file_aio *job)
+{
+    int state;
+
+    pthread_mutex_lock(&aio_pool.lock);
+    state = job->state;
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    return state;
+}
+
+/* Take the result of a finished job, the worker no longer touches it */
+static void eco_file_aio_reap(struct eco_file_aio *job)
+{
+    pthread_mutex_lock(&aio_pool.lock);
+    list_del_init(&job->list);
+    job->state = AIO_IDLE;
+    pthread_mutex_unlock(&aio_pool.lock);
+}
+
+static int eco_file_aio_reserve(char **buf, size_t *size, size_t len)
+{
+    char *p;
+
+    if (*size >= len)
+        return 0;
+
+    p = realloc(*buf, len);
+    if (!p)
+        return ENOMEM;
+
+    *buf = p;
+    *size = len;
+
+    return 0;
+}
+
+/*
+ * Read callback for an eco.reader created with `polled = false`: returning
+ * -EAGAIN makes the reader wait until it is notified, which file.lua does
+ * when the loop's eventfd reports the job done.
+ */
+static int eco_file_aio_read(void *buf, size_t len, void *ctx, char **err)
+{
+    struct eco_file_aio *job = ctx;
+    int ret;
+
+    switch (eco_file_aio_state(job)) {
+    case AIO_RUNNING:
+        return -EAGAIN;
+
+    case AIO_DONE:
+        eco_file_aio_reap(job);
+
+        if (job->ret < 0) {
+            *err = strerror(job->err);
+            return -1;
+        }
+
+        job->pos = 0;
+        job->avail = job->ret;
+
+        if (job->avail == 0)
+            return 0;
+        break;
+    }
+
+    if (job->avail > 0) {
+        if (len > job->avail)
+            len = job->avail;
+
+        memcpy(buf, job->buf + job->pos, len);
+        job->pos += len;
+        job->avail -= len;
+
+        return len;
+    }
+
+    if (len < AIO_READ_AHEAD)
+        len = AIO_READ_AHEAD;
+
+    ret = eco_file_aio_reserve(&job->buf, &job->buf_size, len);
+    if (!ret) {
+        job->len = len;
+        ret = eco_file_aio_queue(job, AIO_READ);
+    }
+
+    if (ret) {
+        *err = strerror(ret);
+        return -1;
+    }
+
+    return -EAGAIN;
+}
+
+static struct eco_file_aio_loop *eco_file_aio_loop_check(lua_State *L, int idx)
+{
+    struct eco_file_aio_loop **loop = luaL_checkudata(L, idx, ECO_FILE_AIO_LOOP_MT);
+
+    return *loop;
+}
+
+static int lua_aio_loop_efd(lua_State *L)
+{
+    struct eco_file_aio_loop *loop = eco_file_aio_loop_check(L, 1);
+
+    lua_pushinteger(L, loop->efd);
+    return 1;
+}
+
+/* Array of the jobs finished since the last call, as their ctx */
+static int lua_aio_loop_reap(lua_State *L)
+{
+    struct eco_file_aio_loop *loop = eco_file_aio_loop_check(L, 1);
+    struct eco_file_aio *job, *tmp;
+    eventfd_t v;
+    int n = 0, i = 0;
+
+    pthread_mutex_lock(&aio_pool.lock);
+    eventfd_read(loop->efd, &v);
+    list_for_each_entry(job, &loop->done, list)
+        n++;
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    /* Allocating may run finalizers, which drop closed jobs from the list */
+    lua_createtable(L, n, 0);
+
+    pthread_mutex_lock(&aio_pool.lock);
+
+    list_for_each_entry_safe(job, tmp, &loop->done, list) {
+        /* Finished in the meantime, left for the next call */
+        if (i == n) {
+            eventfd_write(loop->efd, 1);
+            break;
+        }
+
+        list_del_init(&job->list);
+        lua_pushlightuserdata(L, job);
+        lua_rawseti(L, -2, ++i);
+    }
+
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    return 1;
+}
+
+/* Wake the loop up without a finished job */
+static int lua_aio_loop_kick(lua_State *L)
+{
+    struct eco_file_aio_loop *loop = eco_file_aio_loop_check(L, 1);
+
+    eventfd_write(loop->efd, 1);
+    return 0;
+}
+
+static int lua_aio_loop_gc(lua_State *L)
+{
+    struct eco_file_aio_loop *loop = eco_file_aio_loop_check(L, 1);
+
+    pthread_mutex_lock(&aio_pool.lock);
+    eco_file_aio_loop_put(loop);
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    return 0;
+}
+
+/* Changes in a forked child, whose loops must not use the parent's state */
+static int lua_aio_gen(lua_State *L)
+{
+    lua_pushinteger(L, aio_pool.gen);
+    return 1;
+}
+
+static const struct luaL_Reg aio_loop_methods[] =  {
+    {"efd", lua_aio_loop_efd},
+    {"reap", lua_aio_loop_reap},
+    {"kick", lua_aio_loop_kick},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg aio_loop_mt[] =  {
+    {"__gc", lua_aio_loop_gc},
+    {NULL, NULL}
+};
+
+static int lua_aio_loop(lua_State *L)
+{
+    struct eco_file_aio_loop **p = lua_newuserdatauv(L, sizeof(struct eco_file_aio_loop *), 0);
+    struct eco_file_aio_loop *loop;
+
+    loop = calloc(1, sizeof(struct eco_file_aio_loop));
+    if (!loop)
+        return push_errno(L, ENOMEM);
+
+    loop->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop->efd < 0) {
+        int err = errno;
+        free(loop);
+        return push_errno(L, err);
+    }
+
+    INIT_LIST_HEAD(&loop->done);
+    loop->refs = 1;
+
+    /* A forked child must start over, even before any worker started */
+    pthread_mutex_lock(&aio_pool.lock);
+    if (!aio_pool.atfork) {
+        pthread_atfork(eco_file_aio_atfork_prepare, eco_file_aio_atfork_parent,
+                       eco_file_aio_atfork_child);
+        aio_pool.atfork = true;
+    }
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    *p = loop;
+    luaL_setmetatable(L, ECO_FILE_AIO_LOOP_MT);
+
+    return 1;
+}
+
+static struct eco_file_aio *eco_file_aio_check(lua_State *L)
+{
+    struct eco_file_aio **job = luaL_checkudata(L, 1, ECO_FILE_AIO_MT);
+
+    if (!*job)
+        luaL_error(L, "aio job is closed");
+
+    return *job;
+}
+
+static struct eco_file_aio *eco_file_aio_check_idle(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check(L);
+
+    if (eco_file_aio_state(job) != AIO_IDLE)
+        return NULL;
+
+    return job;
+}
+
+static int eco_file_aio_submit(lua_State *L, struct eco_file_aio *job, int op)
+{
+    int err = eco_file_aio_queue(job, op);
+
+    if (err)
+        return push_errno(L, err);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int lua_aio_open(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check_idle(L);
+    const char *path = luaL_checkstring(L, 2);
+    char *dup;
+
+    if (!job)
+        return push_errno(L, EBUSY);
+
+    dup = strdup(path);
+    if (!dup)
+        return push_errno(L, ENOMEM);
+
+    free(job->path);
+    job->path = dup;
+    job->flags = luaL_optinteger(L, 3, O_RDONLY);
+    job->mode = luaL_optinteger(L, 4, 0);
+
+    return eco_file_aio_submit(L, job, AIO_OPEN);
+}
+
+/*
+ * Hand data over to the worker, wait for it with result. Behind a running
+ * write, the data is queued and written by the same run. Returns false
+ * when the job is busy with something else or has enough queued already.
+ */
+static int lua_aio_write(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check(L);
+    size_t len;
+    const char *data = luaL_checklstring(L, 2, &len);
+    int state, err = 0;
+
+    pthread_mutex_lock(&aio_pool.lock);
+
+    state = job->state;
+
+    if (state == AIO_RUNNING) {
+        if (job->op != AIO_WRITE || job->next_len + len > AIO_WRITE_BEHIND) {
+            pthread_mutex_unlock(&aio_pool.lock);
+            lua_pushboolean(L, false);
+            return 1;
+        }
+
+        err = eco_file_aio_reserve(&job->next, &job->next_size, job->next_len + len);
+        if (!err) {
+            memcpy(job->next + job->next_len, data, len);
+            job->next_len += len;
+        }
+    }
+
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    if (state == AIO_RUNNING) {
+        if (err)
+            return push_errno(L, err);
+
+        lua_pushboolean(L, true);
+        return 1;
+    }
+
+    /* Nobody waits for the result of a call that timed out */
+    if (state == AIO_DONE)
+        eco_file_aio_reap(job);
+
+    err = eco_file_aio_reserve(&job->buf, &job->buf_size, len);
+    if (err)
+        return push_errno(L, err);
+
+    memcpy(job->buf, data, len);
+    job->len = len;
+
+    return eco_file_aio_submit(L, job, AIO_WRITE);
+}
+
+static int lua_aio_fsync(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check_idle(L);
+
+    if (!job)
+        return push_errno(L, EBUSY);
+
+    return eco_file_aio_submit(L, job, AIO_FSYNC);
+}
+
+static int lua_aio_stat(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check_idle(L);
+    const char *path = luaL_checkstring(L, 2);
+    char *dup;
+
+    if (!job)
+        return push_errno(L, EBUSY);
+
+    dup = strdup(path);
+    if (!dup)
+        return push_errno(L, ENOMEM);
+
+    free(job->path);
+    job->path = dup;
+
+    return eco_file_aio_submit(L, job, AIO_STAT);
+}
+
+static int lua_aio_fstat(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check_idle(L);
+
+    if (!job)
+        return push_errno(L, EBUSY);
+
+    return eco_file_aio_submit(L, job, AIO_FSTAT);
+}
+
+/* false while still running, otherwise what the operation returned */
+static int lua_aio_result(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check(L);
+    int state = eco_file_aio_state(job);
+
+    if (state == AIO_RUNNING) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    if (state == AIO_IDLE || job->op == AIO_READ)
+        return luaL_error(L, "no pending operation");
+
+    eco_file_aio_reap(job);
+
+    if (job->ret < 0)
+        return push_errno(L, job->err);
+
+    switch (job->op) {
+    case AIO_OPEN:
+    case AIO_WRITE:
+        lua_pushinteger(L, job->ret);
+        return 1;
+
+    case AIO_STAT:
+    case AIO_FSTAT:
+        return __lua_file_stat(L, &job->st);
+
+    default:
+        lua_pushboolean(L, true);
+        return 1;
+    }
+}
+
+static int lua_aio_busy(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check(L);
+
+    lua_pushboolean(L, eco_file_aio_state(job) != AIO_IDLE);
+    return 1;
+}
+
+/* Drop the data read ahead, returns how many bytes the offset is past the reader */
+static int lua_aio_discard(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check(L);
+
+    lua_pushinteger(L, job->avail);
+    job->avail = 0;
+    return 1;
+}
+
+static int lua_aio_ctx(lua_State *L)
+{
+    struct eco_file_aio *job = eco_file_aio_check(L);
+
+    lua_pushlightuserdata(L, job);
+    return 1;
+}
+
+static int lua_aio_close(lua_State *L)
+{
+    struct eco_file_aio **p = luaL_checkudata(L, 1, ECO_FILE_AIO_MT);
+    struct eco_file_aio *job = *p;
+    bool running;
+
+    if (!job)
+        return 0;
+
+    *p = NULL;
+
+    pthread_mutex_lock(&aio_pool.lock);
+    running = job->state == AIO_RUNNING;
+    if (running)
+        job->orphan = true;
+    else
+        list_del_init(&job->list);
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    if (!running)
+        eco_file_aio_free(job);
+
+    return 0;
+}
+
+static const struct luaL_Reg aio_methods[] =  {
+    {"open", lua_aio_open},
+    {"write", lua_aio_write},
+    {"fsync", lua_aio_fsync},
+    {"stat", lua_aio_stat},
+    {"fstat", lua_aio_fstat},
+    {"result", lua_aio_result},
+    {"busy", lua_aio_busy},
+    {"discard", lua_aio_discard},
+    {"ctx", lua_aio_ctx},
+    {"close", lua_aio_close},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg aio_mt[] =  {
+    {"__gc", lua_aio_close},
+    {"__close", lua_aio_close},
+    {NULL, NULL}
+};
+
+/* aio_job(loop[, fd]): the job completes on loop, fd stays the file's */
+static int lua_aio_job(lua_State *L)
+{
+    struct eco_file_aio_loop *loop = eco_file_aio_loop_check(L, 1);
+    int fd = luaL_optinteger(L, 2, -1);
+    struct eco_file_aio **p = lua_newuserdatauv(L, sizeof(struct eco_file_aio *), 0);
+    struct eco_file_aio *job;
+
+    *p = NULL;
+    luaL_setmetatable(L, ECO_FILE_AIO_MT);
+
+    job = calloc(1, sizeof(struct eco_file_aio));
+    if (!job)
+        return push_errno(L, ENOMEM);
+
+    INIT_LIST_HEAD(&job->list);
+    job->fd = fd;
+    job->loop = loop;
+
+    pthread_mutex_lock(&aio_pool.lock);
+    list_add(&job->node, &aio_pool.jobs);
+    loop->refs++;
+    pthread_mutex_unlock(&aio_pool.lock);
+
+    *p = job;
+
+    return 1;
+}
+
+/*
+ * aio_close(fd, job...): close a file's fd, or have the last of its jobs
+ * close it when they are freed. Call it before closing the jobs.
+ */
+static int lua_aio_close_fd(lua_State *L)
+{
+    int fd = luaL_checkinteger(L, 1);
+    int n = lua_gettop(L);
+    struct eco_file_aio_fd *closing = NULL;
+    int i;
+
+    for (i = 2; i <= n; i++) {
+        struct eco_file_aio **job = luaL_testudata(L, i, ECO_FILE_AIO_MT);
+
+        if (!job || !*job)
+            continue;
+
+        if (!closing) {
+            closing = calloc(1, sizeof(struct eco_file_aio_fd));
+            if (!closing)
+                return luaL_error(L, "failed to allocate fd context");
+
+            closing->fd = fd;
+        }
+
+        pthread_mutex_lock(&aio_pool.lock);
+        closing->refs++;
+        pthread_mutex_unlock(&aio_pool.lock);
+
+        (*job)->closing = closing;
+    }
+
+    if (!closing)
+        close(fd);
+
+    return 0;
+}
+
 static const luaL_Reg funcs[] = {
     {"sync", lua_file_sync},
     {"mkdir", lua_file_mkdir},
@@ -590,15 +1484,24 @@ static const luaL_Reg funcs[] = {
     {"inotify_add_watch", lua_inotify_add_watch},
     {"inotify_rm_watch", lua_inotify_rm_watch},
     {"inotify_parse_event", lua_inotify_parse_event},
+    {"aio_gen", lua_aio_gen},
+    {"aio_loop", lua_aio_loop},
+    {"aio_job", lua_aio_job},
+    {"aio_close", lua_aio_close_fd},
     {NULL, NULL}
 };
 
 int luaopen_eco_internal_file(lua_State *L)
 {
     creat_metatable(L, ECO_FILE_DIR_MT, dir_mt, NULL);
+    creat_metatable(L, ECO_FILE_AIO_MT, aio_mt, aio_methods);
+    creat_metatable(L, ECO_FILE_AIO_LOOP_MT, aio_loop_mt, aio_loop_methods);
 
     luaL_newlib(L, funcs);
 
+    lua_pushlightuserdata(L, eco_file_aio_read);
+    lua_setfield(L, -2, "aio_read");
+
     lua_add_constant(L, "O_RDONLY", O_RDONLY);
     lua_add_constant(L, "O_WRONLY", O_WRONLY);
     lua_add_constant(L, "O_RDWR", O_RDWR);
@@ -19,10 +19,17 @@
 --   `IN_MOVE`, `IN_CREATE`, `IN_DELETE`, `IN_DELETE_SELF`, `IN_MOVE_SELF`,
 --   `IN_ALL_EVENTS`, `IN_ISDIR`
 --
+-- Regular files are always "ready" for epoll, so their I/O would block the
+-- whole loop on slow storage. @{open}, @{readfile}, @{writefile}, @{stat}
+-- and the read/write/fsync/stat methods of regular files run their syscalls
+-- on a small pool of worker threads instead, and only suspend the calling
+-- coroutine. Outside a coroutine they fall back to blocking calls.
+--
 -- @module eco.file
 
 local file = require 'eco.internal.file'
 local time = require 'eco.time'
+local sync = require 'eco.sync'
 local sys = require 'eco.sys'
 local eco = require 'eco'
 
@@ -31,6 +38,171 @@ local M = {
     SKIP = 1
 }
 
+-- The workers report finished jobs through one eventfd per loop. While
+-- coroutines wait for jobs, a dispatcher coroutine waits on it and wakes
+-- them up.
+--
+-- A child forked with the state in use would share the eventfd with its
+-- parent, and never see the jobs running at fork() complete. The child
+-- starts over with a new state instead.
+local aio
+
+-- Closed on every way out, so errors can't leave a user behind
+local aio_user_mt = {
+    __close = function(self)
+        local aio = self.aio
+
+        aio.users = aio.users - 1
+
+        -- Let the dispatcher see that nobody waits anymore
+        if aio.users == 0 and aio.waiting then
+            aio.waiting = false
+            aio.loop:kick()
+        end
+    end
+}
+
+local function aio_state()
+    local gen = file.aio_gen()
+
+    if not aio or aio.gen ~= gen then
+        aio = {
+            gen = gen,
+            users = 0,      -- coroutines waiting for a job
+            wakers = {},    -- job ctx -> function waking its waiter
+            idle = {}       -- jobs kept around for one-shot operations (open, stat, ...)
+        }
+
+        aio.user = setmetatable({ aio = aio }, aio_user_mt)
+    end
+
+    return aio
+end
+
+local function aio_loop()
+    local aio = aio_state()
+
+    if not aio.loop then
+        local loop, err = file.aio_loop()
+        if not loop then
+            return nil, err
+        end
+
+        aio.loop = loop
+        aio.rd = eco.reader(loop:efd())
+    end
+
+    return aio.loop
+end
+
+local function aio_dispatch(aio)
+    while aio.users > 0 do
+        aio.waiting = true
+        aio.rd:wait()
+        aio.waiting = false
+
+        for _, ctx in ipairs(aio.loop:reap()) do
+            local wake = aio.wakers[ctx]
+            if wake then
+                wake()
+            end
+        end
+    end
+
+    aio.dispatching = false
+end
+
+local function aio_enter()
+    local aio = aio_state()
+
+    aio.users = aio.users + 1
+
+    if not aio.dispatching then
+        aio.dispatching = true
+        eco.run(aio_dispatch, aio)
+    end
+
+    return aio.user
+end
+
+local function aio_new_job(fd)
+    local loop, err = aio_loop()
+    if not loop then
+        return nil, err
+    end
+
+    local job
+    job, err = file.aio_job(loop, fd)
+    if not job then
+        return nil, err
+    end
+
+    local cond = sync.cond()
+
+    aio.wakers[job:ctx()] = function() cond:signal() end
+
+    return { job = job, cond = cond, aio = aio }
+end
+
+local function aio_close_job(j)
+    j.aio.wakers[j.job:ctx()] = nil
+    j.cond:close()
+    j.job:close()
+end
+
+-- Wait for the operation submitted on `j`, and return its result
+local function aio_wait(j, timeout)
+    local _<close> = aio_enter()
+
+    while true do
+        local res = table.pack(j.job:result())
+        if res[1] ~= false then
+            return table.unpack(res, 1, res.n)
+        end
+
+        local ok, err = j.cond:wait(timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+end
+
+-- Run `file[op](...)` on the worker pool
+local function aio_call(op, ...)
+    if not coroutine.isyieldable() then
+        return file[op](...)
+    end
+
+    local idle_jobs = aio_state().idle
+    local j = table.remove(idle_jobs)
+
+    if not j then
+        local err
+
+        j, err = aio_new_job()
+        if not j then
+            return nil, err
+        end
+    end
+
+    local ok, err = j.job[op](j.job, ...)
+    if not ok then
+        aio_close_job(j)
+        return nil, err
+    end
+
+    local res = table.pack(aio_wait(j))
+
+    -- A canceled wait leaves the job running, the worker frees it
+    if j.job:busy() or #idle_jobs >= 4 then
+        aio_close_job(j)
+    else
+        idle_jobs[#idle_jobs + 1] = j
+    end
+
+    return table.unpack(res, 1, res.n)
+end
+
 --- Read contents from a file.
 --
 -- Opens the file in read-only mode and reads data using `file:read`.
@@ -55,12 +227,24 @@ local M = {
 --     print('readfile failed:', err)
 -- end
 function M.readfile(path, m)
-    local f<close>, err = io.open(path, 'r')
+    m = m or '*a'
+
+    -- eco.reader has no number format
+    if not coroutine.isyieldable() or m == 'n' or m == '*n' then
+        local f<close>, err = io.open(path, 'r')
+        if not f then
+            return nil, err
+        end
+
+        return f:read(m)
+    end
+
+    local f<close>, err = M.open(path)
     if not f then
         return nil, err
     end
 
-    return f:read(m or '*a')
+    return f:read(m)
 end
 
 --- Write data to a file.
@@ -78,13 +262,29 @@ end
 -- local ok, err = file.writefile('/tmp/out.txt', 'hello\n')
 -- assert(ok, err)
 function M.writefile(path, data, append)
-    local m = 'w'
+    if not coroutine.isyieldable() then
+        local f<close>, err = io.open(path, append and 'a' or 'w')
+        if not f then
+            return nil, err
+        end
+
+        _, err = f:write(data)
+        if err then
+            return nil, err
+        end
+
+        return true
+    end
+
+    local flags = file.O_WRONLY | file.O_CREAT
 
     if append then
-        m = 'a'
+        flags = flags | file.O_APPEND
+    else
+        flags = flags | file.O_TRUNC
     end
 
-    local f<close>, err = io.open(path, m)
+    local f<close>, err = M.open(path, flags, 438) -- 0666, like io.open
     if not f then
         return nil, err
     end
@@ -94,7 +294,20 @@ function M.writefile(path, data, append)
         return nil, err
     end
 
-    return true
+    return f:flush()
+end
+
+--- Get file status by path, without blocking the loop.
+--
+-- Same as @{file.stat}, run on the worker pool.
+--
+-- @function stat
+-- @tparam string path Path to file.
+-- @treturn table Info table, see @{file.stat}.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function M.stat(path)
+    return aio_call('stat', path)
 end
 
 --- File object returned by @{open}.
@@ -104,28 +317,325 @@ end
 -- @type file
 local file_methods = {}
 
+-- Move the offset back over what the reader's job read ahead, before it's used
+local function file_unread(self)
+    local n = self.rjob and self.rjob:discard() or 0
+
+    if n > 0 then
+        file.lseek(self.fd, -n, file.SEEK_CUR)
+    end
+
+    return n
+end
+
+local function file_close_jobs(self)
+    if self.rd then
+        self.rd:cancel()
+    end
+
+    if self.rjob then
+        self.aio.wakers[self.rjob:ctx()] = nil
+        self.rjob:close()
+    end
+
+    if self.wjob then
+        aio_close_job(self.wjob)
+    end
+
+    -- The reader's context is the job just freed, it must not be used again
+    self.rd = nil
+    self.rjob = nil
+    self.wjob = nil
+    self.mutex = nil
+    self.aio = nil
+end
+
+-- Jobs created before a fork() complete on the parent's loop, the child
+-- starts over with new ones. Data the reader had buffered is lost.
+local function file_check_fork(self)
+    if self.aio and self.aio ~= aio_state() then
+        file_unread(self)
+        file_close_jobs(self)
+    end
+end
+
+-- Reads of regular files go through a reader woken by the dispatcher
+local function file_reader(self)
+    if self.fd < 0 then
+        return nil, 'Bad file descriptor'
+    end
+
+    file_check_fork(self)
+
+    if not self.rd then
+        local loop, err = aio_loop()
+        if not loop then
+            return nil, err
+        end
+
+        local job
+        job, err = file.aio_job(loop, self.fd)
+        if not job then
+            return nil, err
+        end
+
+        local rd = eco.reader(self.fd, file.aio_read, job:ctx(), { polled = false })
+
+        aio.wakers[job:ctx()] = function() rd:notify() end
+
+        self.aio = aio
+        self.rjob = job
+        self.rd = rd
+    end
+
+    return self.rd
+end
+
+-- Writes, fsync and fstat of regular files share one job
+local function file_job(self)
+    if self.fd < 0 then
+        return nil, 'Bad file descriptor'
+    end
+
+    file_check_fork(self)
+
+    if not self.wjob then
+        local j, err = aio_new_job(self.fd)
+        if not j then
+            return nil, err
+        end
+
+        self.aio = aio
+        self.wjob = j
+        self.mutex = sync.mutex()
+    end
+
+    return self.wjob
+end
+
+-- Wait for what runs on the job still, a write or a call that timed out.
+-- Its result belongs to that call and is dropped.
+local function file_job_settle(j, timeout)
+    if not j.job:busy() then
+        return true
+    end
+
+    local _, err = aio_wait(j, timeout)
+
+    if j.job:busy() then
+        return nil, err
+    end
+
+    return true
+end
+
+local function file_job_call(self, op, timeout)
+    local j, err = file_job(self)
+    if not j then
+        return nil, err
+    end
+
+    local mutex = self.mutex
+
+    mutex:lock()
+
+    local ok
+    ok, err = file_job_settle(j, timeout)
+    if not ok then
+        mutex:unlock()
+        return nil, err
+    end
+
+    ok, err = j.job[op](j.job)
+    if not ok then
+        mutex:unlock()
+        return nil, err
+    end
+
+    local res = table.pack(aio_wait(j, timeout))
+
+    mutex:unlock()
+
+    return table.unpack(res, 1, res.n)
+end
+
+-- The data is copied to the job and written by a worker while the caller
+-- waits. Behind a write that timed out, it's queued to that job and the
+-- worker writes both in one go.
+local function file_write(self, data, timeout)
+    local j, err = file_job(self)
+    if not j then
+        return nil, err
+    end
+
+    local mutex = self.mutex
+
+    mutex:lock()
+
+    local ok
+
+    while true do
+        ok, err = j.job:write(data)
+        if ok ~= false then
+            break
+        end
+
+        ok, err = file_job_settle(j, timeout)
+        if not ok then
+            break
+        end
+    end
+
+    if ok then
+        ok, err = aio_wait(j, timeout)
+    end
+
+    mutex:unlock()
+
+    if not ok then
+        return nil, err
+    end
+
+    return #data
+end
+
+-- Wait for a write that timed out, reads and seeks need it done
+local function file_settle(self, timeout)
+    local j = self.wjob
+
+    if not j or not j.job:busy() then
+        return true
+    end
+
+    local mutex = self.mutex
+
+    mutex:lock()
+
+    local ok, err = file_job_settle(j, timeout)
+
+    mutex:unlock()
+
+    return ok, err
+end
+
 --- See @{eco.reader:read}
 -- @function file:read
 function file_methods:read(format, timeout)
-    return self.rd:read(format, timeout)
+    local rd, err = file_reader(self)
+    if not rd then
+        return nil, err
+    end
+
+    if self.wjob then
+        local ok
+        ok, err = file_settle(self, timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    local _<close> = self.rjob and aio_enter()
+
+    return rd:read(format, timeout)
 end
 
 --- See @{eco.reader:readfull}
 -- @function file:readfull
 function file_methods:readfull(format, timeout)
-    return self.rd:readfull(format, timeout)
+    local rd, err = file_reader(self)
+    if not rd then
+        return nil, err
+    end
+
+    if self.wjob then
+        local ok
+        ok, err = file_settle(self, timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    local _<close> = self.rjob and aio_enter()
+
+    return rd:readfull(format, timeout)
 end
 
 --- See @{eco.reader:readuntil}
 -- @function file:readuntil
 function file_methods:readuntil(format, timeout)
-    return self.rd:readuntil(format, timeout)
+    local rd, err = file_reader(self)
+    if not rd then
+        return nil, err
+    end
+
+    if self.wjob then
+        local ok
+        ok, err = file_settle(self, timeout)
+        if not ok then
+            return nil, err
+        end
+    end
+
+    local _<close> = self.rjob and aio_enter()
+
+    return rd:readuntil(format, timeout)
 end
 
 --- See @{eco.writer:write}
+--
+-- On regular files, the data is written by the worker pool while the
+-- calling coroutine waits. A write that times out still completes in the
+-- background.
+--
 -- @function file:write
 function file_methods:write(data, timeout)
-    return self.wr:write(data, timeout)
+    if self.wr then
+        return self.wr:write(data, timeout)
+    end
+
+    file_unread(self)
+
+    return file_write(self, data, timeout)
+end
+
+--- Wait until the data passed to @{file:write} is written.
+--
+-- Writes the data still buffered in userspace, and waits for writes that
+-- timed out. Unlike @{file:fsync}, it doesn't wait for the storage device.
+--
+-- @function file:flush
+-- @tparam[opt] number timeout Timeout in seconds.
+-- @treturn boolean true On success.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function file_methods:flush(timeout)
+    if self.fd < 0 then
+        return nil, 'Bad file descriptor'
+    end
+
+    if self.wr then
+        local n, err = self.wr:flush(timeout)
+        if not n then
+            return nil, err
+        end
+
+        return true
+    end
+
+    return file_settle(self, timeout)
+end
+
+--- Flush the file's data and metadata to the storage device.
+--
+-- Runs `fsync(2)` on the worker pool.
+--
+-- @function file:fsync
+-- @tparam[opt] number timeout Timeout in seconds.
+-- @treturn boolean true On success.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function file_methods:fsync(timeout)
+    return file_job_call(self, 'fsync', timeout)
 end
 
 --- Reposition read/write file offset.
@@ -137,6 +647,13 @@ end
 -- @treturn[2] nil On failure.
 -- @treturn[2] string Error message.
 function file_methods:lseek(offset, where)
+    local ok, err = file_settle(self)
+    if not ok then
+        return nil, err
+    end
+
+    file_unread(self)
+
     return file.lseek(self.fd, offset, where)
 end
 
@@ -149,7 +666,11 @@ end
 -- @treturn[2] nil On failure.
 -- @treturn[2] string Error message.
 function file_methods:stat()
-    return file.fstat(self.fd)
+    if not coroutine.isyieldable() then
+        return file.fstat(self.fd)
+    end
+
+    return file_job_call(self, 'fstat')
 end
 
 --- Acquire or release an advisory file lock.
@@ -209,17 +730,41 @@ end
 --
 -- This is idempotent and is also used as the `__gc` / `__close` metamethod.
 --
+-- Called from a coroutine, it first waits for writes that timed out.
+-- Otherwise, as from `__gc`, they complete after it.
+--
 -- @function file:close
 function file_methods:close()
     if self.fd < 0 then
         return
     end
 
-    file.close(self.fd)
+    if self.wjob and coroutine.isyieldable() then
+        file_settle(self)
+
+        -- Closed by another coroutine meanwhile
+        if self.fd < 0 then
+            return
+        end
+    end
+
+    -- Before close(2): a background flush must not reach a reused fd
+    if self.wr then
+        self.wr:cancel(true)
+    end
+
+    if self.rjob or self.wjob then
+        -- A job still running keeps the fd open until it's done
+        file.aio_close(self.fd, self.rjob, self.wjob and self.wjob.job)
+    else
+        file.close(self.fd)
+    end
+
     self.fd = -1
 
-    self.rd:cancel()
-    self.wr:cancel()
+    file_close_jobs(self)
+
+    self.wr = nil
 end
 
 --- End of `file` class section.
@@ -241,11 +786,18 @@ local file_mt = {
 -- @treturn[2] nil On failure.
 -- @treturn[2] string Error message.
 function M.open(path, flags, mode)
-    local fd, err = file.open(path, flags, mode)
+    local fd, err = aio_call('open', path, flags, mode)
     if not fd then
         return nil, err
     end
 
+    local st = file.fstat(fd)
+
+    -- Regular files get their reader and write job on first use
+    if st and st.type == 'REG' and coroutine.isyieldable() then
+        return setmetatable({ fd = fd }, file_mt)
+    end
+
     return setmetatable({
         fd = fd,
         rd = eco.reader(fd),
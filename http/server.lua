@@ -15,6 +15,7 @@ local file = require 'eco.internal.file'
 local socket = require 'eco.socket'
 local url = require 'eco.http.url'
 local log = require 'eco.log'
+local sys = require 'eco.sys'
 local eco = require 'eco'
 
 local str_format = string.format
@@ -625,7 +626,7 @@ function methods:flush()
         return true
     end
 
-    local _, err = sock:send(concat(data))
+    local _, err = sock:sendv(data)
     if err then
         return nil, err
     end
@@ -1120,6 +1121,77 @@ end
 
 local metatable = { __index = methods }
 
+local function create_listener(ipaddr, port, options)
+    if options.ssl then
+        local ssl = require 'eco.ssl'
+        return ssl.listen(ipaddr, port, options)
+    end
+
+    return socket.listen_tcp(ipaddr, port, options)
+end
+
+local function serve(sock, options, handler)
+    while true do
+        local c, peer = sock:accept()
+        if c then
+            log.debug(peer.ipaddr .. ':' .. peer.port .. ': new connection')
+
+            local con = setmetatable({
+                sock = c,
+                resp = {
+                    code = 200,
+                    headers = {
+                        server = server_header_value
+                    },
+                    data = {}
+                },
+                peer = peer,
+                options = options
+            }, metatable)
+
+            eco.run(function()
+                while true do
+                    if not handle_connection(con, handler) then
+                        c:close()
+                        break
+                    end
+                end
+            end)
+        else
+            return nil, peer
+        end
+    end
+end
+
+-- Each worker process binds its own SO_REUSEPORT socket, so the kernel
+-- spreads connections over per-process accept queues.
+local function spawn_workers(sock, ipaddr, port, options, handler)
+    -- With port 0, the workers must join the port picked for the first socket
+    local addr = (options.ssl and sock.sock or sock):getsockname()
+    if addr then
+        port = addr.port
+    end
+
+    for i = 2, options.workers do
+        local pid, err = sys.spawn(function()
+            sock:close()
+
+            local s, lerr = create_listener(ipaddr, port, options)
+            if not s then
+                log.err('http worker ' .. i .. ': listen: ' .. lerr)
+                return
+            end
+
+            local _, serr = serve(s, options, handler)
+            log.err('http worker ' .. i .. ': ' .. tostring(serr))
+        end)
+
+        if not pid then
+            log.err('spawn http worker: ' .. err)
+        end
+    end
+end
+
 --- Listen and serve HTTP requests.
 --
 -- This function creates a listening socket and enters an accept loop.
@@ -1141,6 +1213,9 @@ local metatable = { __index = methods }
 -- - `index` (string) index file name (default `index.html`).
 -- - `http_keepalive` (number) keepalive timeout seconds (default 30).
 -- - `gzip` (boolean) serve `.gz` when available.
+-- - `workers` (integer) number of processes serving the port (default 1).
+--   The calling process is one of them, the others are forked with
+--   @{eco.sys.spawn} and die with it. All of them bind with `reuseport`.
 -- - TLS: set `cert` and `key` to enable TLS via @{eco.ssl.listen}.
 --
 -- Other fields are passed to @{eco.socket.listen_tcp} / @{eco.ssl.listen}.
@@ -1163,53 +1238,26 @@ function M.listen(ipaddr, port, options, handler)
 
     options.index = options.index or 'index.html'
     options.http_keepalive = options.http_keepalive or 30
+    options.workers = options.workers or 1
 
-    local sock, err
+    options.ssl = (options.cert and options.key) and true or nil
 
-    if options.cert and options.key then
-        local ssl = require 'eco.ssl'
-        options.ssl = true
-        sock, err = ssl.listen(ipaddr, port, options)
-    else
-        sock, err = socket.listen_tcp(ipaddr, port, options)
+    if options.workers > 1 then
+        options.reuseport = true
     end
 
+    local sock, err = create_listener(ipaddr, port, options)
     if not sock then
         return nil, err
     end
 
     log.debug('listen on:', ipaddr, port, options.ssl and 'ssl' or '')
 
-    while true do
-        local c, peer = sock:accept()
-        if c then
-            log.debug(peer.ipaddr .. ':' .. peer.port .. ': new connection')
-
-            local con = setmetatable({
-                sock = c,
-                resp = {
-                    code = 200,
-                    headers = {
-                        server = server_header_value
-                    },
-                    data = {}
-                },
-                peer = peer,
-                options = options
-            }, metatable)
-
-            eco.run(function()
-                while true do
-                    if not handle_connection(con, handler) then
-                        c:close()
-                        break
-                    end
-                end
-            end)
-        else
-            return nil, peer
-        end
+    if options.workers > 1 then
+        spawn_workers(sock, ipaddr, port, options, handler)
     end
+
+    return serve(sock, options, handler)
 end
 
 return M
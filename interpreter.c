@@ -121,6 +121,12 @@ int main(int argc, char *const argv[])
     lua_gc(L, LUA_GCRESTART);   /* start GC... */
     lua_gc(L, LUA_GCGEN, 0, 0); /* in generational mode */
 
+    /* Built into the interpreter, as worker threads need luaopen_eco */
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+    lua_pushcfunction(L, luaopen_eco_internal_threads);
+    lua_setfield(L, -2, "eco.internal.threads");
+    lua_pop(L, 1);
+
     luaL_requiref(L, "eco", luaopen_eco, 1);
     eco_idx = lua_absindex(L, -1);
 
@@ -9,6 +9,16 @@
  * This module uses `mmap(MAP_SHARED)` on files under `/dev/shm` to provide
  * cross-process shared memory semantics.
  *
+ * Like nginx's `lua_shared_dict`, the memory is split into 4 KiB slab
+ * pages. A page is carved into chunks of one size class (powers of two
+ * from 64 bytes up to half a page) and small items take the smallest
+ * chunk they fit in. Larger items take a run of whole pages. A page goes
+ * back to the pool once all its chunks are free, so any class can use it.
+ * The memory footprint is fixed: when nothing is free, @{dict:set} evicts
+ * the least recently used items, first of the item's own class. A large
+ * item evicts the pages next to the largest free run instead, until the
+ * run fits it.
+ *
  * @module eco.shared
  */
 
@@ -34,7 +44,20 @@
 
 #define SHARED_MT "struct eco_shared_dict *"
 
-#define SHARED_MAGIC 0x45434f2d534844u /* ECO-SHD */
+#define SHARED_MAGIC 0x45434f2d534834u /* ECO-SH4 */
+
+/* Hash index buckets and lists hold a chunk offset + 1, 0 is none */
+#define INDEX_EMPTY 0
+#define INDEX_TOMB UINT32_MAX
+
+#define SLAB_CHUNK_MIN 64
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_CLASSES 7      /* 64 .. SLAB_PAGE_SIZE / 2, then page runs */
+#define SLAB_LARGE (SLAB_CLASSES - 1)
+#define SLAB_PAGE_FREE UINT32_MAX
+
+/* Items set() may evict to make room for one */
+#define SLAB_EVICT_MAX 30
 
 enum {
     TYPE_BOOL,
@@ -42,6 +65,13 @@ enum {
     TYPE_STR
 };
 
+/* dict_store flags */
+enum {
+    STORE_ADD = 1 << 0,     /* fail if the key exists */
+    STORE_REPLACE = 1 << 1, /* fail if the key doesn't exist */
+    STORE_SAFE = 1 << 2     /* never evict */
+};
+
 struct item_value {
     uint8_t type;
     size_t len;
@@ -53,20 +83,51 @@ struct item_value {
     };
 };
 
+/* Header of a chunk, followed by the key and the value */
 struct item_hdr {
     unsigned type:2;
-    unsigned dead:1;
+    unsigned used:1;
     unsigned hash:29;
+    uint8_t cls;
     uint32_t key_len;
     uint32_t val_len;
+    uint32_t lru_prev;  /* LRU list of the class, most recent first */
+    uint32_t lru_next;  /* also links free chunks */
     int64_t expires_at;
     char key[0];
 };
 
+struct slab_class {
+    uint32_t pages;     /* pages with free chunks */
+    uint32_t lru_head;
+    uint32_t lru_tail;
+};
+
+/* Page lists hold a page index + 1, 0 is none */
+struct slab_page {
+    uint32_t prev;
+    uint32_t next;
+    uint32_t free;      /* free chunks of a small page */
+    uint32_t used;      /* chunks in use of a small page */
+    uint32_t npages;    /* run length, on the first and the last page of a run */
+    uint32_t cls;       /* class of the run, SLAB_PAGE_FREE if in the pool */
+};
+
+/*
+ * Segment layout: this header, an open-addressing hash index of
+ * `nbuckets` chunk references (linear probing), `npages` page
+ * descriptors, then the slab pages.
+ */
 struct shm_hdr {
     uint64_t magic;
-    size_t len;
-    uint8_t base[0];
+    size_t size;        /* npages * SLAB_PAGE_SIZE */
+    uint32_t npages;
+    uint32_t free_pages;
+    uint32_t free_runs; /* runs of free pages, merged when adjacent */
+    uint32_t nbuckets;  /* power of 2 */
+    uint32_t nused;     /* buckets not empty, tombstones included */
+    struct slab_class classes[SLAB_CLASSES];
+    uint32_t index[0];
 };
 
 struct eco_shared_dict {
@@ -77,6 +138,36 @@ struct eco_shared_dict {
     bool owner;
 };
 
+static inline struct slab_page *slab_pages(struct shm_hdr *hdr)
+{
+    return (struct slab_page *)(hdr->index + hdr->nbuckets);
+}
+
+static inline uint8_t *dict_records(struct shm_hdr *hdr)
+{
+    return (uint8_t *)(slab_pages(hdr) + hdr->npages);
+}
+
+static inline uint32_t page_of(uint32_t ref)
+{
+    return (ref - 1) / SLAB_PAGE_SIZE;
+}
+
+static inline uint32_t pages_for(size_t len)
+{
+    return (len + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+}
+
+static inline uint8_t *chunk_ptr(struct shm_hdr *hdr, uint32_t ref)
+{
+    return dict_records(hdr) + ref - 1;
+}
+
+static inline uint32_t chunk_ref(struct shm_hdr *hdr, const uint8_t *record)
+{
+    return record - dict_records(hdr) + 1;
+}
+
 static inline int64_t now_ms()
 {
     struct timespec ts = {};
@@ -104,16 +195,8 @@ static inline uint8_t *item_val_ptr(uint8_t *record, const struct item_hdr *item
     return record + sizeof(*item) + item->key_len;
 }
 
-static inline size_t item_size(const struct item_hdr *item)
-{
-    return sizeof(struct item_hdr) + item->key_len + item->val_len;
-}
-
-static inline bool item_is_dead(const struct item_hdr *item)
+static inline bool item_is_expired(const struct item_hdr *item)
 {
-    if (item->dead)
-        return true;
-
     if (item->expires_at > 0)
         return now_ms() > item->expires_at;
 
@@ -142,7 +225,7 @@ static inline uint32_t calc_key_hash(const char *key, size_t key_len)
 static bool item_match(const uint8_t *record, const struct item_hdr *item,
                        const char *key, size_t key_len, uint32_t hash)
 {
-    if (item_is_dead(item))
+    if (!item->used)
         return false;
 
     if (item->key_len != key_len)
@@ -154,119 +237,564 @@ static bool item_match(const uint8_t *record, const struct item_hdr *item,
     return !memcmp(record + sizeof(*item), key, key_len);
 }
 
-static void dict_gc(struct eco_shared_dict *dict)
+/* Smallest class whose chunks hold `len` bytes, -1 if larger than the dict */
+static int slab_class_of(struct shm_hdr *hdr, size_t len)
 {
-    struct shm_hdr *hdr = dict->hdr;
-    size_t src = 0;
-    size_t dst = 0;
+    size_t size = SLAB_CHUNK_MIN;
+    int c = 0;
 
-    while (src < hdr->len) {
-        uint8_t *record = hdr->base + src;
-        struct item_hdr item;
-        size_t len;
+    if (len > SLAB_PAGE_SIZE / 2)
+        return len <= hdr->size ? SLAB_LARGE : -1;
 
-        item_hdr_load(record, &item);
-        len = item_size(&item);
+    while (size < len) {
+        size <<= 1;
+        c++;
+    }
 
-        if (!item_is_dead(&item)) {
-            if (dst != src)
-                memmove(hdr->base + dst, record, len);
+    return c;
+}
 
-            dst += len;
+/* Bytes available to the item in chunk `ref` of class `c` */
+static size_t slab_room(struct shm_hdr *hdr, uint32_t ref, int c)
+{
+    if (c == SLAB_LARGE)
+        return (size_t)slab_pages(hdr)[page_of(ref)].npages * SLAB_PAGE_SIZE;
+
+    return SLAB_CHUNK_MIN << c;
+}
+
+static bool index_insert(struct shm_hdr *hdr, uint32_t hash, uint32_t ref)
+{
+    uint32_t mask = hdr->nbuckets - 1;
+    uint32_t b = hash & mask;
+
+    for (uint32_t i = 0; i < hdr->nbuckets; i++, b = (b + 1) & mask) {
+        uint32_t *slot = &hdr->index[b];
+
+        if (*slot == INDEX_EMPTY || *slot == INDEX_TOMB) {
+            if (*slot == INDEX_EMPTY)
+                hdr->nused++;
+
+            *slot = ref;
+            return true;
         }
+    }
+
+    return false;
+}
+
+static void index_remove(struct shm_hdr *hdr, uint32_t hash, uint32_t ref)
+{
+    uint32_t mask = hdr->nbuckets - 1;
+    uint32_t b = hash & mask;
 
-        src += len;
+    for (uint32_t i = 0; i < hdr->nbuckets; i++, b = (b + 1) & mask) {
+        uint32_t *slot = &hdr->index[b];
+
+        if (*slot == INDEX_EMPTY)
+            return;
+
+        if (*slot == ref) {
+            *slot = INDEX_TOMB;
+            return;
+        }
     }
+}
 
-    hdr->len = dst;
+static void index_reset(struct shm_hdr *hdr)
+{
+    memset(hdr->index, 0, hdr->nbuckets * sizeof(uint32_t));
+    hdr->nused = 0;
 }
 
-static uint8_t *find_item(struct eco_shared_dict *dict, const char *key, size_t key_len,
-                          uint32_t hash, struct item_hdr *item)
+/* Drop the tombstones: every live item sits in the LRU list of its class */
+static void index_rebuild(struct shm_hdr *hdr)
 {
-    struct shm_hdr *hdr = dict->hdr;
-    size_t offset = 0;
+    index_reset(hdr);
 
-    while (offset < hdr->len) {
-        uint8_t *record = hdr->base + offset;
+    for (uint32_t c = 0; c < SLAB_CLASSES; c++) {
+        uint32_t ref = hdr->classes[c].lru_head;
 
-        item_hdr_load(record, item);
+        while (ref) {
+            struct item_hdr item;
 
-        if (item_match(record, item, key, key_len, hash))
-            return record;
+            item_hdr_load(chunk_ptr(hdr, ref), &item);
+            index_insert(hdr, item.hash, ref);
+            ref = item.lru_next;
+        }
+    }
+}
 
-        offset += item_size(item);
+static void lru_unlink(struct shm_hdr *hdr, struct item_hdr *item)
+{
+    struct slab_class *cls = &hdr->classes[item->cls];
+    struct item_hdr tmp;
+    uint8_t *record;
+
+    if (item->lru_prev) {
+        record = chunk_ptr(hdr, item->lru_prev);
+        item_hdr_load(record, &tmp);
+        tmp.lru_next = item->lru_next;
+        item_hdr_store(record, &tmp);
+    } else {
+        cls->lru_head = item->lru_next;
     }
 
-    return NULL;
+    if (item->lru_next) {
+        record = chunk_ptr(hdr, item->lru_next);
+        item_hdr_load(record, &tmp);
+        tmp.lru_prev = item->lru_prev;
+        item_hdr_store(record, &tmp);
+    } else {
+        cls->lru_tail = item->lru_prev;
+    }
+
+    item->lru_prev = 0;
+    item->lru_next = 0;
 }
 
-static bool dict_del(struct eco_shared_dict *dict, const char *key, size_t key_len,
-                     uint32_t hash)
+static void lru_push(struct shm_hdr *hdr, struct item_hdr *item, uint32_t ref)
+{
+    struct slab_class *cls = &hdr->classes[item->cls];
+    struct item_hdr tmp;
+    uint8_t *record;
+
+    item->lru_prev = 0;
+    item->lru_next = cls->lru_head;
+
+    if (cls->lru_head) {
+        record = chunk_ptr(hdr, cls->lru_head);
+        item_hdr_load(record, &tmp);
+        tmp.lru_prev = ref;
+        item_hdr_store(record, &tmp);
+    } else {
+        cls->lru_tail = ref;
+    }
+
+    cls->lru_head = ref;
+}
+
+/* Move an item to the head of its LRU list */
+static void lru_touch(struct shm_hdr *hdr, uint8_t *record, struct item_hdr *item)
+{
+    uint32_t ref = chunk_ref(hdr, record);
+
+    if (hdr->classes[item->cls].lru_head == ref)
+        return;
+
+    lru_unlink(hdr, item);
+    lru_push(hdr, item, ref);
+    item_hdr_store(record, item);
+}
+
+static void page_list_add(struct shm_hdr *hdr, uint32_t *head, uint32_t p)
 {
+    struct slab_page *pages = slab_pages(hdr);
+
+    pages[p].prev = 0;
+    pages[p].next = *head;
+
+    if (*head)
+        pages[*head - 1].prev = p + 1;
+
+    *head = p + 1;
+}
+
+static void page_list_del(struct shm_hdr *hdr, uint32_t *head, uint32_t p)
+{
+    struct slab_page *pages = slab_pages(hdr);
+
+    if (pages[p].prev)
+        pages[pages[p].prev - 1].next = pages[p].next;
+    else
+        *head = pages[p].next;
+
+    if (pages[p].next)
+        pages[pages[p].next - 1].prev = pages[p].prev;
+}
+
+/*
+ * Only the first and the last page of a run are tagged, that's all
+ * page_free() looks at to find the runs around the one it releases.
+ */
+static void page_run_set(struct shm_hdr *hdr, uint32_t p, uint32_t n, uint32_t cls)
+{
+    struct slab_page *pages = slab_pages(hdr);
+
+    pages[p].npages = pages[p + n - 1].npages = n;
+    pages[p].cls = pages[p + n - 1].cls = cls;
+}
+
+/*
+ * Take `n` free pages. Runs for large items come from the lowest run that
+ * fits and single pages for the small classes from the top of the highest
+ * run, so the small pages don't split the space large items need.
+ */
+static bool page_alloc(struct shm_hdr *hdr, uint32_t n, uint32_t cls, uint32_t *page)
+{
+    struct slab_page *pages = slab_pages(hdr);
+    uint32_t best = 0;
+    uint32_t p, run;
+
+    for (p = hdr->free_runs; p; p = pages[p - 1].next) {
+        if (pages[p - 1].npages < n)
+            continue;
+
+        if (!best || (cls == SLAB_LARGE ? p < best : p > best))
+            best = p;
+    }
+
+    if (!best)
+        return false;
+
+    p = best - 1;
+    run = pages[p].npages;
+
+    if (cls == SLAB_LARGE) {
+        page_list_del(hdr, &hdr->free_runs, p);
+
+        if (run > n) {
+            page_run_set(hdr, p + n, run - n, SLAB_PAGE_FREE);
+            page_list_add(hdr, &hdr->free_runs, p + n);
+        }
+    } else if (run > n) {
+        page_run_set(hdr, p, run - n, SLAB_PAGE_FREE);
+        p += run - n;
+    } else {
+        page_list_del(hdr, &hdr->free_runs, p);
+    }
+
+    page_run_set(hdr, p, n, cls);
+    hdr->free_pages -= n;
+    *page = p;
+
+    return true;
+}
+
+/* Give `n` pages back to the pool, merged with the free runs next to them */
+static void page_free(struct shm_hdr *hdr, uint32_t p, uint32_t n)
+{
+    struct slab_page *pages = slab_pages(hdr);
+
+    hdr->free_pages += n;
+
+    if (p + n < hdr->npages && pages[p + n].cls == SLAB_PAGE_FREE) {
+        uint32_t next = p + n;
+
+        n += pages[next].npages;
+        page_list_del(hdr, &hdr->free_runs, next);
+    }
+
+    if (p > 0 && pages[p - 1].cls == SLAB_PAGE_FREE) {
+        uint32_t prev = p - pages[p - 1].npages;
+
+        n += pages[prev].npages;
+        page_list_del(hdr, &hdr->free_runs, prev);
+        p = prev;
+    }
+
+    page_run_set(hdr, p, n, SLAB_PAGE_FREE);
+    page_list_add(hdr, &hdr->free_runs, p);
+}
+
+/* All pages in one free run, no class holding any */
+static void slab_reset(struct shm_hdr *hdr)
+{
+    memset(hdr->classes, 0, sizeof(hdr->classes));
+
+    hdr->free_runs = 0;
+    hdr->free_pages = 0;
+
+    page_free(hdr, 0, hdr->npages);
+}
+
+/* Release an item's chunk. `slot` is its index bucket, if known. */
+static void item_free(struct shm_hdr *hdr, uint8_t *record, struct item_hdr *item, uint32_t *slot)
+{
+    struct slab_class *cls = &hdr->classes[item->cls];
+    uint32_t ref = chunk_ref(hdr, record);
+    uint32_t p = page_of(ref);
+    struct slab_page *page = &slab_pages(hdr)[p];
+
+    lru_unlink(hdr, item);
+
+    if (slot)
+        *slot = INDEX_TOMB;
+    else
+        index_remove(hdr, item->hash, ref);
+
+    item->used = 0;
+
+    if (item->cls == SLAB_LARGE) {
+        item_hdr_store(record, item);
+        page_free(hdr, p, page->npages);
+        return;
+    }
+
+    if (!page->free)
+        page_list_add(hdr, &cls->pages, p);
+
+    item->lru_next = page->free;
+    page->free = ref;
+
+    item_hdr_store(record, item);
+
+    if (--page->used == 0) {
+        page_list_del(hdr, &cls->pages, p);
+        page_free(hdr, p, 1);
+    }
+}
+
+static void slab_carve(struct shm_hdr *hdr, int c, uint32_t p)
+{
+    struct slab_page *page = &slab_pages(hdr)[p];
+    uint32_t chunk = SLAB_CHUNK_MIN << c;
+    size_t base = (size_t)p * SLAB_PAGE_SIZE;
+    struct item_hdr item = {
+        .cls = c
+    };
+
+    page->free = 0;
+    page->used = 0;
+
+    for (uint32_t off = SLAB_PAGE_SIZE; off >= chunk; off -= chunk) {
+        uint32_t ref = base + off - chunk + 1;
+
+        item.lru_next = page->free;
+        item_hdr_store(chunk_ptr(hdr, ref), &item);
+        page->free = ref;
+    }
+
+    page_list_add(hdr, &hdr->classes[c].pages, p);
+}
+
+/* Returns a free chunk reference of small class `c`, 0 when out of memory */
+static uint32_t slab_alloc_chunk(struct shm_hdr *hdr, int c)
+{
+    struct slab_class *cls = &hdr->classes[c];
+    struct slab_page *page;
     struct item_hdr item;
-    uint8_t *record = find_item(dict, key, key_len, hash, &item);
+    uint32_t ref, p;
 
-    if (record) {
-        item.dead = 1;
-        item_hdr_store(record, &item);
-        return true;
+    if (!cls->pages) {
+        if (!page_alloc(hdr, 1, c, &p))
+            return 0;
+
+        slab_carve(hdr, c, p);
     }
 
-    return false;
+    p = cls->pages - 1;
+    page = &slab_pages(hdr)[p];
+
+    ref = page->free;
+    item_hdr_load(chunk_ptr(hdr, ref), &item);
+    page->free = item.lru_next;
+    page->used++;
+
+    /* A full page leaves the list until one of its chunks is freed */
+    if (!page->free)
+        page_list_del(hdr, &cls->pages, p);
+
+    return ref;
 }
 
-/**
- * Dictionary object created by @{shared.new} or opened by @{shared.get}.
- *
- * Keys are strings. Values can be booleans, numbers, or strings.
- * Expiration time is stored per key and measured in seconds in the Lua API.
- *
- * @type dict
+/*
+ * The least recently used item of class `c`, or if it has none, of the
+ * class with the largest chunks that has one. `keep` is never picked.
+ * Returns 0 if there is nothing to evict.
  */
+static uint32_t slab_victim(struct shm_hdr *hdr, int c, uint32_t keep)
+{
+    for (int i = SLAB_CLASSES; i >= 0; i--) {
+        uint32_t ref = hdr->classes[i == SLAB_CLASSES ? c : i].lru_tail;
 
-/**
- * Delete a key.
- *
- * @function dict:del
- * @tparam string key
- * @treturn boolean removed `true` if the key existed and was deleted.
+        if (ref && ref == keep) {
+            struct item_hdr item;
+
+            item_hdr_load(chunk_ptr(hdr, ref), &item);
+            ref = item.lru_prev;
+        }
+
+        if (ref)
+            return ref;
+    }
+
+    return 0;
+}
+
+/* Evict the least recently used item of class `c`, see slab_victim() */
+static bool slab_evict(struct shm_hdr *hdr, int c, uint32_t keep)
+{
+    uint32_t ref = slab_victim(hdr, c, keep);
+    struct item_hdr item;
+    uint8_t *record;
+
+    if (!ref)
+        return false;
+
+    record = chunk_ptr(hdr, ref);
+    item_hdr_load(record, &item);
+    item_free(hdr, record, &item, NULL);
+
+    return true;
+}
+
+/*
+ * Evict every item of the run starting at page `p`, which then goes back
+ * to the pool. Returns false, evicting nothing, if `keep` is in it.
  */
-static int lua_dict_del(lua_State *L)
+static bool slab_evict_pages(struct shm_hdr *hdr, uint32_t p, uint32_t keep)
 {
-    struct eco_shared_dict *dict = check_dict(L);
-    size_t key_len;
-    const char *key = luaL_checklstring(L, 2, &key_len);
-    uint32_t hash;
-    bool found;
+    struct slab_page *page = &slab_pages(hdr)[p];
+    size_t base = (size_t)p * SLAB_PAGE_SIZE;
+    uint32_t chunk = SLAB_PAGE_SIZE;
+    uint32_t used = 1;
 
-    if (flock(dict->fd, LOCK_EX))
-        return push_errno(L, errno);
+    if (keep && page_of(keep) >= p && page_of(keep) < p + page->npages)
+        return false;
 
-    hash = calc_key_hash(key, key_len);
+    if (page->cls != SLAB_LARGE) {
+        chunk = SLAB_CHUNK_MIN << page->cls;
+        used = page->used;
+    }
 
-    found = dict_del(dict, key, key_len, hash);
+    for (uint32_t off = 0; used; off += chunk) {
+        uint8_t *record = chunk_ptr(hdr, base + off + 1);
+        struct item_hdr item;
 
-    lua_pushboolean(L, found);
-    flock(dict->fd, LOCK_UN);
-    return 1;
+        item_hdr_load(record, &item);
+
+        if (item.used) {
+            item_free(hdr, record, &item, NULL);
+            used--;
+        }
+    }
+
+    return true;
 }
 
-/**
- * Set key to value.
- *
- * When `exptime` is positive, the key expires after `exptime` seconds.
- * If `exptime` is `0` or negative, the key is stored without expiration.
- *
- * @function dict:set
- * @tparam string key
- * @tparam string|number|boolean value
- * @tparam[opt] number exptime Expiration in seconds.
- * @treturn boolean ok
- * @treturn[2] nil
- * @treturn[2] string err
+/*
+ * Large items need contiguous pages, which evicting in LRU order rarely
+ * frees when small pages are scattered around. Grow the largest free run
+ * instead, evicting the run that borders it. Without any free run, start
+ * with the one of the least recently used item.
  */
-static int lua_dict_set(lua_State *L)
+static bool slab_evict_run(struct shm_hdr *hdr, uint32_t keep)
+{
+    struct slab_page *pages = slab_pages(hdr);
+    uint32_t best = 0;
+    uint32_t p, n;
+
+    for (p = hdr->free_runs; p; p = pages[p - 1].next) {
+        if (!best || pages[p - 1].npages > pages[best - 1].npages)
+            best = p;
+    }
+
+    if (!best) {
+        uint32_t ref = slab_victim(hdr, SLAB_LARGE, keep);
+
+        if (!ref)
+            return false;
+
+        /* A large item's reference is the start of its run */
+        return slab_evict_pages(hdr, page_of(ref), keep);
+    }
+
+    p = best - 1;
+    n = pages[p].npages;
+
+    if (p + n < hdr->npages && slab_evict_pages(hdr, p + n, keep))
+        return true;
+
+    return p > 0 && slab_evict_pages(hdr, p - pages[p - 1].npages, keep);
+}
+
+/* Returns room for a `len` bytes item of class `c`, 0 when out of memory */
+static uint32_t slab_alloc(struct shm_hdr *hdr, int c, size_t len, bool evict, uint32_t keep)
+{
+    for (int i = 0; ; i++) {
+        uint32_t ref = 0;
+        uint32_t p;
+
+        if (c != SLAB_LARGE)
+            ref = slab_alloc_chunk(hdr, c);
+        else if (page_alloc(hdr, pages_for(len), SLAB_LARGE, &p))
+            ref = p * SLAB_PAGE_SIZE + 1;
+
+        if (ref || !evict)
+            return ref;
+
+        /* Every eviction grows the largest free run, so this ends */
+        if (c == SLAB_LARGE) {
+            if (!slab_evict_run(hdr, keep))
+                return 0;
+            continue;
+        }
+
+        if (i == SLAB_EVICT_MAX || !slab_evict(hdr, c, keep))
+            return 0;
+    }
+}
+
+/*
+ * Look up a live item. An expired one is released when `reap` is set,
+ * which needs the exclusive lock.
+ */
+static uint8_t *find_item(struct eco_shared_dict *dict, const char *key, size_t key_len,
+                          uint32_t hash, struct item_hdr *item, uint32_t **slot, bool reap)
+{
+    struct shm_hdr *hdr = dict->hdr;
+    uint32_t mask = hdr->nbuckets - 1;
+    uint32_t b = hash & mask;
+
+    for (uint32_t i = 0; i < hdr->nbuckets; i++, b = (b + 1) & mask) {
+        uint32_t ref = hdr->index[b];
+        uint8_t *record;
+
+        if (ref == INDEX_EMPTY)
+            break;
+
+        if (ref == INDEX_TOMB)
+            continue;
+
+        record = chunk_ptr(hdr, ref);
+
+        item_hdr_load(record, item);
+
+        if (!item_match(record, item, key, key_len, hash))
+            continue;
+
+        if (item_is_expired(item)) {
+            if (reap)
+                item_free(hdr, record, item, &hdr->index[b]);
+            return NULL;
+        }
+
+        if (slot)
+            *slot = &hdr->index[b];
+
+        return record;
+    }
+
+    return NULL;
+}
+
+static bool dict_del(struct eco_shared_dict *dict, const char *key, size_t key_len,
+                     uint32_t hash)
+{
+    struct item_hdr item;
+    uint32_t *slot;
+    uint8_t *record = find_item(dict, key, key_len, hash, &item, &slot, true);
+
+    if (record) {
+        item_free(dict->hdr, record, &item, slot);
+        return true;
+    }
+
+    return false;
+}
+
+static int dict_store(lua_State *L, int flags)
 {
     struct eco_shared_dict *dict = check_dict(L);
     struct shm_hdr *hdr = dict->hdr;
@@ -275,9 +803,14 @@ static int lua_dict_set(lua_State *L)
     struct item_value value = {};
     lua_Number exptime = 0;
     struct item_hdr item = {};
+    struct item_hdr old;
+    const char *err;
     uint8_t *record;
-    size_t item_len;
+    uint32_t *slot;
     uint32_t hash;
+    uint32_t ref;
+    size_t len;
+    int c;
 
     luaL_argcheck(L, key_len > 0, 2, "invalid key");
 
@@ -313,33 +846,70 @@ static int lua_dict_set(lua_State *L)
     if (flock(dict->fd, LOCK_EX))
         return push_errno(L, errno);
 
-    item_len = sizeof(struct item_hdr) + key_len + value.len;
+    /* Reclaim tombstones before probe chains get long */
+    if (hdr->nused >= hdr->nbuckets / 4 * 3)
+        index_rebuild(hdr);
 
-    if (hdr->len + item_len > dict->map_size - sizeof(struct shm_hdr)) {
-        dict_gc(dict);
+    hash = calc_key_hash(key, key_len);
+    record = find_item(dict, key, key_len, hash, &old, &slot, true);
 
-        if (hdr->len + item_len > dict->map_size - sizeof(struct shm_hdr)) {
-            lua_pushnil(L);
-            lua_pushliteral(L, "no memory");
-            flock(dict->fd, LOCK_UN);
-            return 2;
-        }
+    if (record && (flags & STORE_ADD)) {
+        err = "exists";
+        goto fail;
     }
 
-    hash = calc_key_hash(key, key_len);
+    if (!record && (flags & STORE_REPLACE)) {
+        err = "not found";
+        goto fail;
+    }
+
+    err = "no memory";
+
+    len = sizeof(struct item_hdr) + key_len + value.len;
+
+    c = slab_class_of(hdr, len);
+    if (c < 0)
+        goto fail;
+
+    ref = 0;
+
+    /* An old item of the same chunk size is rewritten in place */
+    if (!record || old.cls != c ||
+            (c == SLAB_LARGE && slab_room(hdr, chunk_ref(hdr, record), c) != pages_for(len) * SLAB_PAGE_SIZE))
+        ref = slab_alloc(hdr, c, len, !(flags & STORE_SAFE), record ? chunk_ref(hdr, record) : 0);
 
-    dict_del(dict, key, key_len, hash);
+    /* Evicting its LRU neighbours may have relinked the old item */
+    if (record)
+        item_hdr_load(record, &old);
 
-    record = hdr->base + hdr->len;
+    if (ref) {
+        if (record)
+            item_free(hdr, record, &old, slot);
+
+        index_insert(hdr, hash, ref);
+    } else if (record && slab_room(hdr, chunk_ref(hdr, record), old.cls) >= len) {
+        /* Rewrite the old chunk in place, it's large enough */
+        ref = chunk_ref(hdr, record);
+        c = old.cls;
+        lru_unlink(hdr, &old);
+    } else {
+        goto fail;
+    }
+
+    record = chunk_ptr(hdr, ref);
 
     item.type = value.type;
+    item.used = 1;
     item.hash = hash;
+    item.cls = c;
     item.key_len = key_len;
     item.val_len = value.len;
 
     if (exptime > 0)
         item.expires_at = now_ms() + (int64_t)(exptime * 1000);
 
+    lru_push(hdr, &item, ref);
+
     item_hdr_store(record, &item);
     memcpy(record + sizeof(item), key, key_len);
 
@@ -348,12 +918,146 @@ static int lua_dict_set(lua_State *L)
     else
         memcpy(item_val_ptr(record, &item), value.value, value.len);
 
-    hdr->len += item_len;
-
     flock(dict->fd, LOCK_UN);
 
     lua_pushboolean(L, true);
     return 1;
+
+fail:
+    flock(dict->fd, LOCK_UN);
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+}
+
+/**
+ * Dictionary object created by @{shared.new} or opened by @{shared.get}.
+ *
+ * Keys are strings. Values can be booleans, numbers, or strings.
+ * Expiration time is stored per key and measured in seconds in the Lua API.
+ *
+ * Keys are looked up through a hash index kept in the shared segment, so
+ * operations don't slow down as the number of keys grows.
+ *
+ * @type dict
+ */
+
+/**
+ * Delete a key.
+ *
+ * @function dict:del
+ * @tparam string key
+ * @treturn boolean removed `true` if the key existed and was deleted.
+ */
+static int lua_dict_del(lua_State *L)
+{
+    struct eco_shared_dict *dict = check_dict(L);
+    size_t key_len;
+    const char *key = luaL_checklstring(L, 2, &key_len);
+    uint32_t hash;
+    bool found;
+
+    if (flock(dict->fd, LOCK_EX))
+        return push_errno(L, errno);
+
+    hash = calc_key_hash(key, key_len);
+
+    found = dict_del(dict, key, key_len, hash);
+
+    lua_pushboolean(L, found);
+    flock(dict->fd, LOCK_UN);
+    return 1;
+}
+
+/**
+ * Set key to value.
+ *
+ * When `exptime` is positive, the key expires after `exptime` seconds.
+ * If `exptime` is `0` or negative, the key is stored without expiration.
+ *
+ * When no memory is left, the least recently used items are evicted:
+ * those of the item's size class first, then those of the other classes,
+ * largest chunks first. At most 30 items are evicted for one set.
+ *
+ * Items larger than half a page need contiguous pages: the items in the
+ * pages bordering the largest free run are evicted, whatever their age,
+ * until the run is long enough.
+ *
+ * @function dict:set
+ * @tparam string key
+ * @tparam string|number|boolean value
+ * @tparam[opt] number exptime Expiration in seconds.
+ * @treturn boolean ok
+ * @treturn[2] nil
+ * @treturn[2] string err
+ */
+static int lua_dict_set(lua_State *L)
+{
+    return dict_store(L, 0);
+}
+
+/**
+ * Like @{dict:set}, but never evicts other items.
+ *
+ * @function dict:safe_set
+ * @tparam string key
+ * @tparam string|number|boolean value
+ * @tparam[opt] number exptime Expiration in seconds.
+ * @treturn boolean ok
+ * @treturn[2] nil
+ * @treturn[2] string err `"no memory"` when there's no room.
+ */
+static int lua_dict_safe_set(lua_State *L)
+{
+    return dict_store(L, STORE_SAFE);
+}
+
+/**
+ * Like @{dict:set}, but only stores the key if it doesn't exist yet.
+ *
+ * @function dict:add
+ * @tparam string key
+ * @tparam string|number|boolean value
+ * @tparam[opt] number exptime Expiration in seconds.
+ * @treturn boolean ok
+ * @treturn[2] nil
+ * @treturn[2] string err `"exists"` if the key exists.
+ */
+static int lua_dict_add(lua_State *L)
+{
+    return dict_store(L, STORE_ADD);
+}
+
+/**
+ * Like @{dict:add}, but never evicts other items.
+ *
+ * @function dict:safe_add
+ * @tparam string key
+ * @tparam string|number|boolean value
+ * @tparam[opt] number exptime Expiration in seconds.
+ * @treturn boolean ok
+ * @treturn[2] nil
+ * @treturn[2] string err
+ */
+static int lua_dict_safe_add(lua_State *L)
+{
+    return dict_store(L, STORE_ADD | STORE_SAFE);
+}
+
+/**
+ * Like @{dict:set}, but only stores the key if it already exists.
+ *
+ * @function dict:replace
+ * @tparam string key
+ * @tparam string|number|boolean value
+ * @tparam[opt] number exptime Expiration in seconds.
+ * @treturn boolean ok
+ * @treturn[2] nil
+ * @treturn[2] string err `"not found"` if the key doesn't exist.
+ */
+static int lua_dict_replace(lua_State *L)
+{
+    return dict_store(L, STORE_REPLACE);
 }
 
 /**
@@ -375,16 +1079,19 @@ static int lua_dict_get(lua_State *L)
     uint8_t *value;
     uint32_t hash;
 
-    if (flock(dict->fd, LOCK_SH))
+    /* Exclusive: a hit moves the item in its LRU list */
+    if (flock(dict->fd, LOCK_EX))
         return push_errno(L, errno);
 
     hash = calc_key_hash(key, key_len);
-    record = find_item(dict, key, key_len, hash, &item);
+    record = find_item(dict, key, key_len, hash, &item, NULL, true);
     if (!record) {
         flock(dict->fd, LOCK_UN);
         return 0;
     }
 
+    lru_touch(dict->hdr, record, &item);
+
     value = item_val_ptr(record, &item);
 
     switch (item.type) {
@@ -455,7 +1162,7 @@ static int lua_dict_incr(lua_State *L)
 
     hash = calc_key_hash(key, key_len);
 
-    record = find_item(dict, key, key_len, hash, &item);
+    record = find_item(dict, key, key_len, hash, &item, NULL, true);
     if (!record) {
         flock(dict->fd, LOCK_UN);
         return 0;
@@ -485,10 +1192,11 @@ static int lua_dict_incr(lua_State *L)
             item.expires_at = now_ms() + (int64_t)(exptime * 1000);
         else
             item.expires_at = 0;
-
-        item_hdr_store(record, &item);
     }
 
+    lru_touch(dict->hdr, record, &item);
+    item_hdr_store(record, &item);
+
     flock(dict->fd, LOCK_UN);
 
     lua_pushnumber(L, n);
@@ -520,7 +1228,7 @@ static int lua_dict_ttl(lua_State *L)
 
     hash = calc_key_hash(key, key_len);
 
-    record = find_item(dict, key, key_len, hash, &item);
+    record = find_item(dict, key, key_len, hash, &item, NULL, false);
     if (!record) {
         flock(dict->fd, LOCK_UN);
         return 0;
@@ -565,7 +1273,7 @@ static int lua_dict_expire(lua_State *L)
 
     hash = calc_key_hash(key, key_len);
 
-    record = find_item(dict, key, key_len, hash, &item);
+    record = find_item(dict, key, key_len, hash, &item, NULL, true);
     if (!record) {
         flock(dict->fd, LOCK_UN);
         return 0;
@@ -596,7 +1304,8 @@ static int lua_dict_flush_all(lua_State *L)
     if (flock(dict->fd, LOCK_EX))
         return push_errno(L, errno);
 
-    dict->hdr->len = 0;
+    slab_reset(dict->hdr);
+    index_reset(dict->hdr);
 
     flock(dict->fd, LOCK_UN);
     return 0;
@@ -612,7 +1321,6 @@ static int lua_dict_get_keys(lua_State *L)
 {
     struct eco_shared_dict *dict = check_dict(L);
     struct shm_hdr *hdr = dict->hdr;
-    size_t offset = 0;
     int i = 1;
 
     lua_newtable(L);
@@ -620,23 +1328,68 @@ static int lua_dict_get_keys(lua_State *L)
     if (flock(dict->fd, LOCK_SH))
         return push_errno(L, errno);
 
-    while (offset < hdr->len) {
-        uint8_t *record = hdr->base + offset;
-        struct item_hdr item;
+    for (uint32_t c = 0; c < SLAB_CLASSES; c++) {
+        uint32_t ref = hdr->classes[c].lru_head;
 
-        item_hdr_load(record, &item);
+        while (ref) {
+            uint8_t *record = chunk_ptr(hdr, ref);
+            struct item_hdr item;
 
-        if (!item_is_dead(&item)) {
-            lua_pushlstring(L, (char *)record + sizeof(item), item.key_len);
-            lua_rawseti(L, -2, i++);
-        }
+            item_hdr_load(record, &item);
+
+            if (!item_is_expired(&item)) {
+                lua_pushlstring(L, (char *)record + sizeof(item), item.key_len);
+                lua_rawseti(L, -2, i++);
+            }
 
-        offset += item_size(&item);
+            ref = item.lru_next;
+        }
     }
 
     flock(dict->fd, LOCK_UN);
     return 1;
+}
+
+/**
+ * Get the size of the item memory.
+ *
+ * That's the size given to @{new}, rounded up to whole slab pages.
+ *
+ * @function dict:capacity
+ * @treturn integer bytes
+ */
+static int lua_dict_capacity(lua_State *L)
+{
+    struct eco_shared_dict *dict = check_dict(L);
+
+    lua_pushinteger(L, dict->hdr->size);
+    return 1;
+}
+
+/**
+ * Get the size of the slab pages not used by any item.
+ *
+ * Free chunks inside used pages are not counted, so a small item may
+ * still fit when this returns `0`.
+ *
+ * @function dict:free_space
+ * @treturn integer bytes
+ */
+static int lua_dict_free_space(lua_State *L)
+{
+    struct eco_shared_dict *dict = check_dict(L);
+    struct shm_hdr *hdr = dict->hdr;
+    size_t n;
+
+    if (flock(dict->fd, LOCK_SH))
+        return push_errno(L, errno);
 
+    n = (size_t)hdr->free_pages * SLAB_PAGE_SIZE;
+
+    flock(dict->fd, LOCK_UN);
+
+    lua_pushinteger(L, n);
+    return 1;
 }
 
 /**
@@ -678,12 +1431,18 @@ static int lua_dict_close(lua_State *L)
 static const luaL_Reg methods[] = {
     {"del", lua_dict_del},
     {"set", lua_dict_set},
+    {"safe_set", lua_dict_safe_set},
+    {"add", lua_dict_add},
+    {"safe_add", lua_dict_safe_add},
+    {"replace", lua_dict_replace},
     {"get", lua_dict_get},
     {"incr", lua_dict_incr},
     {"ttl", lua_dict_ttl},
     {"expire", lua_dict_expire},
     {"flush_all", lua_dict_flush_all},
     {"get_keys", lua_dict_get_keys},
+    {"capacity", lua_dict_capacity},
+    {"free_space", lua_dict_free_space},
     {"close", lua_dict_close},
     {NULL, NULL}
 };
@@ -694,10 +1453,48 @@ static const luaL_Reg metatable[] = {
     {NULL, NULL}
 };
 
+/* Enough slab pages to hold `size` */
+static void slab_layout(struct shm_hdr *hdr, size_t size)
+{
+    uint32_t n = 8;
+
+    hdr->npages = pages_for(size);
+    hdr->size = (size_t)hdr->npages * SLAB_PAGE_SIZE;
+
+    /* Two buckets per smallest chunk: the index stays at most half full */
+    while (n < hdr->size / SLAB_CHUNK_MIN * 2)
+        n <<= 1;
+
+    hdr->nbuckets = n;
+}
+
+static inline bool is_pow2(uint32_t n)
+{
+    return n && !(n & (n - 1));
+}
+
+static size_t slab_map_size(const struct shm_hdr *hdr)
+{
+    return sizeof(struct shm_hdr) + (size_t)hdr->nbuckets * sizeof(uint32_t) +
+            (size_t)hdr->npages * sizeof(struct slab_page) + hdr->size;
+}
+
+static bool slab_layout_valid(const struct shm_hdr *hdr, size_t map_size)
+{
+    if (!is_pow2(hdr->nbuckets) || hdr->npages < 1)
+        return false;
+
+    if (hdr->size != (size_t)hdr->npages * SLAB_PAGE_SIZE || hdr->free_pages > hdr->npages)
+        return false;
+
+    return slab_map_size(hdr) <= map_size;
+}
+
 static int lua_shared_open(lua_State *L, const char *name, bool create, size_t size)
 {
     int flags = O_RDWR | O_CLOEXEC;
     struct eco_shared_dict *dict;
+    struct shm_hdr layout = {};
     struct shm_hdr *hdr;
     size_t map_size = 0;
     void *map = NULL;
@@ -733,7 +1530,8 @@ static int lua_shared_open(lua_State *L, const char *name, bool create, size_t s
     }
 
     if (create) {
-        map_size = sizeof(struct shm_hdr) + size;
+        slab_layout(&layout, size);
+        map_size = slab_map_size(&layout);
         if (ftruncate(fd, map_size))
             goto err1;
     }
@@ -756,8 +1554,10 @@ static int lua_shared_open(lua_State *L, const char *name, bool create, size_t s
 
     if (create) {
         memset(map, 0, map_size);
+        memcpy(hdr, &layout, sizeof(layout));
         hdr->magic = SHARED_MAGIC;
-    } else if (hdr->magic != SHARED_MAGIC) {
+        slab_reset(hdr);
+    } else if (hdr->magic != SHARED_MAGIC || !slab_layout_valid(hdr, map_size)) {
         lua_pushnil(L);
         lua_pushliteral(L, "invalid shared memory header");
         goto err2;
@@ -798,7 +1598,8 @@ err2:
  *
  * @function new
  * @tparam string name Dictionary name.
- * @tparam integer size Size of the dictionary.
+ * @tparam integer size Size in bytes of the item memory, rounded up to
+ * whole slab pages. The hash index is allocated on top of it.
  * @treturn dict
  * @treturn[2] nil
  * @treturn[2] string err
@@ -132,7 +132,7 @@ echo '[5/5] Checking coverage checklist'
 [[ -f "$CHECKLIST" ]] || { echo 'Missing coverage checklist'; exit 1; }
 
 for mod in \
-  eco.time eco.sync eco.channel eco.file eco.sys eco.socket eco.ssl eco.dns eco.net eco.packet \
+  eco.time eco.sync eco.channel eco.file eco.sys eco.threads eco.socket eco.ssl eco.dns eco.net eco.packet \
   eco.http.url eco.http.client eco.http.server eco.websocket eco.mqtt eco.ubus eco.uci eco.shared eco.log eco.termios eco.ssh \
   eco.nl eco.genl eco.rtnl eco.ip eco.nl80211 eco.encoding.base64 eco.encoding.hex eco.hash.md5 eco.hash.sha1 eco.hash.sha256 eco.hash.hmac; do
   grep -q "$mod" "$CHECKLIST" || { echo "Coverage checklist is missing module: $mod"; exit 1; }
@@ -23,6 +23,7 @@
 #include <linux/if_ether.h>
 #include <linux/if_arp.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <linux/icmpv6.h>
 #include <linux/icmp.h>
 #include <linux/if_tun.h>
@@ -31,12 +32,41 @@
 
 #define SOCKET_MT "struct eco_socket *"
 
+#define MMSG_MAX 1024
+
+/* Largest datagram, GRO coalesced ones included */
+#define MMSG_SIZE_MAX 65535
+
+/* Scratch areas larger than this are freed after the call that needed them */
+#define SCRATCH_KEEP (512 * 1024)
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+/* Room for one UDP_SEGMENT (send) or UDP_GRO (receive) control message */
+#define UDP_CMSG_SPACE CMSG_SPACE(sizeof(int))
+
 struct eco_socket {
     struct {
         uint8_t established:1;
     } flag;
     int domain;
     int fd;
+    void *scratch;          /* recvmmsg/sendmmsg work area, reused across calls */
+    size_t scratch_size;
+};
+
+union eco_sockaddr {
+    struct sockaddr_ll ll;
+    struct sockaddr_nl nl;
+    struct sockaddr_un un;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
 };
 
 struct sock_opt {
@@ -246,10 +276,30 @@ static int lua_accept(lua_State *L)
         return 2;
     }
 
+    /* Already accepted by io:accept, a peer gone meanwhile is skipped */
+    if (lua_isinteger(L, 2)) {
+        fd = lua_tointeger(L, 2);
+
+        if (getpeername(fd, (struct sockaddr *)&addr, &addrlen)) {
+            close(fd);
+            lua_pushboolean(L, false);
+            return 1;
+        }
+
+        goto done;
+    }
+
     fd = accept4(sock->fd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
-    if (fd < 0)
+    if (fd < 0) {
+        /* The backlog is drained */
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            lua_pushboolean(L, false);
+            return 1;
+        }
         return push_errno(L, errno);
+    }
 
+done:
     eco_socket_init(L, fd, sock->domain, true);
     lua_push_sockaddr(L, (struct sockaddr *)&addr, addrlen);
 
@@ -297,20 +347,40 @@ static int lua_sendto(lua_State *L)
     return 1;
 }
 
+/* Segment size of a datagram coalesced by UDP_GRO, 0 if it wasn't */
+static int udp_gro_segment_size(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+
+    return 0;
+}
+
 static int lua_recvfrom(lua_State *L)
 {
     struct eco_socket *sock = luaL_checkudata(L, 1, SOCKET_MT);
     int n = luaL_checkinteger(L, 2);
-    union {
-        struct sockaddr_ll ll;
-        struct sockaddr_nl nl;
-        struct sockaddr_un un;
-        struct sockaddr_in in;
-        struct sockaddr_in6 in6;
-    } addr = {};
-    socklen_t addrlen = sizeof(addr);
+    union eco_sockaddr addr = {};
+    char ctrl[UDP_CMSG_SPACE] __attribute__((aligned(sizeof(size_t))));
+    struct iovec iov;
+    struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_namelen = sizeof(addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = ctrl,
+        .msg_controllen = sizeof(ctrl)
+    };
+    int segment_size;
     luaL_Buffer b;
-    char *p;
     int ret;
 
     if (n < 1)
@@ -318,19 +388,260 @@ static int lua_recvfrom(lua_State *L)
 
     luaL_buffinit(L, &b);
 
-    p = luaL_prepbuffsize(&b, n);
+    iov.iov_base = luaL_prepbuffsize(&b, n);
+    iov.iov_len = n;
 
-    ret = recvfrom(sock->fd, p, n, 0, (struct sockaddr *)&addr, &addrlen);
+    ret = recvmsg(sock->fd, &msg, 0);
     if (ret < 0)
         return push_errno(L, errno);
 
     luaL_addsize(&b, ret);
     luaL_pushresult(&b);
-    lua_push_sockaddr(L, (struct sockaddr *)&addr, addrlen);
+    lua_push_sockaddr(L, (struct sockaddr *)&addr, msg.msg_namelen);
+
+    segment_size = udp_gro_segment_size(&msg);
+    if (segment_size > 0) {
+        lua_pushinteger(L, segment_size);
+        return 3;
+    }
 
     return 2;
 }
 
+static void *eco_socket_scratch(lua_State *L, struct eco_socket *sock, size_t size)
+{
+    void *p;
+
+    if (size <= sock->scratch_size)
+        return sock->scratch;
+
+    p = realloc(sock->scratch, size);
+    if (!p)
+        luaL_error(L, "failed to allocate %d bytes", (int)size);
+
+    sock->scratch = p;
+    sock->scratch_size = size;
+
+    return p;
+}
+
+/* Don't hold on to what an unusually large batch needed */
+static void eco_socket_scratch_trim(struct eco_socket *sock)
+{
+    if (sock->scratch_size <= SCRATCH_KEEP)
+        return;
+
+    free(sock->scratch);
+    sock->scratch = NULL;
+    sock->scratch_size = 0;
+}
+
+static int lua_recvmmsg(lua_State *L)
+{
+    struct eco_socket *sock = luaL_checkudata(L, 1, SOCKET_MT);
+    int max = luaL_checkinteger(L, 2);
+    int size = luaL_checkinteger(L, 3);
+    union eco_sockaddr *addrs;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *ctrls;
+    char *bufs;
+    int i, n;
+
+    luaL_argcheck(L, max > 0 && max <= MMSG_MAX, 2, "must be in range [1, 1024]");
+    luaL_argcheck(L, size > 0 && size <= MMSG_SIZE_MAX, 3, "must be in range [1, 65535]");
+
+    msgs = eco_socket_scratch(L, sock, max * (sizeof(struct mmsghdr) +
+                sizeof(struct iovec) + sizeof(union eco_sockaddr) + UDP_CMSG_SPACE + size));
+    iovs = (struct iovec *)(msgs + max);
+    addrs = (union eco_sockaddr *)(iovs + max);
+    ctrls = (char *)(addrs + max);
+    bufs = ctrls + max * UDP_CMSG_SPACE;
+
+    memset(msgs, 0, max * sizeof(struct mmsghdr));
+
+    for (i = 0; i < max; i++) {
+        iovs[i].iov_base = bufs + i * size;
+        iovs[i].iov_len = size;
+
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(union eco_sockaddr);
+        msgs[i].msg_hdr.msg_control = ctrls + i * UDP_CMSG_SPACE;
+        msgs[i].msg_hdr.msg_controllen = UDP_CMSG_SPACE;
+    }
+
+    n = recvmmsg(sock->fd, msgs, max, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        int err = errno;
+        eco_socket_scratch_trim(sock);
+        return push_errno(L, err);
+    }
+
+    lua_createtable(L, n, 0);
+
+    for (i = 0; i < n; i++) {
+        struct msghdr *hdr = &msgs[i].msg_hdr;
+        int segment_size;
+
+        lua_createtable(L, 0, 3);
+
+        lua_pushlstring(L, iovs[i].iov_base, msgs[i].msg_len);
+        lua_setfield(L, -2, "data");
+
+        /* unnamed peers, e.g. from socketpair() */
+        if (hdr->msg_namelen > sizeof(sa_family_t)) {
+            lua_push_sockaddr(L, hdr->msg_name, hdr->msg_namelen);
+            lua_setfield(L, -2, "addr");
+        }
+
+        if (hdr->msg_flags & MSG_TRUNC) {
+            lua_pushboolean(L, true);
+            lua_setfield(L, -2, "truncated");
+        }
+
+        segment_size = udp_gro_segment_size(hdr);
+        if (segment_size > 0) {
+            lua_pushinteger(L, segment_size);
+            lua_setfield(L, -2, "segment_size");
+        }
+
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    eco_socket_scratch_trim(sock);
+
+    return 1;
+}
+
+/* Convert an address table, as pushed by lua_push_sockaddr, to a sockaddr */
+static int lua_table_to_sockaddr(struct eco_socket *sock, lua_State *L, int idx, struct sockaddr *a)
+{
+    int top = lua_gettop(L);
+    int addrlen;
+
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    switch (sock->domain) {
+    case AF_INET:
+    case AF_INET6:
+        lua_getfield(L, idx, "ipaddr");
+        lua_getfield(L, idx, "port");
+        break;
+
+    case AF_UNIX:
+        lua_getfield(L, idx, "path");
+        break;
+
+    case AF_NETLINK:
+        lua_getfield(L, idx, "groups");
+        lua_getfield(L, idx, "pid");
+        break;
+
+    default:
+        lua_pushvalue(L, idx);
+        break;
+    }
+
+    addrlen = lua_args_to_sockaddr(sock, L, a, top - 1);
+
+    /* keep the error message pushed on failure */
+    if (addrlen >= 0)
+        lua_settop(L, top);
+
+    return addrlen;
+}
+
+/*
+ * Send list[first], list[first + 1]... each {data = ..., addr = {...}},
+ * with an optional segment_size to have the kernel split data (UDP GSO).
+ */
+static int lua_sendmmsg(lua_State *L)
+{
+    struct eco_socket *sock = luaL_checkudata(L, 1, SOCKET_MT);
+    int first = luaL_optinteger(L, 3, 1);
+    union eco_sockaddr *addrs;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    char *ctrls;
+    int i, n;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    n = lua_rawlen(L, 2) - first + 1;
+    if (n < 1) {
+        lua_pushinteger(L, 0);
+        return 1;
+    }
+
+    if (n > MMSG_MAX)
+        n = MMSG_MAX;
+
+    msgs = eco_socket_scratch(L, sock, n * (sizeof(struct mmsghdr) +
+                sizeof(struct iovec) + sizeof(union eco_sockaddr) + UDP_CMSG_SPACE));
+    iovs = (struct iovec *)(msgs + n);
+    addrs = (union eco_sockaddr *)(iovs + n);
+    ctrls = (char *)(addrs + n);
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+
+    /*
+     * The strings stay referenced by the list while sendmmsg runs. Numbers
+     * would be converted to strings only the stack references.
+     */
+    for (i = 0; i < n; i++) {
+        size_t len;
+        int addrlen;
+
+        lua_rawgeti(L, 2, first + i);
+        luaL_argcheck(L, lua_istable(L, -1), 2, "entries must be tables");
+
+        lua_getfield(L, -1, "data");
+        luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "entry data must be a string");
+        iovs[i].iov_base = (void *)lua_tolstring(L, -1, &len);
+        iovs[i].iov_len = len;
+        lua_pop(L, 1);
+
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+
+        if (lua_getfield(L, -1, "addr") != LUA_TNIL) {
+            addrlen = lua_table_to_sockaddr(sock, L, lua_gettop(L), (struct sockaddr *)&addrs[i]);
+            if (addrlen < 0)
+                return 2;
+
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = addrlen;
+        }
+        lua_pop(L, 1);
+
+        if (lua_getfield(L, -1, "segment_size") != LUA_TNIL) {
+            uint16_t segment_size = luaL_checkinteger(L, -1);
+            struct msghdr *hdr = &msgs[i].msg_hdr;
+            struct cmsghdr *cmsg;
+
+            hdr->msg_control = ctrls + i * UDP_CMSG_SPACE;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(segment_size));
+
+            cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(segment_size));
+            memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+
+        lua_pop(L, 2);
+    }
+
+    n = sendmmsg(sock->fd, msgs, n, MSG_DONTWAIT);
+    if (n < 0)
+        return push_errno(L, errno);
+
+    lua_pushinteger(L, n);
+    return 1;
+}
+
 static int lua_getsockname(lua_State *L)
 {
     struct eco_socket *sock = luaL_checkudata(L, 1, SOCKET_MT);
@@ -506,6 +817,8 @@ static struct sock_opt optsets[] = {
     {"tcp_keepcnt", SOL_TCP, TCP_KEEPCNT, sockopt_set_int},
     {"tcp_fastopen", SOL_TCP, TCP_FASTOPEN, sockopt_set_int},
     {"tcp_nodelay", SOL_TCP, TCP_NODELAY, sockopt_set_boolean},
+    {"udp_segment", IPPROTO_UDP, UDP_SEGMENT, sockopt_set_int},
+    {"udp_gro", IPPROTO_UDP, UDP_GRO, sockopt_set_boolean},
     {"ip_add_membership", SOL_IP, IP_ADD_MEMBERSHIP, sockopt_set_ip_membership},
     {"ip_drop_membership", SOL_IP, IP_DROP_MEMBERSHIP, sockopt_set_ip_membership},
     {"ipv6_v6only", SOL_IPV6, IPV6_V6ONLY, sockopt_set_boolean},
@@ -597,6 +910,10 @@ static int lua_sock_close(lua_State *L)
 {
     struct eco_socket *sock = luaL_checkudata(L, 1, SOCKET_MT);
 
+    free(sock->scratch);
+    sock->scratch = NULL;
+    sock->scratch_size = 0;
+
     if (sock->fd < 0)
         return 0;
 
@@ -622,6 +939,8 @@ static const luaL_Reg methods[] = {
     {"connect", lua_connect},
     {"sendto", lua_sendto},
     {"recvfrom", lua_recvfrom},
+    {"recvmmsg", lua_recvmmsg},
+    {"sendmmsg", lua_sendmmsg},
     {"getsockname", lua_getsockname},
     {"getpeername", lua_getpeername},
     {"setoption", lua_setoption},
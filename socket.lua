@@ -89,18 +89,23 @@ function methods:getfd()
 end
 
 --- Close the socket.
+--
+-- Data left in the write buffer (see @{eco.writer:setbuf}) is sent as
+-- far as the socket takes it without blocking, the rest is discarded.
+-- Call @{socket:flush} first to wait until all of it is sent.
 -- @function socket:close
 function methods:close()
+    -- Before close(2): a background flush must not reach a reused fd
+    if self.wr then
+        self.wr:cancel(true)
+    end
+
     self.sock:close()
 
     if self.rd then
         self.rd:cancel()
     end
 
-    if self.wr then
-        self.wr:cancel()
-    end
-
     if self.io then
         self.io:cancel()
     end
@@ -118,6 +123,10 @@ end
 -- Supported option names: `reuseaddr`, `reuseport`, `keepalive`,
 -- `broadcast`, `mark`, `bindtodevice`, `tcp_nodelay`, `tcp_keepidle`, ...
 --
+-- On UDP sockets, `udp_segment` (integer) sets the segment size used to
+-- split every send (GSO), and `udp_gro` (boolean) lets the kernel coalesce
+-- received datagrams (GRO), see @{socket:recvfrom}.
+--
 -- @function socket:setoption
 -- @tparam string name Option name.
 -- @tparam any value Option value.
@@ -192,6 +201,8 @@ function methods:listen(backlog)
         return nil, err
     end
 
+    self.io = self.io or eco.io(self:getfd())
+
     return self
 end
 
@@ -241,14 +252,29 @@ local metatable = {
 -- @treturn[2] nil On failure.
 -- @treturn[2] string Error message.
 function methods:accept(timeout)
-    local ok, err = self.rd:wait(timeout)
-    if not ok then
-        return nil, err
-    end
+    local sock, perr
 
-    local sock, perr = self.sock:accept()
-    if not sock then
-        return nil, perr
+    -- Take queued connections right away, only wait once the backlog is empty
+    while true do
+        sock, perr = self.sock:accept()
+        if sock then
+            break
+        end
+
+        if sock == nil then
+            return nil, perr
+        end
+
+        -- Completed by the kernel with io_uring, a readiness wait otherwise
+        local fd, err = self.io:accept(timeout)
+        if not fd then
+            return nil, err
+        end
+
+        sock, perr = self.sock:accept(fd)
+        if sock then
+            break
+        end
     end
 
     local fd = sock:getfd()
@@ -292,6 +318,63 @@ function methods:write(data, timeout)
     return self:send(data, timeout)
 end
 
+--- Send several strings with one vectored write.
+--
+-- Avoids concatenating `data` into a new string first.
+--
+-- @function socket:sendv
+-- @tparam {string,...} data Strings to send, in order.
+-- @tparam[opt] number timeout Timeout in seconds
+-- @treturn integer Total bytes sent.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function methods:sendv(data, timeout)
+    local mutex = self.mutex
+
+    mutex:lock()
+    local sent, err = self.wr:writev(data, timeout)
+    mutex:unlock()
+
+    if sent then
+        return sent
+    else
+        return nil, err
+    end
+end
+
+--- Buffer small sends in userspace.
+--
+-- See @{eco.writer:setbuf}. @{socket:close} only sends what the socket
+-- takes without blocking, call @{socket:flush} first to send all of it.
+--
+-- @function socket:setbuf
+-- @tparam integer size Buffer size in bytes, 0 disables buffering.
+-- @tparam[opt=false] boolean auto_flush Flush at the end of each loop iteration.
+function methods:setbuf(size, auto_flush)
+    self.wr:setbuf(size, auto_flush)
+end
+
+--- Send the data buffered by @{socket:setbuf}.
+--
+-- @function socket:flush
+-- @tparam[opt] number timeout Timeout in seconds
+-- @treturn integer Number of bytes flushed.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function methods:flush(timeout)
+    local mutex = self.mutex
+
+    mutex:lock()
+    local sent, err = self.wr:flush(timeout)
+    mutex:unlock()
+
+    if sent then
+        return sent
+    else
+        return nil, err
+    end
+end
+
 --- Send a datagram.
 --
 -- For UDP/RAW sockets, destination address is provided after `data`.
@@ -403,6 +486,12 @@ function methods:readuntil(needle, timeout)
     return self.rd:readuntil(needle, timeout)
 end
 
+--- See @{eco.reader:read_into}
+-- @function socket:read_into
+function methods:read_into(buf, n, timeout)
+    return self.rd:read_into(buf, n, timeout)
+end
+
 --- Receive a datagram.
 --
 -- @function socket:recvfrom
@@ -410,6 +499,8 @@ end
 -- @tparam[opt] number timeout Timeout in seconds.
 -- @treturn string data
 -- @treturn table Peer address.
+-- @treturn[opt] integer Segment size, when `udp_gro` is enabled and the
+-- kernel coalesced several datagrams into `data`.
 -- @treturn[2] nil On failure.
 -- @treturn[2] string Error message.
 function methods:recvfrom(n, timeout)
@@ -421,6 +512,88 @@ function methods:recvfrom(n, timeout)
     return self.sock:recvfrom(n)
 end
 
+--- Receive a burst of datagrams with one `recvmmsg(2)` call.
+--
+-- Waits until at least one datagram is available, then returns all the
+-- queued ones, up to `max`.
+--
+-- @function socket:recvfrom_batch
+-- @tparam[opt=64] integer max Max datagrams to receive, up to 1024.
+-- @tparam[opt] number timeout Timeout in seconds.
+-- @tparam[opt=4096] integer size Max bytes per datagram, up to 65535.
+-- @treturn table Array of `{ data = string, addr = table }`. `truncated`
+-- is set on entries longer than `size`. `addr` is absent for unnamed
+-- peers. `segment_size` is set on entries coalesced by `udp_gro`.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+-- @usage
+-- for _, msg in ipairs(sock:recvfrom_batch(64)) do
+--     print(msg.addr.ipaddr, msg.addr.port, msg.data)
+-- end
+function methods:recvfrom_batch(max, timeout, size)
+    local ok, err = self.rd:wait(timeout)
+    if not ok then
+        return nil, err
+    end
+
+    return self.sock:recvmmsg(max or 64, size or 4096)
+end
+
+--- Send several datagrams with `sendmmsg(2)`.
+--
+-- Entries have the same shape as the ones from @{socket:recvfrom_batch},
+-- so a received batch can be sent back as is. `addr` may be omitted on
+-- connected sockets. An entry with `segment_size` is split by the kernel
+-- into datagrams of that size (UDP GSO).
+--
+-- @function socket:sendto_batch
+-- @tparam table list Array of `{ data = string, addr = table }`.
+-- @tparam[opt=5.0] number timeout Timeout in seconds for each wait.
+-- @treturn integer Number of datagrams sent.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+-- @treturn[2] integer Number of datagrams sent before the failure.
+-- @usage
+-- sock:sendto_batch({
+--     { data = 'a', addr = { ipaddr = '127.0.0.1', port = 8000 } },
+--     { data = 'b', addr = { ipaddr = '127.0.0.1', port = 8001 } }
+-- })
+function methods:sendto_batch(list, timeout)
+    local mutex = self.mutex
+    local total = #list
+    local sent = 0
+
+    timeout = timeout or 5.0
+
+    mutex:lock()
+
+    while sent < total do
+        local ok, err = self.wr:wait(timeout)
+        if not ok then
+            mutex:unlock()
+            return nil, err, sent
+        end
+
+        -- a malformed entry raises from C, don't leave the socket locked
+        local ok, n, err = pcall(self.sock.sendmmsg, self.sock, list, sent + 1)
+        if not ok then
+            mutex:unlock()
+            error(n, 2)
+        end
+
+        if not n then
+            mutex:unlock()
+            return nil, err, sent
+        end
+
+        sent = sent + n
+    end
+
+    mutex:unlock()
+
+    return sent
+end
+
 --- End of `socket` class section.
 -- @section end
 
@@ -71,6 +71,61 @@ function cli_methods:write(data, timeout)
     return self:send(data, timeout)
 end
 
+--- Send several strings in order.
+--
+-- @function ssl_client:sendv
+-- @tparam {string,...} data Strings to send.
+-- @tparam[opt] number timeout Timeout in seconds
+-- @treturn integer Total bytes sent.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function cli_methods:sendv(data, timeout)
+    local mutex = self.mutex
+
+    mutex:lock()
+    local sent, err = self.wr:writev(data, timeout)
+    mutex:unlock()
+
+    if sent then
+        return sent
+    else
+        return nil, err
+    end
+end
+
+--- Buffer small sends in userspace.
+--
+-- See @{eco.writer:setbuf}. @{ssl_client:close} only sends what the socket
+-- takes without blocking, call @{ssl_client:flush} first to send all of it.
+--
+-- @function ssl_client:setbuf
+-- @tparam integer size Buffer size in bytes, 0 disables buffering.
+-- @tparam[opt=false] boolean auto_flush Flush at the end of each loop iteration.
+function cli_methods:setbuf(size, auto_flush)
+    self.wr:setbuf(size, auto_flush)
+end
+
+--- Send the data buffered by @{ssl_client:setbuf}.
+--
+-- @function ssl_client:flush
+-- @tparam[opt] number timeout Timeout in seconds
+-- @treturn integer Number of bytes flushed.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function cli_methods:flush(timeout)
+    local mutex = self.mutex
+
+    mutex:lock()
+    local sent, err = self.wr:flush(timeout)
+    mutex:unlock()
+
+    if sent then
+        return sent
+    else
+        return nil, err
+    end
+end
+
 --- Send file content.
 --
 -- This is a convenience helper that reads from a file and sends exactly
@@ -144,6 +199,12 @@ function cli_methods:readuntil(format, timeout)
     return self.rd:readuntil(format, timeout)
 end
 
+--- See @{eco.reader:read_into}
+-- @function ssl_client:read_into
+function cli_methods:read_into(buf, n, timeout)
+    return self.rd:read_into(buf, n, timeout)
+end
+
 --- Close the TLS connection.
 --
 -- Frees internal TLS state and closes the underlying TCP socket.
@@ -158,7 +219,7 @@ function cli_methods:close()
 
     -- Wake any blocked read/write coroutine before releasing ssl session.
     self.rd:cancel()
-    self.wr:cancel()
+    self.wr:cancel(true)
 
     self.sock:close()
     self.ssock:free()
@@ -8,6 +8,7 @@
 #define _GNU_SOURCE
 
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/sysinfo.h>
 #include <sys/prctl.h>
 #include <sys/wait.h>
@@ -225,12 +226,29 @@ static int lua_kill(lua_State *L)
     return 1;
 }
 
+/*
+ * Children are reaped by the main loop with waitpid(-1), a thread started
+ * by eco.threads would never see its own exit.
+ */
+static int check_main_thread(lua_State *L)
+{
+    if (syscall(SYS_gettid) == getpid())
+        return 0;
+
+    lua_pushnil(L);
+    lua_pushliteral(L, "child processes can't be created in eco.threads");
+    return 2;
+}
+
 static int lua_exec(lua_State *L)
 {
     int opipe[2] = { -1 };
     int epipe[2] = { -1 };
     pid_t pid;
 
+    if (check_main_thread(L))
+        return 2;
+
     if (pipe2(opipe, O_CLOEXEC | O_NONBLOCK) < 0
         || pipe2(epipe, O_CLOEXEC | O_NONBLOCK) < 0) {
         push_errno(L, errno);
@@ -368,6 +386,8 @@ err:
 /**
  * Fork the current process.
  *
+ * Only the main loop can fork, it fails in threads started by `eco.threads`.
+ *
  * @function fork
  * @treturn integer Child pid in parent, 0 in child.
  * @treturn[2] nil On error.
@@ -377,6 +397,9 @@ static int lua_fork(lua_State *L)
 {
     pid_t pid;
 
+    if (check_main_thread(L))
+        return 2;
+
     pid = fork();
     if (pid < 0)
         return push_errno(L, errno);
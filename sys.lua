@@ -214,6 +214,9 @@ local exec_metatable = {
 -- Spawns a new process and returns a process handle object.
 -- The returned object provides methods to wait for process exit, read stdout/stderr.
 --
+-- Exits are reaped by the main loop, so it fails in threads started by
+-- @{eco.threads}.
+--
 -- There are two supported calling forms:
 --
 -- 1. Argument list form:
@@ -395,6 +398,7 @@ end
 --
 -- This function forks a child process and runs the given function `f`
 -- inside it. The child process will be terminated if the parent dies (`PR_SET_PDEATHSIG = SIGKILL`).
+-- Like @{exec}, it fails in threads started by @{eco.threads}.
 --
 -- @function spawn
 -- @tparam function f Lua function to run in the child process.
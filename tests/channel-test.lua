@@ -2,7 +2,6 @@
 
 local eco = require 'eco'
 local channel = require 'eco.channel'
-local ifile = require 'eco.internal.file'
 local test = require 'test'
 
 -- Constructor argument checks and capacity normalization.
@@ -207,29 +206,172 @@ test.run_case_sync('channel close wakes blocked senders', function()
     end, 2.0, 0.01)
 end)
 
--- GC regression: channel wrapper and internal cond objects should be collectable.
+-- GC regression: channels should be collectable once dropped.
 do
     local weak = setmetatable({}, { __mode = 'v' })
-    local send_fd, recv_fd
 
-    test.run_case_sync('channel gc closes cond eventfd', function()
+    test.run_case_sync('channel gc', function()
         local ch = channel.new(2)
-        send_fd = ch.cond_send.efd
-        recv_fd = ch.cond_recv.efd
-
+        assert(ch:send('buffered'))
         weak.ch = ch
     end)
 
     test.full_gc()
 
     assert(weak.ch == nil, 'channel should be collectible after references are dropped')
+end
 
-    local ok, err = ifile.close(send_fd)
-    assert(ok == nil and type(err) == 'string', 'channel cond_send eventfd should be closed by GC path')
+-- nil is reserved for "closed": sending it raises. FIFO order holds
+-- across the ring wrap.
+test.run_case_async('channel rejects nil and keeps ring order', function()
+    local ch = channel.new(3)
 
-    ok, err = ifile.close(recv_fd)
-    assert(ok == nil and type(err) == 'string', 'channel cond_recv eventfd should be closed by GC path')
-end
+    test.expect_error_contains(function()
+        ch:send(nil)
+    end, "can't send nil", 'send should reject nil')
+
+    test.expect_error_contains(function()
+        ch:send_many({ 1, nil, 3 })
+    end, "can't send nil", 'send_many should reject holes')
+
+    assert(ch:length() == 0, 'a rejected batch should send nothing')
+
+    for round = 1, 4 do
+        assert(ch:send(round))
+        assert(ch:send(false))
+        assert(ch:length() == 2)
+
+        local v, err = ch:recv(0.1)
+        assert(v == round and err == nil)
+
+        v, err = ch:recv(0.1)
+        assert(v == false and err == nil)
+        assert(ch:length() == 0)
+    end
+
+    assert(ch:capacity() == 3)
+end)
+
+-- Parked senders refill the ring in order when a receiver frees a slot.
+test.run_case_sync('channel parked senders keep order', function()
+    local ch = channel.new(1)
+    local got = {}
+
+    assert(ch:send(1))
+
+    for i = 2, 5 do
+        eco.run(function()
+            assert(ch:send(i, 1.0))
+        end)
+    end
+
+    eco.run(function()
+        eco.sleep(0.02)
+
+        for _ = 1, 5 do
+            got[#got + 1] = ch:recv(1.0)
+        end
+    end)
+
+    test.wait_until('all values received', function()
+        return #got == 5
+    end, 2.0, 0.01)
+
+    for i = 1, 5 do
+        assert(got[i] == i, 'values should be received in send order')
+    end
+end)
+
+test.run_case_sync('channel send_many and recv_many', function()
+    local ch = channel.new(4)
+    local received = {}
+    local sent, send_err
+
+    eco.run(function()
+        local values = {}
+        for i = 1, 10 do
+            values[i] = i
+        end
+
+        sent, send_err = ch:send_many(values, 1.0)
+        ch:close()
+    end)
+
+    eco.run(function()
+        while true do
+            local t, n = ch:recv_many(3, 1.0)
+            if not t then
+                assert(n == nil, n)
+                break
+            end
+
+            assert(n >= 1 and n <= 3)
+
+            for i = 1, n do
+                received[#received + 1] = t[i]
+            end
+        end
+    end)
+
+    test.wait_until('batch transfer completes', function()
+        return ch:length() == 0 and #received == 10
+    end, 2.0, 0.01)
+
+    assert(sent == 10 and send_err == nil)
+
+    for i = 1, 10 do
+        assert(received[i] == i)
+    end
+
+    local full = channel.new(2)
+    local n, err = full:send_many({ 'a', 'b', 'c' }, 0.05)
+    assert(n == 2 and err == 'timeout', 'send_many should report partial progress on timeout')
+
+    local t
+    t, err = channel.new(1):recv_many(nil, 0.03)
+    assert(t == nil and err == 'timeout')
+end)
+
+test.run_case_sync('channel select', function()
+    local ch1, ch2 = channel.new(1), channel.new(1)
+    local results = {}
+
+    assert(ch2:send('ready'))
+
+    local i, v = channel.select({ ch1, ch2 }, 0.1)
+    assert(i == 2 and v == 'ready', 'select should pick the ready channel')
+
+    i, v = channel.select({ ch1, ch2 }, 0.03)
+    assert(i == nil and v == 'timeout')
+
+    eco.run(function()
+        for _ = 1, 2 do
+            local idx, val = channel.select({ ch1, ch2 }, 1.0)
+            results[#results + 1] = { idx, val }
+        end
+    end)
+
+    eco.run(function()
+        eco.sleep(0.02)
+        assert(ch1:send('one'))
+        eco.sleep(0.02)
+        ch2:close()
+    end)
+
+    test.wait_until('select wakes on each channel', function()
+        return #results == 2
+    end, 2.0, 0.01)
+
+    assert(results[1][1] == 1 and results[1][2] == 'one')
+    assert(results[2][1] == 2 and results[2][2] == nil, 'closed channel should select as nil')
+
+    -- The handoff went to the selecting coroutine only: nothing left behind.
+    assert(ch1:length() == 0)
+
+    test.expect_error_contains(function()
+        channel.select({ ch1, 'x' })
+    end, 'bad item #2 in list', 'select should reject non-channels')
+end)
 
 -- Memory leak regression: equal channel bursts should show plateau behavior.
 do
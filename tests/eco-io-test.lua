@@ -166,6 +166,49 @@ test.run_case_sync('reader formats and readuntil', function()
     end)
 end)
 
+test.run_case_sync('reader buffer size options and growth', function()
+    local s1, s2 = make_pair()
+
+    test.expect_error_contains(function()
+        eco.reader(s1:getfd(), { bufsize = 100 })
+    end, 'bufsize must be at least 512', 'reader should reject a tiny buffer')
+
+    local rd = eco.reader(s1:getfd(), { bufsize = 512, maxbufsize = 8192 })
+    local lines = {}
+
+    for i = 1, 200 do
+        lines[i] = string.rep(string.char(97 + i % 26), i * 37 % 3000) .. '\n'
+    end
+
+    local payload = table.concat(lines) .. string.rep('q', 5000) .. '--end--tail'
+
+    eco.run(function()
+        assert(s2:send(payload))
+    end)
+
+    for i = 1, #lines do
+        local line, err = rd:read('L', 1.0)
+        assert(line == lines[i], err or 'line mismatch at ' .. i)
+    end
+
+    local parts = {}
+
+    while true do
+        local data, found = rd:readuntil('--end--', 1.0)
+        assert(data, found)
+        parts[#parts + 1] = data
+
+        if found then
+            break
+        end
+    end
+
+    assert(table.concat(parts) == string.rep('q', 5000))
+    assert(rd:readfull(4, 1.0) == 'tail')
+
+    close_pair(s1, s2)
+end)
+
 test.run_case_sync('reader readfull exact and closed', function()
     local s1, s2 = make_pair()
     local rd = eco.reader(s1:getfd())
@@ -414,6 +457,379 @@ test.run_case_sync('writer timeout under backpressure', function()
     end)
 end)
 
+test.run_case_sync('writer writev table, varargs and partial writes', function()
+    local s1, s2 = make_pair()
+    local wr = eco.writer(s1:getfd())
+    local rd = eco.reader(s2:getfd())
+
+    assert(wr:writev({ 'ab', '', 'cd', 12 }) == 6)
+    assert(rd:readfull(6, 1.0) == 'abcd12')
+
+    assert(wr:writev('x', 'y', 'z') == 3)
+    assert(rd:readfull(3, 1.0) == 'xyz')
+
+    assert(wr:writev({}) == 0)
+
+    test.expect_error_contains(function()
+        wr:writev({ 'a', {} })
+    end, 'bad buffer #2', 'writev should reject non-string buffers')
+
+    -- Several buffers larger than the socket buffer force partial writes
+    -- in the middle of a buffer and resumption across boundaries.
+    s1:setoption('sndbuf', 4096)
+
+    local parts = {}
+    for i = 1, 8 do
+        parts[i] = string.rep(string.char(96 + i), 64 * 1024 + i)
+    end
+
+    local expected = table.concat(parts)
+    local received
+
+    eco.run(function()
+        received = rd:readfull(#expected, 5.0)
+    end)
+
+    local n, err = wr:writev(parts, 5.0)
+    assert(n == #expected, err)
+
+    test.wait_until('writev payload received', function()
+        return received ~= nil
+    end, 5.0)
+
+    assert(received == expected, 'writev should preserve data order across partial writes')
+
+    close_pair(s1, s2)
+end)
+
+test.run_case_sync('writer writev timeout under backpressure', function()
+    local s1, s2 = make_pair()
+    local wr = eco.writer(s1:getfd())
+
+    s1:setoption('sndbuf', 4096)
+
+    local big = string.rep('x', 1024 * 1024)
+    local n, err = wr:writev({ big, big }, 0.05)
+    assert(n == nil and err == 'timeout', 'writer:writev should timeout under backpressure')
+
+    close_pair(s1, s2)
+end)
+
+test.run_case_sync('writer buffered writes and flush', function()
+    local s1, s2 = make_pair()
+    local wr = eco.writer(s1:getfd())
+    local rd = eco.reader(s2:getfd())
+
+    wr:setbuf(16)
+
+    assert(wr:write('abc') == 3)
+    assert(wr:write('defg') == 4)
+
+    local data, err = rd:read(16, 0.05)
+    assert(data == nil and err == 'timeout', 'buffered data should not be sent before flush')
+
+    assert(wr:flush() == 7)
+    assert(rd:readfull(7, 1.0) == 'abcdefg')
+    assert(wr:flush() == 0)
+
+    -- Overflowing the buffer writes it out together with the new data
+    assert(wr:write(string.rep('x', 10)) == 10)
+    assert(wr:write(string.rep('y', 10)) == 10)
+    assert(rd:readfull(20, 1.0) == string.rep('x', 10) .. string.rep('y', 10))
+
+    assert(wr:write('z') == 1)
+
+    test.expect_error_contains(function()
+        wr:setbuf(0)
+    end, 'smaller than the pending data', 'setbuf should not drop pending data')
+
+    assert(wr:writev({ '1', '2' }) == 2)
+    assert(rd:readfull(3, 1.0) == 'z12', 'writev should send the buffer first')
+
+    wr:setbuf(0)
+    assert(wr:write('plain') == 5)
+    assert(rd:readfull(5, 1.0) == 'plain')
+
+    close_pair(s1, s2)
+end)
+
+test.run_case_sync('writer auto flush', function()
+    local s1, s2 = make_pair()
+    local wr = eco.writer(s1:getfd())
+    local rd = eco.reader(s2:getfd())
+
+    wr:setbuf(1024, true)
+
+    for _ = 1, 3 do
+        assert(wr:write('ab') == 2)
+    end
+
+    assert(rd:readfull(6, 1.0) == 'ababab', 'buffer should be flushed at the end of the loop iteration')
+
+    -- A small socket buffer leaves part of each auto flush for EPOLLOUT
+    s1:setoption('sndbuf', 4096)
+    wr:setbuf(64 * 1024, true)
+
+    local chunks = {}
+    for i = 1, 256 do
+        chunks[i] = string.rep(string.char(65 + i % 26), 1000)
+    end
+
+    local expected = table.concat(chunks)
+    local received
+
+    eco.run(function()
+        received = rd:readfull(#expected, 5.0)
+    end)
+
+    for i = 1, #chunks do
+        assert(wr:write(chunks[i]) == #chunks[i])
+
+        if i % 16 == 0 then
+            eco.sleep(0)
+        end
+    end
+
+    test.wait_until('auto flushed payload received', function()
+        return received ~= nil
+    end, 5.0)
+
+    assert(received == expected, 'auto flush should preserve data order')
+
+    close_pair(s1, s2)
+end)
+
+test.run_case_sync('socket close drops the pending auto flush', function()
+    local a1, a2 = make_pair()
+    local fd = a1:getfd()
+
+    a1.wr:setbuf(1024, true)
+    assert(a1.wr:write('SECRET-FOR-A') == 12)
+
+    close_pair(a1, a2)
+
+    -- The fd numbers are reused right away, the flush must not follow them
+    local b1, b2 = make_pair()
+    assert(b1:getfd() == fd or b2:getfd() == fd)
+
+    local data, err = b2:recv(64, 0.05)
+    assert(data == nil and err == 'timeout', 'data buffered for a closed socket leaked: ' .. tostring(data))
+
+    data, err = b1:recv(64, 0.05)
+    assert(data == nil and err == 'timeout', 'data buffered for a closed socket leaked: ' .. tostring(data))
+
+    close_pair(b1, b2)
+end)
+
+test.run_case_sync('socket close sends the buffered tail', function()
+    local s1, s2 = make_pair()
+
+    s1:setbuf(1024)
+    assert(s1:send('head'))
+    assert(s1:send('tail'))
+    s1:close()
+
+    assert(s2:recvfull(8, 1.0) == 'headtail', 'close should write out the buffer')
+    local data, err = s2:recv(1, 1.0)
+    assert(data == nil and err == 'closed', 'unexpected result after the tail: ' .. tostring(err))
+
+    s1, s2 = make_pair()
+    s1:setbuf(1024, true)
+    assert(s1:send('auto'))
+    s1:close()
+
+    assert(s2:recvfull(4, 1.0) == 'auto', 'close should write out a pending auto flush')
+
+    s2:close()
+end)
+
+test.run_case_sync('buffer slicing and read_into/write', function()
+    local buf = eco.buffer(16, 'hello')
+
+    assert(#buf == 5 and buf:len() == 5 and buf:cap() == 16)
+    assert(buf:tostring() == 'hello' and buf:tostring(2, -2) == 'ell')
+
+    buf:append(' world'):append(eco.buffer(4, '!!'))
+    assert(buf:tostring() == 'hello world!!')
+
+    test.expect_error_contains(function()
+        buf:append('too long')
+    end, 'not enough space', 'append should not overflow the buffer')
+
+    local s = buf:slice(7, 11)
+    assert(s:tostring() == 'world' and s:cap() == 5)
+    assert(buf:slice(20):len() == 0)
+
+    -- slices share memory and outlive their parent
+    buf:consume(6)
+    assert(buf:tostring() == 'world!!')
+    buf = nil
+    test.full_gc()
+    assert(s:tostring() == '!orld')
+
+    local s1, s2 = make_pair()
+    local rd = eco.reader(s1:getfd())
+    local wr = eco.writer(s2:getfd())
+
+    assert(wr:write(eco.buffer(8, 'abcdefgh'):slice(3, 6)) == 4)
+    assert(wr:writev({ 'x', eco.buffer(2, 'yz') }) == 3)
+
+    local dst = eco.buffer(64)
+    local n = assert(rd:read_into(dst, 2, 1.0))
+    assert(n == 2 and dst:tostring() == 'cd')
+
+    while dst:len() < 7 do
+        assert(rd:read_into(dst, nil, 1.0))
+    end
+
+    assert(dst:tostring() == 'cdefxyz')
+
+    -- served from the reader buffer first
+    assert(wr:write('line\nrest'))
+    assert(rd:read('l', 1.0) == 'line')
+    dst:consume()
+    assert(rd:read_into(dst, nil, 1.0) == 4 and dst:tostring() == 'rest')
+
+    local n2, err = rd:read_into(dst, nil, 0.05)
+    assert(n2 == nil and err == 'timeout')
+
+    -- the space a pending read goes to can't move under it
+    local got
+    dst:consume()
+    eco.run(function()
+        got = rd:read_into(dst, nil, 1.0)
+    end)
+    eco.sleep(0.01)
+
+    test.expect_error_contains(function()
+        dst:append('xx')
+    end, 'reading into this buffer', 'append should raise while read_into is pending')
+
+    test.expect_error_contains(function()
+        dst:consume()
+    end, 'reading into this buffer', 'consume should raise while read_into is pending')
+
+    assert(wr:write('late'))
+    test.wait_until('pending read_into', function() return got == 4 end, 1.0)
+    assert(dst:tostring() == 'late')
+    dst:append('!')
+    assert(dst:tostring() == 'late!')
+
+    s2:close()
+    n2, err = rd:read_into(dst)
+    assert(n2 == nil and err == 'closed')
+
+    close_pair(s1, s2)
+
+    -- the data a pending write sends can't move under it, through any view
+    s1, s2 = make_pair()
+    rd = eco.reader(s1:getfd())
+    wr = eco.writer(s2:getfd())
+
+    local big = eco.buffer(4 * 1024 * 1024, string.rep('w', 4 * 1024 * 1024))
+    local half = big:slice(1, 2 * 1024 * 1024)
+    local sent
+
+    eco.run(function()
+        sent = wr:writev({ 'head', half })
+    end)
+    eco.sleep(0.01)
+
+    assert(sent == nil, 'the write should be pending')
+
+    test.expect_error_contains(function()
+        big:consume(1)
+    end, 'writing this buffer', 'consume should raise while a write of a slice is pending')
+
+    test.expect_error_contains(function()
+        half:consume(1)
+    end, 'writing this buffer', 'consume should raise while a write is pending')
+
+    local got = 0
+    while got < 4 + #half do
+        got = got + #assert(rd:read(65536, 1.0))
+    end
+
+    test.wait_until('pending write', function() return sent == 4 + #half end, 1.0)
+    big:consume(1)
+
+    close_pair(s1, s2)
+end)
+
+test.run_case_sync('splice relays between sockets', function()
+    local a1, a2 = make_pair()
+    local b1, b2 = make_pair()
+    local rd = eco.reader(b2:getfd())
+
+    -- bounded length, the rest stays in the source
+    assert(a1:send('hello world'))
+    assert(eco.splice(a2:getfd(), b1:getfd(), { len = 5 }) == 5)
+    assert(rd:readfull(5, 1.0) == 'hello')
+
+    local n, err, moved_before, stranded = eco.splice(a2:getfd(), b1:getfd(), { len = 100, timeout = 0.05 })
+    assert(n == nil and err == 'timeout', 'splice should time out waiting for more input')
+    assert(moved_before == 6 and stranded == 0, 'splice should report the bytes moved before the timeout')
+    assert(rd:readfull(6, 1.0) == ' world', 'data moved before the timeout is delivered')
+
+    -- bulk relay until EOF, larger than the socket buffers
+    local payload = string.rep('0123456789abcdef', 64 * 1024)
+    local moved, received
+
+    eco.run(function()
+        moved = eco.splice(a2:getfd(), b1:getfd(), { timeout = 5.0 })
+    end)
+
+    eco.run(function()
+        received = rd:readfull(#payload, 5.0)
+    end)
+
+    assert(a1:send(payload, 5.0))
+    a1:close()
+
+    test.wait_until('splice finished', function()
+        return moved ~= nil and received ~= nil
+    end, 5.0)
+
+    assert(moved == #payload, 'splice should stop at EOF')
+    assert(received == payload, 'splice should preserve data')
+
+    close_pair(a1, a2)
+    close_pair(b1, b2)
+end)
+
+test.run_case_sync('splice releases its pipe on return', function()
+    local file = require 'eco.file'
+
+    local function nfds()
+        local n = 0
+
+        for _ in file.dir('/proc/self/fd') do
+            n = n + 1
+        end
+
+        return n
+    end
+
+    local a1, a2 = make_pair()
+    local b1, b2 = make_pair()
+    local rd = eco.reader(b2:getfd())
+    local base = nfds()
+
+    for _ = 1, 300 do
+        assert(a1:send('x'))
+        assert(eco.splice(a2:getfd(), b1:getfd(), { len = 1 }) == 1)
+        assert(rd:readfull(1, 1.0) == 'x')
+    end
+
+    local n, err = eco.splice(a2:getfd(), b1:getfd(), { len = 1, timeout = 0.01 })
+    assert(n == nil and err == 'timeout')
+
+    assert(nfds() == base, 'splice should not hold fds after returning')
+
+    close_pair(a1, a2)
+    close_pair(b1, b2)
+end)
+
 test.run_case_sync('writer cancel blocked write', function()
     local s1, s2 = make_pair()
     local wr = eco.writer(s1:getfd())
@@ -450,7 +866,12 @@ test.run_case_sync('io event rechecks writer after read resume', function()
     local write_done = false
 
     eco.run(function()
-        local data, err = rd:readfull(1, 1.0)
+        -- A readiness wait: with io_uring a read would be a request of its own
+        local ok, err = rd:wait(1.0)
+        assert(ok, err)
+
+        local data
+        data, err = rd:readfull(1, 1.0)
         assert(data == 'x', err)
 
         wr:cancel()
@@ -679,6 +1100,120 @@ test.run_case_sync('regular file write fairness before loop', function()
     end)
 end)
 
+-- With io_uring these reads, writes and accepts wait as kernel requests
+test.run_case_sync('socket requests across timeout, cancel and close', function()
+    local s1, s2 = make_pair()
+    local rd = eco.reader(s1:getfd())
+    local wr = eco.writer(s2:getfd())
+    local done = false
+
+    eco.run(function()
+        local data, err = rd:read(16, 0.03)
+        assert(data == nil and err == 'timeout', 'read should time out without data')
+
+        -- The timed out request must not have eaten the data sent later
+        data, err = rd:readfull(5, 1.0)
+        assert(data == 'hello', err)
+
+        data, err = rd:read(16, 1.0)
+        assert(data == nil and err == 'canceled', 'reader:cancel should cancel a pending read')
+
+        data, err = rd:read(16, 1.0)
+        assert(data == 'after', err)
+
+        data, err = rd:read(16, 1.0)
+        assert(data == nil and (err == 'eof' or err == 'closed'), err)
+
+        done = true
+    end)
+
+    eco.run(function()
+        eco.sleep(0.05)
+        assert(wr:write('hello') == 5)
+
+        eco.sleep(0.02)
+        rd:cancel()
+
+        eco.sleep(0.02)
+        assert(wr:write('after') == 5)
+
+        eco.sleep(0.02)
+        s2:close()
+    end)
+
+    test.wait_until('socket requests complete', function()
+        return done
+    end, 3.0)
+
+    close_pair(s1, s2)
+
+    s1, s2 = make_pair()
+    rd = eco.reader(s2:getfd())
+    wr = eco.writer(s1:getfd())
+    s1:setoption('sndbuf', 4096)
+
+    local big = string.rep('0123456789abcdef', 64 * 1024)
+    local received
+
+    eco.run(function()
+        received = rd:readfull(#big + 6, 5.0)
+    end)
+
+    local n, err = wr:write(big, 5.0)
+    assert(n == #big, err)
+
+    n, err = wr:writev({ 'ab', 'cd', 'ef' }, 5.0)
+    assert(n == 6, err)
+
+    test.wait_until('large write received', function()
+        return received ~= nil
+    end, 5.0)
+
+    assert(received == big .. 'abcdef', 'large write should arrive intact and in order')
+
+    close_pair(s1, s2)
+
+    local server, serr = socket.listen_tcp('127.0.0.1', 0, { reuseaddr = true })
+    assert(server, serr)
+
+    local port = server:getsockname().port
+    local accepted = 0
+
+    eco.run(function()
+        for _ = 1, 3 do
+            local cli, peer = server:accept(2.0)
+            assert(cli, peer)
+            assert(peer.ipaddr == '127.0.0.1')
+
+            local line, rerr = cli:recv('l', 1.0)
+            assert(line == 'hi', rerr)
+
+            cli:close()
+            accepted = accepted + 1
+        end
+
+        local cli, aerr = server:accept(0.03)
+        assert(cli == nil and aerr == 'timeout', 'accept should time out without connections')
+
+        cli, aerr = server:accept(1.0)
+        assert(cli == nil and aerr == 'canceled', 'socket:close should cancel a pending accept')
+    end)
+
+    for _ = 1, 3 do
+        local cli, cerr = socket.connect_tcp('127.0.0.1', port)
+        assert(cli, cerr)
+        assert(cli:send('hi\n') == 3)
+        cli:close()
+    end
+
+    test.wait_until('connections accepted', function()
+        return accepted == 3
+    end, 3.0)
+
+    eco.sleep(0.1)
+    server:close()
+end)
+
 print('eco io/reader/writer tests passed')
 
 -- GC regression for io/reader/writer objects and their worker coroutine.
@@ -1,5 +1,6 @@
 #!/usr/bin/env eco
 
+local socket = require 'eco.socket'
 local eco = require 'eco'
 local test = require 'test'
 
@@ -38,6 +39,13 @@ assert(math.type(eco.VERSION_PATCH) == 'integer')
 assert(math.type(eco.READ) == 'integer')
 assert(math.type(eco.WRITE) == 'integer')
 assert(eco.READ ~= eco.WRITE)
+assert(eco.backend() == 'epoll' or eco.backend() == 'io_uring')
+
+-- Runs against an io_uring build set ECO_BACKEND, a silent fallback fails
+if os.getenv('ECO_BACKEND') then
+    assert(eco.backend() == os.getenv('ECO_BACKEND'),
+           'expected backend ' .. os.getenv('ECO_BACKEND') .. ', got ' .. eco.backend())
+end
 
 -- set_panic_hook argument validation and normal setup.
 test.expect_error(function()
@@ -165,6 +173,381 @@ end, 2.0)
 
 assert(panic_calls == 0, 'panic hook should not be called in normal flow')
 
+-- Cached loop time.
+do
+    local t1 = eco.now()
+    assert(type(t1) == 'number' and t1 > 0, 'eco.now() should return monotonic seconds')
+
+    local until_at = os.clock() + 0.02
+    while os.clock() < until_at do end
+
+    local t2 = eco.update_time()
+    assert(t2 >= t1 + 0.01, 'eco.update_time() should refresh the cached time')
+    assert(eco.now() == t2, 'eco.now() should return the refreshed time')
+
+    -- The loop time has millisecond resolution, compare whole milliseconds
+    eco.sleep(0.02)
+    assert(math.floor((eco.now() - t2) * 1000 + 0.5) >= 20, 'loop time should advance across a sleep')
+end
+
+-- Ready queue must preserve FIFO order while it grows and wraps around.
+do
+    local cos = {}
+    local order = {}
+    local n = 1000
+
+    for i = 1, n do
+        eco.run(function()
+            cos[i] = coroutine.running()
+            coroutine.yield()
+            order[#order + 1] = i
+        end)
+    end
+
+    for round = 1, 2 do
+        local first = round == 1 and 1 or n // 2 + 1
+        local last = round == 1 and n // 2 or n
+
+        for i = first, last do
+            eco._resume(cos[i])
+        end
+
+        test.wait_until('ready queue round drained', function()
+            return #order == last
+        end, 2.0)
+    end
+
+    for i = 1, n do
+        assert(order[i] == i, string.format('ready queue resumed %s at position %d', tostring(order[i]), i))
+    end
+end
+
+-- Timers must fire in deadline order, and in FIFO order for equal deadlines.
+do
+    local order = {}
+    local delays = { 0.05, 0.01, 0.03, 0.02, 0.04, 0.01, 0.03 }
+
+    for i, delay in ipairs(delays) do
+        eco.run(function()
+            eco.sleep(delay)
+            order[#order + 1] = i
+        end)
+    end
+
+    test.wait_until('timer ordering completed', function()
+        return #order == #delays
+    end, 2.0)
+
+    local expected = { 2, 6, 4, 3, 7, 5, 1 }
+
+    for i = 1, #expected do
+        assert(order[i] == expected[i],
+               string.format('timer %d fired out of order: got %s', i, table.concat(order, ',')))
+    end
+end
+
+-- Canceling many pending timers out of order must keep the remaining ones intact.
+do
+    local pairs_ = {}
+    local ios = {}
+    local fired = 0
+
+    for i = 1, 64 do
+        local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        assert(s1 and s2, s2)
+
+        pairs_[i] = { s1, s2 }
+        ios[i] = eco.io(s1:getfd())
+
+        eco.run(function()
+            ios[i]:wait(eco.READ, 10 + i)
+        end)
+    end
+
+    for i = 64, 1, -2 do
+        ios[i]:cancel()
+    end
+
+    eco.run(function()
+        eco.sleep(0.01)
+        fired = fired + 1
+    end)
+
+    test.wait_until('timer survives heap removals', function()
+        return fired == 1
+    end, 2.0)
+
+    for i = 63, 1, -2 do
+        ios[i]:cancel()
+    end
+
+    test.wait_until('canceled waiters drained', function()
+        return eco.count() <= 1
+    end, 2.0)
+
+    for _, p in ipairs(pairs_) do
+        p[1]:close()
+        p[2]:close()
+    end
+end
+
+-- select: one coroutine parked on channels, wait queues, I/O and timers.
+do
+    local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    assert(s1 and s2, s2)
+
+    local io = eco.io(s1:getfd())
+    local ch = eco.channel(1)
+    local q = eco.waitq()
+    local results = {}
+
+    assert(ch:send('x'))
+
+    local i, v = eco.select({ q, ch, 5.0 })
+    assert(i == 2 and v == 'x', 'a ready item should be returned at once')
+
+    i, v = eco.select({ q, ch, 0.02 }, 1.0)
+    assert(i == 3 and v == true, 'a number item should fire as a timer')
+
+    i, v = eco.select({ q, 1.0 }, 0.02)
+    assert(i == nil and v == 'timeout')
+    assert(q:count() == 0, 'timed out select should leave the wait queue')
+
+    eco.run(function()
+        for _ = 1, 3 do
+            local idx, val = eco.select({ ch, q, io }, 1.0)
+            results[#results + 1] = { idx, val }
+        end
+    end)
+
+    eco.run(function()
+        eco.sleep(0.01)
+        assert(q:signal('sig'))
+        eco.sleep(0.01)
+        assert(ch:send('ch'))
+        eco.sleep(0.01)
+        assert(s2:send('io'))
+    end)
+
+    test.wait_until('select wakes on every kind of source', function()
+        return #results == 3
+    end, 2.0)
+
+    assert(results[1][1] == 2 and results[1][2] == 'sig')
+    assert(results[2][1] == 1 and results[2][2] == 'ch')
+    assert(results[3][1] == 3 and results[3][2] == true)
+
+    assert(q:count() == 0 and ch:length() == 0, 'select should unlink from the other sources')
+    assert(s1:recv(2, 0.1) == 'io', 'select should not consume data')
+
+    i, v = nil, nil
+
+    eco.run(function()
+        i, v = eco.select({ q, io })
+    end)
+
+    eco.sleep(0.01)
+    io:cancel()
+
+    test.wait_until('canceled select returns', function()
+        return v ~= nil
+    end, 2.0)
+
+    assert(i == nil and v == 'canceled')
+
+    test.expect_error_contains(function()
+        eco.select({ q, {} })
+    end, 'bad item #2', 'select should reject unknown items')
+
+    s1:close()
+    s2:close()
+end
+
+-- Loop options: small event batches and busy polling must not lose events.
+do
+    test.expect_error_contains(function()
+        eco.set_loop_options({ max_events = 0 })
+    end, 'range', 'set_loop_options should reject zero max_events')
+
+    test.expect_error_contains(function()
+        eco.set_loop_options({ busy_poll = -1 })
+    end, 'range', 'set_loop_options should reject negative busy_poll')
+
+    test.expect_error(function()
+        eco.set_loop_options(1)
+    end, 'set_loop_options should reject non-table')
+
+    eco.set_loop_options({ max_events = 4, busy_poll = 200 })
+
+    local socks = {}
+    local woken = 0
+    local n = 32
+
+    for i = 1, n do
+        local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        assert(s1 and s2, s2)
+
+        socks[i] = { s1, s2 }
+
+        eco.run(function()
+            local io = eco.io(s1:getfd())
+            assert(io:wait(eco.READ, 2.0), 'read readiness lost with a small event batch')
+            woken = woken + 1
+        end)
+    end
+
+    eco.sleep(0.01)
+
+    for i = 1, n do
+        assert(socks[i][2]:send('x'))
+    end
+
+    test.wait_until('all readers woken', function()
+        return woken == n
+    end, 2.0)
+
+    eco.set_loop_options({ max_events = 1024, busy_poll = 0 })
+
+    for _, p in ipairs(socks) do
+        p[1]:close()
+        p[2]:close()
+    end
+end
+
+-- Edge-triggered mode: round trips keep working without re-arming, and a
+-- wait on an fd that still has unread data returns at once.
+do
+    eco.set_loop_options({ edge_triggered = true })
+
+    local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    assert(s1 and s2, s2)
+
+    local rounds = 0
+
+    eco.run(function()
+        for _ = 1, 100 do
+            local data = assert(s2:recv(1, 2.0))
+            assert(s2:send(data))
+        end
+    end)
+
+    for _ = 1, 100 do
+        assert(s1:send('x'))
+        assert(s1:recv(1, 2.0) == 'x', 'edge-triggered round trip failed')
+        rounds = rounds + 1
+    end
+
+    assert(rounds == 100)
+
+    local io = eco.io(s2:getfd())
+
+    assert(s1:send('yy'))
+    assert(io:wait(eco.READ, 1.0))
+    assert(io:wait(eco.READ, 0.1), 'undrained fd should still be readable')
+    assert(s2:recv(2, 1.0) == 'yy')
+
+    eco.set_loop_options({ edge_triggered = false })
+
+    s1:close()
+    s2:close()
+end
+
+-- The fd table grows past its initial size, and released slots are reused.
+do
+    local socks = {}
+    local woken = 0
+
+    for i = 1, 160 do
+        local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+        assert(s1 and s2, s2)
+        socks[i] = { s1, s2 }
+    end
+
+    for i = #socks - 3, #socks do
+        eco.run(function()
+            assert(socks[i][1]:recv(1, 2.0) == 'x', 'high fd lost its waiter')
+            woken = woken + 1
+        end)
+    end
+
+    eco.sleep(0.01)
+
+    for i = #socks - 3, #socks do
+        assert(socks[i][2]:send('x'))
+    end
+
+    test.wait_until('high fd waiters woken', function()
+        return woken == 4
+    end, 2.0)
+
+    for _, p in ipairs(socks) do
+        p[1]:close()
+        p[2]:close()
+    end
+
+    local s1, s2 = socket.socketpair(socket.AF_UNIX, socket.SOCK_STREAM)
+    assert(s1 and s2, s2)
+    assert(s2:send('y'))
+    assert(s1:recv(1, 1.0) == 'y', 'reused fd slot should work')
+    s1:close()
+    s2:close()
+end
+
+-- Coroutine pool: finished coroutines are recycled by eco.run when enabled.
+do
+    local st = eco.co_pool_stats()
+    assert(st.size == 0 and st.count == 0, 'coroutine pool should be disabled by default')
+
+    test.expect_error_contains(function()
+        eco.set_co_pool_size(-1)
+    end, 'range', 'set_co_pool_size should reject negative size')
+
+    eco.set_co_pool_size(4)
+
+    local results = {}
+
+    for i = 1, 8 do
+        eco.run(function(a, b)
+            results[#results + 1] = a + b
+        end, i, i)
+    end
+
+    for i = 1, 8 do
+        assert(results[i] == i * 2, 'pooled coroutine received wrong arguments')
+    end
+
+    st = eco.co_pool_stats()
+    assert(st.size == 4)
+    assert(st.count == 1, 'sequential runs should keep reusing one coroutine')
+    assert(st.hits == 7 and st.misses == 1,
+           string.format('unexpected pool stats: hits=%d misses=%d', st.hits, st.misses))
+
+    local suspended = 0
+    local wake = {}
+
+    for i = 1, 6 do
+        eco.run(function()
+            wake[i] = coroutine.running()
+            suspended = suspended + 1
+            coroutine.yield()
+            suspended = suspended - 1
+        end)
+    end
+
+    for i = 1, 6 do
+        eco._resume(wake[i])
+    end
+
+    test.wait_until('pooled coroutines finished', function()
+        return suspended == 0
+    end, 2.0)
+
+    assert(eco.co_pool_stats().count == 4, 'pool should be capped at its size')
+
+    eco.set_co_pool_size(0)
+    assert(eco.co_pool_stats().count == 0, 'shrinking pool should release coroutines')
+end
+
 -- GC regression: completed coroutines should not be kept alive by scheduler state.
 local weak_co = setmetatable({}, { __mode = 'v' })
 local weak_ready = false
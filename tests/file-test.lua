@@ -227,6 +227,208 @@ test.run_case_async('file object read/write/lseek/stat', function()
 
 	f:close()
 	f:close()
+
+	data, err = f:read(1, 0.2)
+	assert(data == nil and err == 'Bad file descriptor', 'read after close should fail')
+
+	n, err = f:write('x', 0.2)
+	assert(n == nil and err == 'Bad file descriptor', 'write after close should fail')
+end)
+
+test.run_case_async('file offset follows reads served ahead', function()
+	local p = root .. '/ahead.txt'
+	local f = assert(file.open(p, file.O_RDWR | file.O_CREAT | file.O_TRUNC, file.S_IRUSR | file.S_IWUSR))
+
+	assert(f:write('0123456789abcdef') == 16)
+	assert(f:lseek(0, file.SEEK_SET) == 0)
+
+	assert(f:read(4) == '0123')
+	assert(f:lseek(0, file.SEEK_CUR) == 4, 'lseek should see the offset of the reader')
+
+	assert(f:read(2) == '45')
+	assert(f:write('WXYZ') == 4, 'write should land right after the data read')
+	assert(f:read(4) == 'abcd')
+
+	f:close()
+
+	assert(file.readfile(p) == '012345WXYZabcdef')
+end)
+
+test.run_case_async('regular file I/O on the worker pool', function()
+	local p = root .. '/pool.txt'
+	local big = string.rep('0123456789abcdef', 65536)
+
+	local f = assert(file.open(p, file.O_RDWR | file.O_CREAT | file.O_TRUNC, file.S_IRUSR | file.S_IWUSR))
+	assert(f.rd == nil and f.wr == nil, 'regular files should not be polled')
+
+	local ticks, stop = 0, false
+
+	eco.run(function()
+		while not stop do
+			ticks = ticks + 1
+			eco.sleep(0)
+		end
+	end)
+
+	assert(f:write(big) == #big)
+	assert(f:fsync())
+
+	local st, err = f:stat()
+	assert(st and st.size == #big, err)
+
+	st, err = file.stat(p)
+	assert(st and st.type == 'REG' and st.size == #big, err)
+
+	assert(f:lseek(0, file.SEEK_SET) == 0)
+
+	local data
+	data, err = f:read('a')
+	assert(data == big, err)
+
+	data, err = f:read(1)
+	assert(data == nil and err == 'eof')
+
+	f:close()
+
+	assert(ticks > 0, 'other coroutines should run while the pool works')
+	stop = true
+
+	assert(file.readfile(p) == big)
+
+	local ok
+	ok, err = file.readfile(root .. '/no-such-file')
+	assert(ok == nil and err)
+
+	ok, err = file.stat(root .. '/no-such-file')
+	assert(ok == nil and err)
+
+	local done = 0
+
+	for i = 1, 8 do
+		eco.run(function()
+			assert(file.writefile(root .. '/pool-' .. i, tostring(i)))
+			done = done + 1
+		end)
+	end
+
+	test.wait_until('concurrent writefile', function() return done == 8 end, 2.0)
+
+	for i = 1, 8 do
+		assert(file.readfile(root .. '/pool-' .. i) == tostring(i))
+	end
+end)
+
+test.run_case_async('regular files take one fd each', function()
+	local function nfds()
+		local n = 0
+
+		for _ in file.dir('/proc/self/fd') do
+			n = n + 1
+		end
+
+		return n
+	end
+
+	-- The pool's eventfd is created once per loop, by the first file
+	local f = assert(file.open(root .. '/fds-0', file.O_RDWR | file.O_CREAT, file.S_IRUSR | file.S_IWUSR))
+	assert(f:write('x') == 1)
+	assert(f:lseek(0, file.SEEK_SET) == 0)
+	assert(f:read(1) == 'x')
+	f:close()
+
+	local base = nfds()
+	local files = {}
+
+	for i = 1, 16 do
+		f = assert(file.open(root .. '/fds-' .. i, file.O_RDWR | file.O_CREAT | file.O_TRUNC, file.S_IRUSR | file.S_IWUSR))
+		assert(f:write(tostring(i)) == #tostring(i))
+		assert(f:lseek(0, file.SEEK_SET) == 0)
+		assert(f:read('a') == tostring(i))
+		files[i] = f
+	end
+
+	assert(nfds() == base + 16, 'a regular file should hold only its own fd')
+
+	for _, f in ipairs(files) do
+		f:close()
+	end
+
+	assert(nfds() == base, 'closing should release every fd')
+end)
+
+test.run_case_async('regular file writes on the pool', function()
+	local p = root .. '/behind.txt'
+	local chunk = string.rep('z', 1000)
+
+	local f = assert(file.open(p, file.O_WRONLY | file.O_CREAT | file.O_TRUNC, file.S_IRUSR | file.S_IWUSR))
+
+	for i = 1, 100 do
+		assert(f:write(chunk) == #chunk)
+
+		local st = assert(file.stat(p))
+		assert(st.size == i * #chunk, 'write should return once the data is written')
+	end
+
+	-- Several writers share the file's job
+	local done = 0
+
+	for _ = 1, 4 do
+		eco.run(function()
+			for _ = 1, 100 do
+				assert(f:write(chunk) == #chunk)
+			end
+			done = done + 1
+		end)
+	end
+
+	test.wait_until('concurrent writes', function() return done == 4 end, 2.0)
+
+	assert(f:flush())
+
+	local st = assert(f:stat())
+	assert(st.size == 500 * #chunk)
+
+	f:close()
+
+	-- Opened read-only, the write fails on the worker
+	f = assert(file.open(p))
+
+	local ok, err = f:write('x')
+	assert(ok == nil and err == 'Bad file descriptor', 'write should report its own failure')
+
+	st, err = f:stat()
+	assert(st and st.size == 500 * #chunk, err)
+	assert(f:flush(), 'the error should not be reported again')
+
+	f:close()
+end)
+
+test.run_case_async('regular file I/O in a forked child', function()
+	local p = root .. '/fork.txt'
+	local marker = root .. '/fork.marker'
+
+	assert(file.writefile(p, 'from parent'))
+
+	-- Its jobs and the loop's eventfd exist before the fork
+	local f = assert(file.open(p))
+	assert(f:read(4) == 'from')
+
+	local pid = assert(sys.spawn(function()
+		local st = assert(f:stat(), 'a file opened before fork should still work')
+		assert(st.size == 11)
+
+		local data = assert(file.readfile(p))
+		assert(file.writefile(marker, data))
+	end))
+
+	assert(f:read('a') == ' parent')
+	f:close()
+
+	test.wait_until('child file I/O', function()
+		return file.readfile(marker) == 'from parent'
+	end, 2.0)
+
+	sys.waitpid(pid)
 end)
 
 test.run_case_async('inotify add/wait/del', function()
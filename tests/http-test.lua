@@ -42,7 +42,7 @@ local function send_raw_http(port, payload, timeout)
     return data
 end
 
-local function start_server(port, docroot)
+local function start_server(port, docroot, workers)
     local pid, err = sys.spawn(function()
         local http = require 'eco.http.server'
 
@@ -53,6 +53,11 @@ local function start_server(port, docroot)
                 return
             end
 
+            if req.path == '/pid' then
+                con:send(tostring(sys.getpid()))
+                return
+            end
+
             if req.path == '/query' then
                 local v = req.query.a or ''
                 con:add_header('x-query-a', v)
@@ -126,7 +131,8 @@ local function start_server(port, docroot)
             docroot = docroot,
             index = 'index.html',
             gzip = false,
-            http_keepalive = 2
+            http_keepalive = 2,
+            workers = workers
         }
 
         local _, serr = http.listen('127.0.0.1', port, options, handler)
@@ -191,6 +197,36 @@ local ok, err = xpcall(function()
 
     local resp, rerr
 
+    -- workers: a second server, both of its processes end up serving the port.
+    do
+        probe = assert(socket.listen_tcp('127.0.0.1', 0, { reuseaddr = true }))
+        local wport = assert(probe:getsockname()).port
+        probe:close()
+
+        local wpid = start_server(wport, tmp_root, 2)
+        local wbase = 'http://127.0.0.1:' .. tostring(wport)
+        assert(wait_server_ready(wbase))
+
+        local pids = {}
+        local count = 0
+        local deadline = time.now() + 5.0
+
+        while count < 2 and time.now() < deadline do
+            resp, rerr = request('GET', wbase .. '/pid', nil, { timeout = 1.0 })
+            assert(resp and resp.code == 200, rerr)
+
+            if not pids[resp.body] then
+                pids[resp.body] = true
+                count = count + 1
+            end
+        end
+
+        assert(count == 2, 'requests should be spread over both workers')
+
+        -- the forked worker dies with it (PR_SET_PDEATHSIG)
+        sys.kill(wpid, sys.SIGKILL)
+    end
+
     -- client + server: query parsing and plain body.
     resp, rerr = request('GET', base .. '/query?a=hello%20eco', nil, { timeout = 1.0 })
     assert(resp and resp.code == 200, rerr)
@@ -160,12 +160,12 @@ test.run_case_async('shared semantics', function()
     tiny, err = shared.new(tiny_name, 64)
     assert(tiny, err)
 
-    ok, set_err = tiny:set('x', string.rep('z', 256))
+    ok, set_err = tiny:set('x', string.rep('z', tiny:capacity()))
     assert(ok == nil and set_err == 'no memory', 'set should return no memory when item is too large')
 
     tiny:close()
 
-    -- gc reclaim: tombstoned items should be reclaimed on the next pressured set().
+    -- gc reclaim: deleted items should free their chunk for the next set.
     local gc_name = name .. '-gc'
     local gc
     local inserted = {}
@@ -174,10 +174,13 @@ test.run_case_async('shared semantics', function()
     gc, err = shared.new(gc_name, 320)
     assert(gc, err)
 
+    assert(gc:capacity() >= 320)
+    assert(gc:free_space() == gc:capacity())
+
     while true do
         local k = 'g' .. tostring(#inserted + 1)
 
-        ok, set_err = gc:set(k, payload)
+        ok, set_err = gc:safe_set(k, payload)
         if ok then
             inserted[#inserted + 1] = k
         else
@@ -187,14 +190,145 @@ test.run_case_async('shared semantics', function()
     end
 
     assert(#inserted >= 2, 'gc reclaim test requires multiple inserted items')
+    assert(gc:free_space() == 0)
     assert(gc:del(inserted[1]) == true)
 
-    ok, set_err = gc:set(inserted[1], payload)
+    ok, set_err = gc:safe_set(inserted[1], payload)
     assert(ok == true, set_err or 'set should succeed after gc reclaim')
     assert(gc:get(inserted[1]) == payload)
 
+    -- LRU eviction: set() drops the least recently used item of the class.
+    assert(gc:get(inserted[2]) == payload)
+
+    ok, set_err = gc:set('evict', payload)
+    assert(ok == true, set_err)
+    assert(gc:get('evict') == payload)
+    assert(gc:get(inserted[2]) == payload, 'recently read key should survive')
+    assert(gc:get(inserted[3]) == nil, 'least recently used key should be evicted')
+
+    -- add() and replace().
+    ok, set_err = gc:add('evict', 'x')
+    assert(ok == nil and set_err == 'exists')
+
+    ok, set_err = gc:replace('missing', 'x')
+    assert(ok == nil and set_err == 'not found')
+
+    assert(gc:replace('evict', 'replaced'))
+    assert(gc:get('evict') == 'replaced')
+
+    assert(gc:del('evict'))
+    assert(gc:add('evict', payload))
+    assert(gc:get('evict') == payload)
+
     gc:close()
 
+    -- Mixed sizes on a small dict: pages are shared between size classes
+    -- and go back to the pool once empty.
+    local mixed_name = name .. '-mixed'
+    local mixed
+
+    mixed, err = shared.new(mixed_name, 64 * 1024)
+    assert(mixed, err)
+
+    assert(mixed:set('a', 1))
+    ok, set_err = mixed:set('b', string.rep('x', 200))
+    assert(ok == true, set_err)
+    assert(mixed:get('a') == 1 and mixed:get('b') == string.rep('x', 200))
+
+    for round = 1, 3 do
+        -- large items take page runs, evicting older ones
+        for i = 1, 10 do
+            local v = string.rep(tostring(round), 5000 + i * 1000)
+            ok, set_err = mixed:set('l' .. i, v)
+            assert(ok == true, set_err)
+            assert(mixed:get('l' .. i) == v, 'large value should be stored after evictions')
+        end
+
+        -- small items of every class take their pages back
+        for i = 1, 200 do
+            local v = string.rep('s', i % 7 * 100)
+            ok, set_err = mixed:set('s' .. i, v)
+            assert(ok == true, set_err)
+            assert(mixed:get('s' .. i) == v)
+        end
+    end
+
+    for _, k in ipairs(mixed:get_keys()) do
+        assert(mixed:del(k))
+    end
+
+    assert(mixed:free_space() == mixed:capacity(), 'empty pages should return to the pool')
+
+    -- the freed pages merge back into one run
+    local big = string.rep('B', mixed:capacity() - 1024)
+    ok, set_err = mixed:safe_set('big', big)
+    assert(ok == true, set_err)
+    assert(mixed:get('big') == big)
+
+    mixed:close()
+
+    -- Mostly small values with a few large ones: the small pages spread
+    -- all over the dict, large sets must still find contiguous pages.
+    local frag_name = name .. '-frag'
+    local frag
+
+    frag, err = shared.new(frag_name, 1024 * 1024)
+    assert(frag, err)
+
+    math.randomseed(1)
+
+    for i = 1, 20000 do
+        if i % 20 == 0 then
+            local k = 'l' .. math.random(500)
+            local v = string.rep('L', math.random(5000, 30000))
+            ok, set_err = frag:set(k, v)
+            assert(ok == true, set_err)
+            assert(frag:get(k) == v)
+        else
+            ok, set_err = frag:set('s' .. math.random(30000), string.rep('s', math.random(200)))
+            assert(ok == true, set_err)
+        end
+    end
+
+    for _, k in ipairs(frag:get_keys()) do
+        assert(frag:del(k))
+    end
+
+    assert(frag:free_space() == frag:capacity(), 'evicted pages should return to the pool')
+
+    frag:close()
+
+    -- Hash index: many keys, overwrites and deletes across index rebuilds.
+    local many_name = name .. '-many'
+    local many
+
+    many, err = shared.new(many_name, 256 * 1024)
+    assert(many, err)
+
+    for round = 1, 3 do
+        for i = 1, 2000 do
+            ok, set_err = many:set('key' .. i, i * round)
+            assert(ok, set_err)
+        end
+
+        for i = 1, 2000, 2 do
+            assert(many:del('key' .. i) == true)
+        end
+
+        for i = 1, 2000 do
+            local v = many:get('key' .. i)
+            if i % 2 == 1 then
+                assert(v == nil, 'deleted key should be gone')
+            else
+                assert(v == i * round, 'every live key should be found')
+            end
+        end
+    end
+
+    assert(#many:get_keys() == 1000)
+
+    many:close()
+
     -- Owner close should remove backing shared-memory file.
     assert(peer:set('k_after_owner_close', 'ok'))
     owner:close()
@@ -188,6 +188,126 @@ test.run_case_sync('udp sendto recvfrom timeout', function()
     end)
 end)
 
+test.run_case_sync('udp batch send and receive', function()
+    local server = assert(socket.listen_udp('127.0.0.1', 0))
+    local sinfo = assert(server:getsockname())
+    local client = assert(socket.udp())
+    local dst = { ipaddr = '127.0.0.1', port = sinfo.port }
+
+    local list = {}
+    for i = 1, 100 do
+        list[i] = { data = 'msg' .. i, addr = dst }
+    end
+
+    assert(client:sendto_batch(list) == 100)
+
+    local got = {}
+
+    while #got < 100 do
+        local msgs, err = server:recvfrom_batch(64, 1.0)
+        assert(msgs, err)
+        assert(#msgs > 0 and #msgs <= 64)
+
+        for _, m in ipairs(msgs) do
+            assert(m.addr.ipaddr == '127.0.0.1')
+            got[#got + 1] = m
+        end
+    end
+
+    for i = 1, 100 do
+        assert(got[i].data == 'msg' .. i, 'datagrams should keep their order')
+    end
+
+    -- echo a received batch back to its senders
+    assert(server:sendto_batch({ got[1], got[2] }) == 2)
+
+    local back = assert(client:recvfrom_batch(8, 1.0))
+    assert(#back == 2 and back[1].data == 'msg1' and back[2].data == 'msg2')
+    assert(back[1].addr.port == sinfo.port)
+
+    assert(client:sendto_batch({ { data = string.rep('x', 100), addr = dst } }) == 1)
+    local trunc = assert(server:recvfrom_batch(1, 1.0, 10))
+    assert(trunc[1].truncated and trunc[1].data == string.rep('x', 10))
+
+    local none, terr = server:recvfrom_batch(8, 0.03)
+    assert(none == nil and terr == 'timeout')
+
+    assert(client:sendto_batch({}) == 0)
+
+    -- a bad entry raises but must not leave the socket locked
+    test.expect_error_contains(function()
+        client:sendto_batch({ { data = 'ok', addr = dst }, { addr = dst } })
+    end, 'entry data must be a string', 'bad entry should raise')
+
+    test.expect_error_contains(function()
+        client:sendto_batch({ { data = 42, addr = dst } })
+    end, 'entry data must be a string', 'numbers should not be converted')
+
+    test.expect_error_contains(function()
+        server:recvfrom_batch(8, 0.03, 65536)
+    end, 'range', 'size should be capped')
+
+    local resent
+    eco.run(function()
+        resent = client:sendto_batch({ { data = 'after', addr = dst } }, 0.5)
+    end)
+    test.wait_until('send after bad entry', function() return resent == 1 end, 1.0)
+
+    local after = assert(server:recvfrom_batch(8, 1.0))
+    assert(after[#after].data == 'after')
+
+    server:close()
+    client:close()
+end)
+
+test.run_case_sync('udp gso and gro', function()
+    local server = assert(socket.listen_udp('127.0.0.1', 0))
+    local sinfo = assert(server:getsockname())
+    local client = assert(socket.udp())
+    local dst = { ipaddr = '127.0.0.1', port = sinfo.port }
+
+    -- GSO appeared in Linux 4.18 and GRO in 5.0
+    if not client:setoption('udp_segment', 0) or not server:setoption('udp_gro', true) then
+        print('skip udp gso and gro: not supported by the kernel')
+        server:close()
+        client:close()
+        return
+    end
+
+    local payload = string.rep('a', 100) .. string.rep('b', 100) .. string.rep('c', 50)
+
+    assert(client:sendto_batch({ { data = payload, addr = dst, segment_size = 100 } }) == 1)
+
+    local got = {}
+    local total = 0
+
+    while total < #payload do
+        local msgs, err = server:recvfrom_batch(8, 1.0, 65535)
+        assert(msgs, err)
+
+        for _, m in ipairs(msgs) do
+            local size = m.segment_size or #m.data
+            for i = 1, #m.data, size do
+                got[#got + 1] = m.data:sub(i, i + size - 1)
+            end
+            total = total + #m.data
+        end
+    end
+
+    assert(#got == 3 and got[1] == string.rep('a', 100) and got[3] == string.rep('c', 50))
+
+    assert(client:setoption('udp_segment', 100))
+    assert(client:sendto(payload, '127.0.0.1', sinfo.port))
+
+    local data, addr, size = server:recvfrom(65536, 1.0)
+    assert(data, addr)
+    assert(data:sub(1, 100) == string.rep('a', 100))
+    assert(size == nil or size == 100)
+
+    server:close()
+    client:close()
+end)
+
 test.run_case_sync('tcp listen connect accept peer io', function()
     local server, err = socket.listen_tcp('127.0.0.1', 0, { reuseaddr = true })
     assert(server, err)
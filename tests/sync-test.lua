@@ -3,7 +3,6 @@
 local eco = require 'eco'
 local sync = require 'eco.sync'
 local time = require 'eco.time'
-local ifile = require 'eco.internal.file'
 local test = require 'test'
 
 -- cond: signal data, fallback true, timeout and idempotent close.
@@ -96,6 +95,40 @@ test.run_case_sync('cond close wakes waiters', function()
            string.format('wait after close should return closed, got ok=%s err=%s', tostring(ok), tostring(err)))
 end)
 
+-- cond: waiters are woken in FIFO order, whatever their timeouts.
+test.run_case_sync('cond fifo order', function()
+    local c = assert(sync.cond())
+    local order = {}
+    local n = 8
+
+    for i = 1, n do
+        eco.run(function()
+            local v = c:wait(i % 2 == 0 and 1.0 or nil)
+            order[#order + 1] = v
+        end)
+    end
+
+    -- a timed out waiter leaves the queue
+    eco.run(function()
+        local ok, err = c:wait(0.01)
+        assert(ok == nil and err == 'timeout')
+    end)
+
+    eco.sleep(0.03)
+
+    for i = 1, n do
+        assert(c:signal(i))
+    end
+
+    assert(c:signal('nobody') == false)
+
+    test.wait_until('fifo waiters', function() return #order == n end, 1.0)
+
+    for i = 1, n do
+        assert(order[i] == i, 'waiters should be woken in arrival order')
+    end
+end)
+
 -- mutex: lock exclusion, timeout and unlock error.
 test.run_case_sync('mutex lock/unlock semantics', function()
     local m = sync.mutex()
@@ -307,22 +340,21 @@ test.run_case_sync('mutex stress counter correctness', function()
     end)
 end)
 
--- GC regression: sync wrappers should be collectible and close underlying eventfd.
+-- GC regression: sync wrappers should be collectible.
 do
     local weak = setmetatable({}, { __mode = 'v' })
-    local cfd, mfd, wfd
 
-    test.run_case_sync('sync gc closes eventfd', function()
+    test.run_case_sync('sync gc', function()
         local c = assert(sync.cond())
-        cfd = c.efd
+        c:signal()
         weak.c = c
 
         local m = sync.mutex()
-        mfd = m.cond.efd
+        assert(m:lock())
+        m:unlock()
         weak.m = m
 
         local wg = sync.waitgroup()
-        wfd = wg.cond.efd
         weak.wg = wg
     end)
 
@@ -330,16 +362,55 @@ do
 
     assert(weak.c == nil and weak.m == nil and weak.wg == nil,
            'sync objects should be collectible after references are dropped')
+end
 
-    local ok, err = ifile.close(cfd)
-    assert(ok == nil and type(err) == 'string', 'cond eventfd should be closed by GC path')
+-- Sync objects live in the scheduler: holding many of them, with waiters
+-- parked on them, opens no file descriptors.
+test.run_case_sync('sync objects hold no fds', function()
+    local file = require 'eco.file'
 
-    ok, err = ifile.close(mfd)
-    assert(ok == nil and type(err) == 'string', 'mutex cond eventfd should be closed by GC path')
+    local function nfds()
+        local n = 0
 
-    ok, err = ifile.close(wfd)
-    assert(ok == nil and type(err) == 'string', 'waitgroup cond eventfd should be closed by GC path')
-end
+        for _ in file.dir('/proc/self/fd') do
+            n = n + 1
+        end
+
+        return n
+    end
+
+    local base = nfds()
+    local objs = {}
+    local woken = 0
+
+    for i = 1, 200 do
+        local c = assert(sync.cond())
+        local m = sync.mutex()
+        local wg = sync.waitgroup()
+
+        assert(m:lock())
+        wg:add(1)
+
+        eco.run(function()
+            assert(c:wait(1.0))
+            woken = woken + 1
+        end)
+
+        objs[i] = { c = c, m = m, wg = wg }
+    end
+
+    eco.sleep(0.01)
+
+    assert(nfds() == base, 'sync objects should not open fds')
+
+    for _, o in ipairs(objs) do
+        assert(o.c:signal())
+        o.m:unlock()
+        o.wg:done()
+    end
+
+    test.wait_until('cond waiters woken', function() return woken == #objs end, 1.0)
+end)
 
 -- Memory leak regression: repeated primitive creation/usage should plateau.
 do
@@ -0,0 +1,167 @@
+#!/usr/bin/env eco
+
+local threads = require 'eco.threads'
+local test = require 'test'
+
+assert(threads.id() == 0, 'main loop should own mailbox 0')
+
+test.expect_error_contains(function()
+    threads.start(0, function() end)
+end, 'positive integer', 'start should reject a zero thread count')
+
+test.expect_error_contains(function()
+    threads.send(0, function() end)
+end, 'unsupported type', 'send should reject functions')
+
+local ok, err = threads.send(1000000, 'x')
+assert(ok == nil and err == 'no such thread', 'send to unknown id should fail')
+
+test.run_case_sync('round trip through worker mailboxes', function()
+    local workers = assert(threads.start(4, function(tag)
+        local threads = require 'eco.threads'
+
+        local sender, n, t = threads.recv(5.0)
+        assert(sender == 0)
+
+        threads.send(sender, tag, threads.id(), n * n, { t[1], t.k, nested = { t.nested[1] } })
+    end, 'worker'))
+
+    assert(#workers == 4)
+
+    local ids = {}
+
+    for i, w in ipairs(workers) do
+        assert(w:id() > 0)
+        ids[w:id()] = i
+        assert(w:send(i, { 'a', k = 1.5, nested = { true } }))
+    end
+
+    for _ = 1, #workers do
+        local sender, tag, id, sq, t = threads.recv(5.0)
+        local i = ids[sender]
+
+        assert(i, 'reply from unknown sender')
+        assert(tag == 'worker' and id == sender)
+        assert(sq == i * i and math.type(sq) == 'integer')
+        assert(t[1] == 'a' and t[2] == 1.5 and t.nested[1] == true)
+    end
+
+    for _, w in ipairs(workers) do
+        assert(w:join(5.0))
+    end
+
+    assert(threads.send(workers[1]:id(), 'x') == nil, 'exited thread mailbox should be gone')
+end)
+
+test.run_case_sync('recv timeout and nil values', function()
+    local sender, e = threads.recv(0.05)
+    assert(sender == nil and e == 'timeout')
+
+    assert(threads.send(0, nil, 'b', nil))
+
+    local res = table.pack(threads.recv(1.0))
+    assert(res.n == 4 and res[1] == 0 and res[2] == nil and res[3] == 'b' and res[4] == nil)
+end)
+
+test.run_case_sync('many producers', function()
+    local n, count = 4, 500
+
+    local workers = assert(threads.start(n, [[
+        local threads = require 'eco.threads'
+        local count = ...
+
+        for i = 1, count do
+            assert(threads.send(0, i))
+        end
+    ]], count))
+
+    local last = {}
+    local total = 0
+
+    while total < n * count do
+        local sender, i = threads.recv(5.0)
+        assert(sender, i)
+
+        assert(i == (last[sender] or 0) + 1, 'messages from one sender must keep their order')
+        last[sender] = i
+        total = total + 1
+    end
+
+    for _, w in ipairs(workers) do
+        assert(w:join(5.0))
+    end
+end)
+
+test.run_case_sync('finished workers release their loop', function()
+    local file = require 'eco.file'
+
+    -- Thread handles close their eventfds once collected
+    local function nfds()
+        local n = 0
+
+        test.full_gc()
+
+        for _ in file.dir('/proc/self/fd') do
+            n = n + 1
+        end
+
+        return n
+    end
+
+    local function round()
+        local workers = assert(threads.start(4, function()
+            local eco = require 'eco'
+
+            eco.run(function()
+                eco.sleep(0.001)
+            end)
+        end))
+
+        for _, w in ipairs(workers) do
+            assert(w:join(5.0))
+        end
+    end
+
+    round()
+
+    local base = nfds()
+
+    for _ = 1, 10 do
+        round()
+    end
+
+    assert(nfds() <= base, string.format('workers leak fds: %d -> %d', base, nfds()))
+
+    for _ = 1, 10 do
+        test.expect_error_contains(function()
+            threads.start(2, function() end, 'x', function() end)
+        end, 'unsupported type', 'start should reject arguments that cannot be copied')
+    end
+
+    assert(nfds() <= base, 'a failed start should not leave anything behind')
+end)
+
+test.run_case_sync('child processes are refused in threads', function()
+    local workers = assert(threads.start(1, function()
+        local threads = require 'eco.threads'
+        local sys = require 'eco.sys'
+
+        local p, err1 = sys.exec('true')
+        local pid, err2 = sys.spawn(function() end)
+
+        threads.send(0, p == nil and err1, pid == nil and err2)
+    end))
+
+    local sender, err1, err2 = threads.recv(5.0)
+    assert(sender == workers[1]:id())
+    assert(type(err1) == 'string' and err1:find('eco.threads', 1, true), 'exec should fail in a thread')
+    assert(type(err2) == 'string' and err2:find('eco.threads', 1, true), 'spawn should fail in a thread')
+
+    assert(workers[1]:join(5.0))
+
+    local sys = require 'eco.sys'
+    local out = sys.sh('echo main')
+    assert(out == 'main\n', 'the main loop should still run commands')
+end)
+
+print('threads tests passed')
@@ -0,0 +1,860 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Author: Jianhui Zhao <zhaojh329@gmail.com>
+ */
+
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "eco.h"
+
+#define ECO_THREAD_MT "struct eco_thread *"
+#define ECO_SBUF_MT "struct eco_sbuf *"
+
+#define SERIALIZE_MAX_DEPTH 32
+
+enum {
+    VAL_NIL,
+    VAL_FALSE,
+    VAL_TRUE,
+    VAL_INTEGER,
+    VAL_NUMBER,
+    VAL_STRING,
+    VAL_TABLE,
+    VAL_TABLE_END
+};
+
+struct eco_msg {
+    struct eco_msg *next;
+    int sender;
+    int nvals;
+    size_t len;
+    char data[];
+};
+
+/*
+ * Intrusive lock-free MPSC queue (Dmitry Vyukov's design): producers only
+ * swap the head, the single consumer owns the tail. The eventfd is only
+ * written when the consumer may be asleep, which the notified flag tracks.
+ */
+struct eco_mailbox {
+    struct eco_msg *head;
+    struct eco_msg *tail;
+    struct eco_msg stub;
+    int notified;
+    int refcount;
+    int efd;
+    int id;
+};
+
+struct eco_thread {
+    pthread_t tid;
+    struct eco_mailbox *mb;     /* owned by the registry, valid until the thread exits */
+    int id;
+    char *code;
+    size_t code_len;
+    char *args;
+    size_t args_len;
+    int nargs;
+    int exit_efd;
+    int refcount;
+    bool started;
+    bool joined;
+};
+
+static char eco_mailbox_key;
+
+/* Mailboxes indexed by id, id 0 belongs to the main loop */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct eco_mailbox **registry;
+static int registry_cap;
+static int next_id = 1;
+
+static void mailbox_push(struct eco_mailbox *mb, struct eco_msg *msg)
+{
+    struct eco_msg *prev;
+
+    __atomic_store_n(&msg->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&mb->head, msg, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+/* Return NULL when empty or while a producer is halfway through a push. */
+static struct eco_msg *mailbox_pop(struct eco_mailbox *mb)
+{
+    struct eco_msg *tail = mb->tail;
+    struct eco_msg *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &mb->stub) {
+        if (!next)
+            return NULL;
+
+        mb->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&mb->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    mailbox_push(mb, &mb->stub);
+
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next) {
+        mb->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+
+static struct eco_mailbox *mailbox_new(int id)
+{
+    struct eco_mailbox *mb = calloc(1, sizeof(struct eco_mailbox));
+
+    if (!mb)
+        return NULL;
+
+    mb->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mb->efd < 0) {
+        free(mb);
+        return NULL;
+    }
+
+    mb->head = mb->tail = &mb->stub;
+    mb->refcount = 1;
+    mb->id = id;
+
+    return mb;
+}
+
+static void mailbox_put(struct eco_mailbox *mb)
+{
+    struct eco_msg *msg;
+
+    if (__atomic_sub_fetch(&mb->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    while ((msg = mailbox_pop(mb)))
+        free(msg);
+
+    close(mb->efd);
+    free(mb);
+}
+
+static int registry_add(struct eco_mailbox *mb)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&registry_lock);
+
+    if (mb->id >= registry_cap) {
+        int cap = registry_cap ? registry_cap : 16;
+        struct eco_mailbox **tmp;
+
+        while (cap <= mb->id)
+            cap *= 2;
+
+        tmp = realloc(registry, cap * sizeof(struct eco_mailbox *));
+        if (!tmp) {
+            ret = -1;
+            goto out;
+        }
+
+        memset(tmp + registry_cap, 0, (cap - registry_cap) * sizeof(struct eco_mailbox *));
+
+        registry = tmp;
+        registry_cap = cap;
+    }
+
+    registry[mb->id] = mb;
+
+out:
+    pthread_mutex_unlock(&registry_lock);
+
+    return ret;
+}
+
+/* Drop the reference held by the registry since mailbox_new */
+static void registry_del(struct eco_mailbox *mb)
+{
+    pthread_mutex_lock(&registry_lock);
+
+    if (mb->id < registry_cap && registry[mb->id] == mb)
+        registry[mb->id] = NULL;
+
+    pthread_mutex_unlock(&registry_lock);
+
+    mailbox_put(mb);
+}
+
+static struct eco_mailbox *registry_get(int id)
+{
+    struct eco_mailbox *mb = NULL;
+
+    pthread_mutex_lock(&registry_lock);
+
+    if (id >= 0 && id < registry_cap && registry[id]) {
+        mb = registry[id];
+        __atomic_add_fetch(&mb->refcount, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&registry_lock);
+
+    return mb;
+}
+
+static int alloc_id()
+{
+    int id;
+
+    pthread_mutex_lock(&registry_lock);
+    id = next_id++;
+    pthread_mutex_unlock(&registry_lock);
+
+    return id;
+}
+
+/*
+ * Serialization buffer. It lives in a userdata so that it is freed by the
+ * GC if serializing raises an error. luaL_Buffer can't be used because
+ * tables are walked with the stack.
+ */
+struct eco_sbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static int lua_sbuf_gc(lua_State *L)
+{
+    struct eco_sbuf *b = lua_touserdata(L, 1);
+
+    free(b->data);
+    b->data = NULL;
+
+    return 0;
+}
+
+static void sbuf_grow(lua_State *L, struct eco_sbuf *b, size_t n)
+{
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 64;
+        char *data;
+
+        while (cap < b->len + n)
+            cap *= 2;
+
+        data = realloc(b->data, cap);
+        if (!data)
+            luaL_error(L, "not enough memory");
+
+        b->data = data;
+        b->cap = cap;
+    }
+}
+
+static void sbuf_add(lua_State *L, struct eco_sbuf *b, const void *p, size_t n)
+{
+    sbuf_grow(L, b, n);
+
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void sbuf_addtag(lua_State *L, struct eco_sbuf *b, char tag)
+{
+    sbuf_add(L, b, &tag, 1);
+}
+
+static void serialize_value(lua_State *L, struct eco_sbuf *b, int idx, int depth)
+{
+    idx = lua_absindex(L, idx);
+
+    switch (lua_type(L, idx)) {
+    case LUA_TNIL:
+        sbuf_addtag(L, b, VAL_NIL);
+        break;
+
+    case LUA_TBOOLEAN:
+        sbuf_addtag(L, b, lua_toboolean(L, idx) ? VAL_TRUE : VAL_FALSE);
+        break;
+
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            lua_Integer v = lua_tointeger(L, idx);
+            sbuf_addtag(L, b, VAL_INTEGER);
+            sbuf_add(L, b, &v, sizeof(v));
+        } else {
+            lua_Number v = lua_tonumber(L, idx);
+            sbuf_addtag(L, b, VAL_NUMBER);
+            sbuf_add(L, b, &v, sizeof(v));
+        }
+        break;
+
+    case LUA_TSTRING: {
+        size_t len;
+        const char *s = lua_tolstring(L, idx, &len);
+
+        sbuf_addtag(L, b, VAL_STRING);
+        sbuf_add(L, b, &len, sizeof(len));
+        sbuf_add(L, b, s, len);
+        break;
+    }
+
+    case LUA_TTABLE:
+        if (depth >= SERIALIZE_MAX_DEPTH)
+            luaL_error(L, "table nested too deep (or recursive)");
+
+        luaL_checkstack(L, 3, NULL);
+        sbuf_addtag(L, b, VAL_TABLE);
+
+        lua_pushnil(L);
+        while (lua_next(L, idx)) {
+            serialize_value(L, b, -2, depth + 1);
+            serialize_value(L, b, -1, depth + 1);
+            lua_pop(L, 1);
+        }
+
+        sbuf_addtag(L, b, VAL_TABLE_END);
+        break;
+
+    default:
+        luaL_error(L, "unsupported type '%s' for thread message", luaL_typename(L, idx));
+    }
+}
+
+/*
+ * Serialize the values in [first, last] after `headroom` bytes left to the
+ * caller, so that a message header needs no second buffer. The result is
+ * to be freed by the caller, *len doesn't count the headroom.
+ */
+static char *serialize(lua_State *L, int first, int last, size_t headroom, size_t *len)
+{
+    struct eco_sbuf *b = lua_newuserdatauv(L, sizeof(struct eco_sbuf), 0);
+    char *data;
+    int i;
+
+    memset(b, 0, sizeof(struct eco_sbuf));
+    luaL_setmetatable(L, ECO_SBUF_MT);
+
+    sbuf_grow(L, b, headroom);
+    b->len = headroom;
+
+    for (i = first; i <= last; i++)
+        serialize_value(L, b, i, 0);
+
+    /* An empty result must still be distinguishable from a failure */
+    if (!b->data)
+        sbuf_addtag(L, b, VAL_NIL);
+
+    data = b->data;
+    *len = b->len - headroom;
+
+    b->data = NULL;
+    lua_pop(L, 1);
+
+    return data;
+}
+
+static const char *deserialize_value(lua_State *L, const char *p, const char *end)
+{
+    if (p >= end)
+        return NULL;
+
+    luaL_checkstack(L, 2, NULL);
+
+    switch (*p++) {
+    case VAL_NIL:
+        lua_pushnil(L);
+        break;
+
+    case VAL_FALSE:
+        lua_pushboolean(L, false);
+        break;
+
+    case VAL_TRUE:
+        lua_pushboolean(L, true);
+        break;
+
+    case VAL_INTEGER: {
+        lua_Integer v;
+
+        memcpy(&v, p, sizeof(v));
+        lua_pushinteger(L, v);
+        p += sizeof(v);
+        break;
+    }
+
+    case VAL_NUMBER: {
+        lua_Number v;
+
+        memcpy(&v, p, sizeof(v));
+        lua_pushnumber(L, v);
+        p += sizeof(v);
+        break;
+    }
+
+    case VAL_STRING: {
+        size_t len;
+
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        lua_pushlstring(L, p, len);
+        p += len;
+        break;
+    }
+
+    case VAL_TABLE:
+        lua_newtable(L);
+
+        while (p < end && *p != VAL_TABLE_END) {
+            if (!(p = deserialize_value(L, p, end)) || !(p = deserialize_value(L, p, end)))
+                return NULL;
+            lua_rawset(L, -3);
+        }
+        p++;
+        break;
+
+    default:
+        return NULL;
+    }
+
+    return p;
+}
+
+static void deserialize(lua_State *L, const char *data, size_t len, int nvals)
+{
+    const char *end = data + len;
+    int i;
+
+    luaL_checkstack(L, nvals, NULL);
+
+    for (i = 0; i < nvals; i++) {
+        if (data)
+            data = deserialize_value(L, data, end);
+
+        /* Messages are produced by serialize(), this is only a safety net */
+        if (!data)
+            lua_pushnil(L);
+    }
+}
+
+static struct eco_mailbox *get_self_mailbox(lua_State *L)
+{
+    struct eco_mailbox *mb;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_mailbox_key);
+    mb = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    if (mb)
+        return mb;
+
+    /* Not created by eco.threads: this is the main loop */
+    mb = mailbox_new(0);
+    if (!mb)
+        luaL_error(L, "failed to create mailbox: %s", strerror(errno));
+
+    if (registry_add(mb) < 0) {
+        mailbox_put(mb);
+        luaL_error(L, "failed to register mailbox");
+    }
+
+    lua_pushlightuserdata(L, mb);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_mailbox_key);
+
+    return mb;
+}
+
+/* Unregister the mailbox of a state when it is closed */
+static int lua_mailbox_gc(lua_State *L)
+{
+    struct eco_mailbox *mb;
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &eco_mailbox_key);
+    mb = lua_touserdata(L, -1);
+
+    if (mb) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_mailbox_key);
+        registry_del(mb);
+    }
+
+    return 0;
+}
+
+static int lua_threads_id(lua_State *L)
+{
+    lua_pushinteger(L, get_self_mailbox(L)->id);
+    return 1;
+}
+
+static int lua_threads_mailbox_fd(lua_State *L)
+{
+    lua_pushinteger(L, get_self_mailbox(L)->efd);
+    return 1;
+}
+
+static int lua_threads_send(lua_State *L)
+{
+    int id = luaL_checkinteger(L, 1);
+    int sender = get_self_mailbox(L)->id;
+    int nvals = lua_gettop(L) - 1;
+    struct eco_mailbox *mb;
+    struct eco_msg *msg;
+    size_t len;
+
+    /* The values are serialized right into the message */
+    msg = (struct eco_msg *)serialize(L, 2, nvals + 1, offsetof(struct eco_msg, data), &len);
+    if (!msg)
+        return push_errno(L, ENOMEM);
+
+    mb = registry_get(id);
+    if (!mb) {
+        free(msg);
+        lua_pushnil(L);
+        lua_pushliteral(L, "no such thread");
+        return 2;
+    }
+
+    msg->sender = sender;
+    msg->nvals = nvals;
+    msg->len = len;
+
+    mailbox_push(mb, msg);
+
+    /* The counter can't overflow with one write per wakeup, ignore errors */
+    if (!__atomic_exchange_n(&mb->notified, 1, __ATOMIC_SEQ_CST))
+        eventfd_write(mb->efd, 1);
+
+    mailbox_put(mb);
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+/*
+ * Pop one message: return the sender id followed by the values, or nothing
+ * if the mailbox is empty. The caller is expected to drain the eventfd
+ * before calling it.
+ */
+static int lua_threads_recv(lua_State *L)
+{
+    struct eco_mailbox *mb = get_self_mailbox(L);
+    struct eco_msg *msg;
+    int nvals;
+
+    __atomic_store_n(&mb->notified, 0, __ATOMIC_SEQ_CST);
+
+    msg = mailbox_pop(mb);
+    if (!msg)
+        return 0;
+
+    lua_pushinteger(L, msg->sender);
+
+    deserialize(L, msg->data, msg->len, msg->nvals);
+    nvals = msg->nvals;
+
+    free(msg);
+
+    return nvals + 1;
+}
+
+static void eco_thread_put(struct eco_thread *t)
+{
+    if (__atomic_sub_fetch(&t->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    close(t->exit_efd);
+    free(t->code);
+    free(t->args);
+    free(t);
+}
+
+static int eco_thread_report(lua_State *L, const char *what)
+{
+    fprintf(stderr, "eco.threads: %s: %s\n", what, lua_tostring(L, -1));
+    return 1;
+}
+
+static void *eco_thread_main(void *arg)
+{
+    struct eco_thread *t = arg;
+    lua_State *L;
+    int eco_idx;
+
+    L = luaL_newstate();
+    if (!L) {
+        fprintf(stderr, "eco.threads: cannot create state: not enough memory\n");
+        registry_del(t->mb);
+        goto done;
+    }
+
+    luaL_openlibs(L);
+
+    lua_gc(L, LUA_GCRESTART);
+    lua_gc(L, LUA_GCGEN, 0, 0);
+
+    /* Loaded right away, so its __gc unregisters the mailbox on lua_close */
+    luaL_requiref(L, "eco.internal.threads", luaopen_eco_internal_threads, 0);
+    lua_pop(L, 1);
+
+    lua_pushlightuserdata(L, t->mb);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &eco_mailbox_key);
+
+    luaL_requiref(L, "eco", luaopen_eco, 1);
+    eco_idx = lua_absindex(L, -1);
+
+    lua_getfield(L, eco_idx, "run");
+
+    if (luaL_loadbufferx(L, t->code, t->code_len, "=thread", NULL)) {
+        eco_thread_report(L, "load");
+        goto close;
+    }
+
+    deserialize(L, t->args, t->args_len, t->nargs);
+
+    if (lua_pcall(L, t->nargs + 1, 0, 0)) {
+        eco_thread_report(L, "run");
+        goto close;
+    }
+
+    lua_getfield(L, eco_idx, "loop");
+    if (lua_pcall(L, 0, 0, 0))
+        eco_thread_report(L, "loop");
+
+close:
+    lua_close(L);
+
+done:
+    eventfd_write(t->exit_efd, 1);
+
+    eco_thread_put(t);
+
+    return NULL;
+}
+
+/*
+ * Prepare a thread running the chunk `code` (source or string.dump output)
+ * in a new state with eco loaded, passing it the remaining arguments.
+ * Everything that can fail but pthread_create is done here, the thread
+ * is started by thread:start().
+ */
+static int lua_threads_create(lua_State *L)
+{
+    size_t code_len;
+    const char *code = luaL_checklstring(L, 1, &code_len);
+    int nargs = lua_gettop(L) - 1;
+    struct eco_thread *t;
+    struct eco_thread **ud;
+    size_t args_len;
+    char *args;
+    int err;
+
+    /* Make sure the main loop got its mailbox, and thus id 0 */
+    get_self_mailbox(L);
+
+    /* Raises on values that can't be sent, before anything is allocated */
+    args = serialize(L, 2, nargs + 1, 0, &args_len);
+    if (!args)
+        return push_errno(L, ENOMEM);
+
+    t = calloc(1, sizeof(struct eco_thread));
+    if (!t) {
+        free(args);
+        return push_errno(L, ENOMEM);
+    }
+
+    t->exit_efd = -1;
+    t->args = args;
+    t->args_len = args_len;
+
+    t->code = malloc(code_len);
+    if (!t->code) {
+        err = ENOMEM;
+        goto err;
+    }
+
+    memcpy(t->code, code, code_len);
+    t->code_len = code_len;
+    t->nargs = nargs;
+
+    t->exit_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (t->exit_efd < 0) {
+        err = errno;
+        goto err;
+    }
+
+    t->id = alloc_id();
+
+    t->mb = mailbox_new(t->id);
+    if (!t->mb) {
+        err = errno;
+        goto err;
+    }
+
+    if (registry_add(t->mb) < 0) {
+        err = ENOMEM;
+        goto err;
+    }
+
+    /* The Lua object's reference, thread:start() takes one for the thread */
+    t->refcount = 1;
+
+    ud = lua_newuserdatauv(L, sizeof(struct eco_thread *), 0);
+    *ud = t;
+    luaL_setmetatable(L, ECO_THREAD_MT);
+
+    return 1;
+
+err:
+    if (t->mb)
+        mailbox_put(t->mb);
+    if (t->exit_efd >= 0)
+        close(t->exit_efd);
+    free(t->code);
+    free(t->args);
+    free(t);
+
+    return push_errno(L, err);
+}
+
+static int lua_thread_start(lua_State *L)
+{
+    struct eco_thread *t = *(struct eco_thread **)luaL_checkudata(L, 1, ECO_THREAD_MT);
+    sigset_t set, oldset;
+    int err;
+
+    if (t->started)
+        return luaL_error(L, "thread already started");
+
+    /* Signals are handled by the main loop, the new thread inherits the mask */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    __atomic_add_fetch(&t->refcount, 1, __ATOMIC_RELAXED);
+
+    err = pthread_create(&t->tid, NULL, eco_thread_main, t);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    if (err) {
+        t->refcount--;
+        return push_errno(L, err);
+    }
+
+    t->started = true;
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int lua_thread_id(lua_State *L)
+{
+    struct eco_thread *t = *(struct eco_thread **)luaL_checkudata(L, 1, ECO_THREAD_MT);
+
+    lua_pushinteger(L, t->id);
+    return 1;
+}
+
+static int lua_thread_exit_fd(lua_State *L)
+{
+    struct eco_thread *t = *(struct eco_thread **)luaL_checkudata(L, 1, ECO_THREAD_MT);
+
+    lua_pushinteger(L, t->exit_efd);
+    return 1;
+}
+
+/* Only to be called once the exit eventfd fired, so it never blocks for long */
+static int lua_thread_join(lua_State *L)
+{
+    struct eco_thread *t = *(struct eco_thread **)luaL_checkudata(L, 1, ECO_THREAD_MT);
+
+    if (t->started && !t->joined) {
+        pthread_join(t->tid, NULL);
+        t->joined = true;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static int lua_thread_gc(lua_State *L)
+{
+    struct eco_thread **ud = luaL_checkudata(L, 1, ECO_THREAD_MT);
+    struct eco_thread *t = *ud;
+
+    if (!t)
+        return 0;
+
+    *ud = NULL;
+
+    /* Never started: its mailbox is only known to the registry */
+    if (!t->started)
+        registry_del(t->mb);
+    else if (!t->joined)
+        pthread_detach(t->tid);
+
+    eco_thread_put(t);
+
+    return 0;
+}
+
+static const luaL_Reg thread_methods[] = {
+    {"start", lua_thread_start},
+    {"id", lua_thread_id},
+    {"exit_fd", lua_thread_exit_fd},
+    {"join", lua_thread_join},
+    {NULL, NULL}
+};
+
+static const luaL_Reg thread_metatable[] = {
+    {"__gc", lua_thread_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg sbuf_metatable[] = {
+    {"__gc", lua_sbuf_gc},
+    {NULL, NULL}
+};
+
+static const luaL_Reg funcs[] = {
+    {"create", lua_threads_create},
+    {"id", lua_threads_id},
+    {"mailbox_fd", lua_threads_mailbox_fd},
+    {"send", lua_threads_send},
+    {"recv", lua_threads_recv},
+    {NULL, NULL}
+};
+
+int luaopen_eco_internal_threads(lua_State *L)
+{
+    creat_metatable(L, ECO_THREAD_MT, thread_metatable, thread_methods);
+    creat_metatable(L, ECO_SBUF_MT, sbuf_metatable, NULL);
+
+    luaL_newlib(L, funcs);
+
+    /* A sentinel whose __gc unregisters this state's mailbox on lua_close */
+    lua_newuserdatauv(L, 0, 0);
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, lua_mailbox_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "__sentinel");
+
+    return 1;
+}
@@ -0,0 +1,235 @@
+-- SPDX-License-Identifier: MIT
+-- Author: Jianhui Zhao <zhaojh329@gmail.com>
+
+--- OS threads running independent event loops.
+--
+-- Each thread started by this module gets its own Lua state and its own
+-- scheduler, so a program can use more than one CPU core without forking.
+-- Nothing is shared between loops: they talk by passing messages.
+--
+-- Every loop owns a mailbox identified by an integer id. The main loop
+-- (the one started by the `eco` interpreter) is `0`. Any loop can post to
+-- any mailbox with @{threads.send} and the owner reads it with
+-- @{threads.recv}. Mailboxes are lock-free queues, the receiver is woken
+-- through an eventfd.
+--
+-- Messages may contain `nil`, booleans, numbers, strings and tables of
+-- those. Tables are copied.
+--
+-- The thread function is transferred with `string.dump`, so it can't
+-- use upvalues (except `_ENV`): require modules inside the function.
+--
+-- Signals (`SIGINT`, `SIGCHLD`) are handled by the main loop. Modules with
+-- process-wide state (e.g. `eco.log` settings) are shared by all threads.
+--
+-- Child processes are reaped by the main loop as well: `sys.exec`,
+-- `sys.sh`, `sys.spawn` and `sys.fork` fail in threads. Send a message to
+-- the main loop to have it run them instead.
+--
+-- All timeouts are expressed in seconds.
+--
+-- @module eco.threads
+
+local threads = require 'eco.internal.threads'
+local time = require 'eco.time'
+local eco = require 'eco'
+
+local M = {}
+
+local mailbox_rd
+
+local function pack_result(sender, ...)
+    if sender == nil then
+        return nil
+    end
+
+    return true, sender, ...
+end
+
+--- Thread object returned by @{threads.start}.
+-- @type thread
+local methods = {}
+
+--- Get the mailbox id of the thread.
+-- @function thread:id
+-- @treturn integer
+function methods:id()
+    return self.t:id()
+end
+
+--- Send values to the thread.
+--
+-- Same as `threads.send(thread:id(), ...)`.
+--
+-- @function thread:send
+-- @param ... Values to send.
+-- @treturn boolean true On success.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function methods:send(...)
+    return threads.send(self.t:id(), ...)
+end
+
+--- Wait for the thread to finish.
+--
+-- A thread finishes when its event loop has nothing left to do.
+--
+-- @function thread:join
+-- @tparam[opt] number timeout Timeout in seconds.
+-- @treturn boolean true On success.
+-- @treturn[2] nil On timeout.
+-- @treturn[2] string Error message.
+function methods:join(timeout)
+    if not self.joined then
+        local ok, err = self.rd:read(8, timeout)
+        if not ok then
+            return nil, err
+        end
+
+        self.t:join()
+        self.joined = true
+    end
+
+    return true
+end
+
+local metatable = {
+    __index = methods
+}
+
+--- End of `thread` class section.
+-- @section end
+
+--- Get the mailbox id of the current loop.
+--
+-- @function id
+-- @treturn integer `0` in the main loop.
+function M.id()
+    return threads.id()
+end
+
+--- Post values to the mailbox of another loop.
+--
+-- This never blocks.
+--
+-- @function send
+-- @tparam integer id Mailbox id.
+-- @param ... Values to send.
+-- @treturn boolean true On success.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+function M.send(id, ...)
+    return threads.send(id, ...)
+end
+
+--- Receive a message from the mailbox of the current loop.
+--
+-- Only one coroutine per loop may wait in this function at a time.
+--
+-- @function recv
+-- @tparam[opt] number timeout Timeout in seconds.
+-- @treturn integer Mailbox id of the sender.
+-- @return ... The values sent.
+-- @treturn[2] nil On timeout.
+-- @treturn[2] string Error message.
+-- @usage
+-- local sender, msg = threads.recv()
+function M.recv(timeout)
+    local deadline = timeout and time.now() + timeout
+
+    if not mailbox_rd then
+        mailbox_rd = eco.reader(threads.mailbox_fd())
+    end
+
+    while true do
+        local res = table.pack(pack_result(threads.recv()))
+        if res[1] then
+            return table.unpack(res, 2, res.n)
+        end
+
+        local remaining
+
+        if deadline then
+            remaining = deadline - time.now()
+            if remaining <= 0 then
+                return nil, 'timeout'
+            end
+        end
+
+        local ok, err = mailbox_rd:read(8, remaining)
+        if not ok then
+            return nil, err
+        end
+    end
+end
+
+--- Start `n` threads, each running `fn(...)` in a new event loop.
+--
+-- `fn` runs in a coroutine, like with `eco.run`, and the thread ends once
+-- its loop has nothing left to do.
+--
+-- @function start
+-- @tparam integer n Number of threads.
+-- @tparam function|string fn Thread function, or Lua source code.
+-- @param ... Arguments passed to `fn`, copied like messages.
+-- @treturn {thread,...} The started threads.
+-- @treturn[2] nil On failure.
+-- @treturn[2] string Error message.
+-- @usage
+-- local threads = require 'eco.threads'
+--
+-- local workers = threads.start(4, function(name)
+--     local threads = require 'eco.threads'
+--     local sender, n = threads.recv()
+--     threads.send(sender, name, threads.id(), n * n)
+-- end, 'worker')
+--
+-- for i, w in ipairs(workers) do
+--     w:send(i)
+-- end
+--
+-- for _ = 1, #workers do
+--     print(threads.recv())
+-- end
+function M.start(n, fn, ...)
+    assert(math.type(n) == 'integer' and n > 0, 'n must be a positive integer')
+
+    local code = fn
+
+    if type(fn) == 'function' then
+        code = string.dump(fn)
+    end
+
+    assert(type(code) == 'string', 'fn must be a function or a string')
+
+    local list = {}
+
+    -- Nothing runs until every thread could be set up
+    for i = 1, n do
+        local t, err = threads.create(code, ...)
+        if not t then
+            return nil, err
+        end
+
+        list[i] = t
+    end
+
+    for i, t in ipairs(list) do
+        local ok, err = t:start()
+        if not ok then
+            -- Those already running can't be stopped, reap them once they're done
+            for j = 1, i - 1 do
+                local w = setmetatable({ t = list[j], rd = eco.reader(list[j]:exit_fd()) }, metatable)
+                eco.run(function() w:join() end)
+            end
+
+            return nil, err
+        end
+
+        list[i] = setmetatable({ t = t, rd = eco.reader(t:exit_fd()) }, metatable)
+    end
+
+    return list
+end
+
+return M
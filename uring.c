@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Author: Jianhui Zhao <zhaojh329@gmail.com>
+ */
+
+#include "uring.h"
+
+#ifdef ECO_IO_URING
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define URING_REQUIRED_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_EXT_ARG)
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+            unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int eco_uring_init(struct eco_uring *r, unsigned entries)
+{
+    struct io_uring_params p = {};
+    size_t ring_sz;
+    void *ring;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+
+    fd = sys_io_uring_setup(entries, &p);
+    if (fd < 0)
+        return -1;
+
+    if ((p.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ring_sz)
+        ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    ring = mmap(NULL, ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(ring, ring_sz);
+        close(fd);
+        return -1;
+    }
+
+    r->fd = fd;
+    r->sq_entries = p.sq_entries;
+    r->sq_ring = r->cq_ring = ring;
+    r->sq_ring_sz = ring_sz;
+
+    r->sq_khead = ring + p.sq_off.head;
+    r->sq_ktail = ring + p.sq_off.tail;
+    r->sq_kmask = ring + p.sq_off.ring_mask;
+    r->sq_array = ring + p.sq_off.array;
+
+    r->cq_khead = ring + p.cq_off.head;
+    r->cq_ktail = ring + p.cq_off.tail;
+    r->cq_kmask = ring + p.cq_off.ring_mask;
+    r->cqes = ring + p.cq_off.cqes;
+
+    r->sq_tail = *r->sq_ktail;
+
+    return 0;
+}
+
+void eco_uring_exit(struct eco_uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_sz);
+
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_sz);
+        close(r->fd);
+    }
+
+    memset(r, 0, sizeof(*r));
+}
+
+static inline unsigned eco_uring_pending(struct eco_uring *r)
+{
+    return r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+}
+
+static int eco_uring_submit(struct eco_uring *r, unsigned min_complete,
+            unsigned flags, void *arg, size_t argsz)
+{
+    int ret;
+
+    do {
+        ret = sys_io_uring_enter(r->fd, eco_uring_pending(r), min_complete, flags, arg, argsz);
+    } while (ret < 0 && errno == EINTR && !(flags & IORING_ENTER_GETEVENTS));
+
+    return ret < 0 ? -1 : 0;
+}
+
+static struct io_uring_sqe *eco_uring_get_sqe(struct eco_uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    /* The submission queue is full: flush it without waiting */
+    if (eco_uring_pending(r) >= r->sq_entries) {
+        if (eco_uring_submit(r, 0, 0, NULL, 0) < 0)
+            return NULL;
+    }
+
+    sqe = &r->sqes[r->sq_tail & *r->sq_kmask];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+static inline void eco_uring_commit(struct eco_uring *r)
+{
+    unsigned idx = r->sq_tail & *r->sq_kmask;
+
+    r->sq_array[idx] = idx;
+    r->sq_tail++;
+
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+}
+
+int eco_uring_poll_add(struct eco_uring *r, int fd, unsigned events, void *data)
+{
+    struct io_uring_sqe *sqe = eco_uring_get_sqe(r);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uintptr_t)data;
+
+    eco_uring_commit(r);
+
+    return 0;
+}
+
+int eco_uring_poll_remove(struct eco_uring *r, void *data)
+{
+    struct io_uring_sqe *sqe = eco_uring_get_sqe(r);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)data;
+    sqe->user_data = 0;
+
+    eco_uring_commit(r);
+
+    return 0;
+}
+
+static int eco_uring_queue_rw(struct eco_uring *r, int opcode, int fd,
+            const void *addr, size_t len, unsigned msg_flags, void *data)
+{
+    struct io_uring_sqe *sqe = eco_uring_get_sqe(r);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->msg_flags = msg_flags;
+    sqe->user_data = (uintptr_t)data;
+
+    eco_uring_commit(r);
+
+    return 0;
+}
+
+int eco_uring_recv(struct eco_uring *r, int fd, void *buf, size_t len, void *data)
+{
+    return eco_uring_queue_rw(r, IORING_OP_RECV, fd, buf, len, 0, data);
+}
+
+int eco_uring_send(struct eco_uring *r, int fd, const void *buf, size_t len, void *data)
+{
+    return eco_uring_queue_rw(r, IORING_OP_SEND, fd, buf, len, MSG_NOSIGNAL, data);
+}
+
+int eco_uring_sendmsg(struct eco_uring *r, int fd, const struct msghdr *msg, void *data)
+{
+    return eco_uring_queue_rw(r, IORING_OP_SENDMSG, fd, msg, 1, MSG_NOSIGNAL, data);
+}
+
+int eco_uring_accept(struct eco_uring *r, int fd, struct sockaddr *addr,
+            socklen_t *addrlen, int flags, void *data)
+{
+    struct io_uring_sqe *sqe = eco_uring_get_sqe(r);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->addr2 = (uintptr_t)addrlen;
+    sqe->accept_flags = flags;
+    sqe->user_data = (uintptr_t)data;
+
+    eco_uring_commit(r);
+
+    return 0;
+}
+
+int eco_uring_cancel(struct eco_uring *r, void *data)
+{
+    struct io_uring_sqe *sqe = eco_uring_get_sqe(r);
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)data;
+    sqe->user_data = 0;
+
+    eco_uring_commit(r);
+
+    return 0;
+}
+
+int eco_uring_wait(struct eco_uring *r, int timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {};
+
+    if (timeout == 0)
+        return eco_uring_submit(r, 0, 0, NULL, 0);
+
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (uintptr_t)&ts;
+    }
+
+    if (eco_uring_submit(r, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg)) < 0) {
+        if (errno == ETIME)
+            return 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+int eco_uring_reap(struct eco_uring *r, struct io_uring_cqe *cqes, int max)
+{
+    unsigned head = *r->cq_khead;
+    unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (head != tail && n < max)
+        cqes[n++] = r->cqes[head++ & *r->cq_kmask];
+
+    __atomic_store_n(r->cq_khead, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: MIT */
+/*
+ * Author: Jianhui Zhao <zhaojh329@gmail.com>
+ */
+
+#ifndef __ECO_URING_H
+#define __ECO_URING_H
+
+#ifdef ECO_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <stddef.h>
+
+/*
+ * Minimal io_uring wrapper built on the raw syscalls, so no liburing
+ * dependency is needed. Only what the eco scheduler uses is provided:
+ * poll add/remove requests, socket recv/send/sendmsg/accept requests,
+ * cancellation, batched submission and waiting with a timeout.
+ */
+struct eco_uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_tail;       /* local tail, published by eco_uring_commit */
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned *sq_kmask;
+    unsigned *sq_array;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned *cq_kmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_sz;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+/* Return 0 on success, -1 with errno set if io_uring is not usable. */
+int eco_uring_init(struct eco_uring *r, unsigned entries);
+
+void eco_uring_exit(struct eco_uring *r);
+
+/* Queue a one-shot poll for `events` (POLLIN/POLLOUT...) on fd. */
+int eco_uring_poll_add(struct eco_uring *r, int fd, unsigned events, void *data);
+
+/* Queue the removal of a pending poll queued with the same data. */
+int eco_uring_poll_remove(struct eco_uring *r, void *data);
+
+/*
+ * Socket requests. The buffers must stay valid until the completion
+ * arrives, even if the request is canceled.
+ */
+int eco_uring_recv(struct eco_uring *r, int fd, void *buf, size_t len, void *data);
+
+int eco_uring_send(struct eco_uring *r, int fd, const void *buf, size_t len, void *data);
+
+int eco_uring_sendmsg(struct eco_uring *r, int fd, const struct msghdr *msg, void *data);
+
+int eco_uring_accept(struct eco_uring *r, int fd, struct sockaddr *addr,
+            socklen_t *addrlen, int flags, void *data);
+
+/* Queue the cancellation of a pending request queued with the same data. */
+int eco_uring_cancel(struct eco_uring *r, void *data);
+
+/*
+ * Submit all queued requests and wait up to timeout ms (-1 = forever)
+ * for at least one completion. Return -1 with errno set on error.
+ */
+int eco_uring_wait(struct eco_uring *r, int timeout);
+
+/* Copy out at most max completions. Return the number copied. */
+int eco_uring_reap(struct eco_uring *r, struct io_uring_cqe *cqes, int max);
+
+#endif
+
+#endif